@@ -31,11 +31,17 @@
 #include <kern/errno.h>
 #include <kern/syscall.h>
 #include <lib.h>
+#include <cpu.h>
+#include <counter.h>
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
+#include <copyinout.h>
 #include <syscall.h>
 #include <kern/wait.h> /* New include of wait macros for _exit */
+#include "opt-dumbvm.h"
+
+static struct counter syscall_count = COUNTER_INITIALIZER("syscall");
 
 /*
  * System call dispatcher.
@@ -80,6 +86,8 @@ syscall(struct trapframe *tf)
 {
 	int callno;
 	int32_t retval;
+	off_t retval64;
+	bool ret64;
 	int err;
 
 	KASSERT(curthread != NULL);
@@ -87,6 +95,7 @@ syscall(struct trapframe *tf)
 	KASSERT(curthread->t_iplhigh_count == 0);
 
 	callno = tf->tf_v0;
+	COUNTER_INC(&syscall_count);
 
 	/*
 	 * Initialize retval to 0. Many of the system calls don't
@@ -98,6 +107,7 @@ syscall(struct trapframe *tf)
 	 */
 
 	retval = 0;
+	ret64 = false;
 
 	switch (callno) {
 	    case SYS_reboot:
@@ -109,9 +119,45 @@ syscall(struct trapframe *tf)
 				     (userptr_t)tf->tf_a1);
 		    break;
 
-            /* ASST1: These implementations of read and write only work for
-             * console I/O (stdin, stdout and stderr file descriptors)
-             */
+	    /* file calls */
+
+	    case SYS_open:
+		    err = sys_open((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				   &retval);
+		    break;
+
+	    case SYS_close:
+		    err = sys_close(tf->tf_a0);
+		    break;
+
+	    case SYS_dup2:
+		    err = sys_dup2(tf->tf_a0, tf->tf_a1, &retval);
+		    break;
+
+	    case SYS_ioctl:
+		    err = sys_ioctl(tf->tf_a0, tf->tf_a1, (userptr_t)tf->tf_a2);
+		    break;
+
+	    case SYS_lseek:
+	    {
+		    /*
+		     * The 64-bit position is in the aligned pair a2/a3;
+		     * whence is on the user stack.
+		     */
+		    off_t pos;
+		    int whence;
+
+		    pos = ((off_t)tf->tf_a2 << 32) | tf->tf_a3;
+		    err = copyin((const_userptr_t)(tf->tf_sp + 16),
+				 &whence, sizeof(whence));
+		    if (err) {
+			    break;
+		    }
+		    err = sys_lseek(tf->tf_a0, pos, whence, &retval64);
+		    ret64 = true;
+		    break;
+	    }
+
             case SYS_read:
                 err = sys_read(tf->tf_a0, (userptr_t)tf->tf_a1, tf->tf_a2,
                                &retval);
@@ -148,6 +194,43 @@ syscall(struct trapframe *tf)
 			err = sys_kill((pid_t) tf->tf_a0, (int) tf->tf_a1);
 			break;
 
+#if !OPT_DUMBVM
+	    /* memory calls */
+
+	    case SYS_sbrk:
+		    err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		    break;
+
+	    case SYS_mmap:
+	    {
+		    /* fd and the 64-bit offset are on the user stack. */
+		    int fd;
+		    off_t offset;
+
+		    err = copyin((const_userptr_t)(tf->tf_sp + 16),
+				 &fd, sizeof(fd));
+		    if (err) {
+			    break;
+		    }
+		    err = copyin((const_userptr_t)(tf->tf_sp + 24),
+				 &offset, sizeof(offset));
+		    if (err) {
+			    break;
+		    }
+		    err = sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+				   tf->tf_a3, fd, offset, &retval);
+		    break;
+	    }
+
+	    case SYS_munmap:
+		    err = sys_munmap((userptr_t)tf->tf_a0, tf->tf_a1);
+		    break;
+
+	    case SYS_getrusage:
+		    err = sys_getrusage(tf->tf_a0, (userptr_t)tf->tf_a1);
+		    break;
+#endif
+
 
 	    /* Even more system calls will go here */
  
@@ -167,6 +250,12 @@ syscall(struct trapframe *tf)
 		tf->tf_v0 = err;
 		tf->tf_a3 = 1;      /* signal an error */
 	}
+	else if (ret64) {
+		/* Success, with a 64-bit value: high word in v0. */
+		tf->tf_v0 = (uint32_t)(retval64 >> 32);
+		tf->tf_v1 = (uint32_t)retval64;
+		tf->tf_a3 = 0;      /* signal no error */
+	}
 	else {
 		/* Success. */
 		tf->tf_v0 = retval;
@@ -204,7 +293,7 @@ enter_forked_process(void *data1, unsigned long unused)
 	local_tf = *(struct trapframe *)data1;
 
 	/* And free the kernel memory from the trapframe passed in */
-	kfree(data1);
+	fork_trapframe_free(data1);
 
 	/*
 	 * Advance the program counter, to avoid restarting
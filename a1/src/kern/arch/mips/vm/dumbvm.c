@@ -34,8 +34,11 @@
 #include <spinlock.h>
 #include <thread.h>
 #include <current.h>
+#include <cpu.h>
+#include <counter.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
+#include <slab.h>
 #include <vm.h>
 
 /*
@@ -48,29 +51,29 @@
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 
-/*
- * Wrap rma_stealmem in a spinlock.
- */
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+static struct counter fault_count = COUNTER_INITIALIZER("vm_fault");
+
+/* Where address spaces come from. */
+static struct kmem_cache *addrspace_cache;
 
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+	coremap_bootstrap();
+
+	addrspace_cache = kmem_cache_create("addrspace",
+					    sizeof(struct addrspace), 0,
+					    NULL, NULL);
+	if (addrspace_cache == NULL) {
+		panic("vm_bootstrap: Out of memory\n");
+	}
 }
 
 static
 paddr_t
-getppages(unsigned long npages)
+getppages(unsigned long npages, int how)
 {
-	paddr_t addr;
-
-	spinlock_acquire(&stealmem_lock);
-
-	addr = ram_stealmem(npages);
-	
-	spinlock_release(&stealmem_lock);
-	return addr;
+	return coremap_alloc(npages, how);
 }
 
 /* Allocate/free some kernel-space virtual pages */
@@ -78,7 +81,7 @@ vaddr_t
 alloc_kpages(int npages)
 {
 	paddr_t pa;
-	pa = getppages(npages);
+	pa = getppages(npages, COREMAP_KERNEL);
 	if (pa==0) {
 		return 0;
 	}
@@ -88,9 +91,8 @@ alloc_kpages(int npages)
 void 
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
-
-	(void)addr;
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	coremap_free(addr - MIPS_KSEG0);
 }
 
 void
@@ -117,6 +119,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	int spl;
 
 	faultaddress &= PAGE_FRAME;
+	COUNTER_INC(&fault_count);
 
 	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
 
@@ -202,7 +205,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 struct addrspace *
 as_create(void)
 {
-	struct addrspace *as = kmalloc(sizeof(struct addrspace));
+	struct addrspace *as = kmem_cache_alloc(addrspace_cache);
 	if (as==NULL) {
 		return NULL;
 	}
@@ -221,7 +224,16 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
-	kfree(as);
+	if (as->as_pbase1 != 0) {
+		coremap_free(as->as_pbase1);
+	}
+	if (as->as_pbase2 != 0) {
+		coremap_free(as->as_pbase2);
+	}
+	if (as->as_stackpbase != 0) {
+		coremap_free(as->as_stackpbase);
+	}
+	kmem_cache_free(addrspace_cache, as);
 }
 
 void
@@ -294,17 +306,17 @@ as_prepare_load(struct addrspace *as)
 	KASSERT(as->as_pbase2 == 0);
 	KASSERT(as->as_stackpbase == 0);
 
-	as->as_pbase1 = getppages(as->as_npages1);
+	as->as_pbase1 = getppages(as->as_npages1, COREMAP_USER);
 	if (as->as_pbase1 == 0) {
 		return ENOMEM;
 	}
 
-	as->as_pbase2 = getppages(as->as_npages2);
+	as->as_pbase2 = getppages(as->as_npages2, COREMAP_USER);
 	if (as->as_pbase2 == 0) {
 		return ENOMEM;
 	}
 
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
+	as->as_stackpbase = getppages(DUMBVM_STACKPAGES, COREMAP_USER);
 	if (as->as_stackpbase == 0) {
 		return ENOMEM;
 	}
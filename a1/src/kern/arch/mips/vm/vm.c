@@ -0,0 +1,576 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <cpu.h>
+#include <counter.h>
+#include <synch.h>
+#include <mips/tlb.h>
+#include <platform/maxcpus.h>
+#include <addrspace.h>
+#include <vm.h>
+
+/*
+ * MIPS side of the VM system: TLB management and the fault handler.
+ * The machine-independent parts (address spaces and page tables) are
+ * in kern/vm. This replaces dumbvm.c when "options dumbvm" is off.
+ *
+ * TLB replacement is FIFO: each cpu hands out slots in turn, starting
+ * over from slot 0 after a flush. Right after a flush this fills the
+ * empty slots first; once the TLB is full it evicts the entry that
+ * has been there longest. (The MIPS doesn't keep reference bits for
+ * TLB entries, so there is nothing better to go on.)
+ *
+ * TLB entries are tagged with an address space ID (the TLBHI_PID
+ * field), so switching address spaces doesn't require a flush: the
+ * old entries just stop matching, and are still there if we switch
+ * back. There are only NUM_TLBPID IDs, so each cpu hands them out
+ * separately and an address space may have a different one on each
+ * cpu (as_asids[], indexed by cpu number). When a cpu runs out, it
+ * starts a new generation: it flushes its TLB and starts over from
+ * ID 1. An address space whose ID is from an older generation gets a
+ * new one the next time it is activated. ID 0 is never handed out,
+ * so an as_asids entry of 0 means the address space has never run
+ * on that cpu.
+ *
+ * The whole ASID, as stored in as_asids[], is the generation shifted
+ * left by TLBHI_PIDSHIFT, plus the ID. (The generation wraps after
+ * 2^26 rollovers; we don't worry about that.)
+ *
+ * When the pager takes pages away, vm_tlb_shootdown_many removes
+ * their entries from the other cpus' TLBs. Each cpu that might have
+ * any of them gets one IPI carrying the whole batch (or, if there
+ * are more than TLBSHOOTDOWN_MAX, asking it to flush everything);
+ * cpus where none of the address spaces has a current-generation ID
+ * can't have any of the entries, and are skipped. The per-cpu
+ * batches and IPI tickets are kept in static arrays rather than on
+ * the (small) kernel stack, so shootdowns are serialized by
+ * shootdown_lock; lock order is as_lock, then shootdown_lock.
+ *
+ * vm_fault keeps two histograms of how long faults take, from entry
+ * until the TLB is loaded: one for faults that had to read the page
+ * from a file or from swap, and one for the rest. Bucket i counts
+ * faults that took less than 2^i microseconds; the last bucket counts
+ * everything slower. The buckets are ordinary counters, so they cost
+ * no locking, and only the ones that have been hit show up in "kc".
+ */
+
+#define ASID(gen, id)	(((gen) << TLBHI_PIDSHIFT) | (id))
+#define ASID_GEN(asid)	((asid) >> TLBHI_PIDSHIFT)
+#define ASID_ID(asid)	((asid) & (NUM_TLBPID - 1))
+
+static struct counter fault_count = COUNTER_INITIALIZER("vm_fault");
+static struct counter refill_count = COUNTER_INITIALIZER("tlb_refill");
+static struct counter flush_count = COUNTER_INITIALIZER("tlb_flush");
+static struct counter asidgen_count = COUNTER_INITIALIZER("asid_newgen");
+static struct counter shootipi_count = COUNTER_INITIALIZER("shootdown_ipi");
+static struct counter shootall_count = COUNTER_INITIALIZER("shootdown_all");
+
+/* State for vm_tlb_shootdown_many, protected by shootdown_lock. */
+static struct lock *shootdown_lock;
+static struct tlbshootdown shootdown_batch[TLBSHOOTDOWN_MAX];
+static unsigned shootdown_tickets[MAXCPUS];
+static bool shootdown_sent[MAXCPUS];
+
+#define FAULTLAT_BUCKETS	16
+
+static struct counter minorlat_count[FAULTLAT_BUCKETS] = {
+	COUNTER_INITIALIZER("flt_minor<1us"),
+	COUNTER_INITIALIZER("flt_minor<2us"),
+	COUNTER_INITIALIZER("flt_minor<4us"),
+	COUNTER_INITIALIZER("flt_minor<8us"),
+	COUNTER_INITIALIZER("flt_minor<16us"),
+	COUNTER_INITIALIZER("flt_minor<32us"),
+	COUNTER_INITIALIZER("flt_minor<64us"),
+	COUNTER_INITIALIZER("flt_minor<128us"),
+	COUNTER_INITIALIZER("flt_minor<256us"),
+	COUNTER_INITIALIZER("flt_minor<512us"),
+	COUNTER_INITIALIZER("flt_minor<1ms"),
+	COUNTER_INITIALIZER("flt_minor<2ms"),
+	COUNTER_INITIALIZER("flt_minor<4ms"),
+	COUNTER_INITIALIZER("flt_minor<8ms"),
+	COUNTER_INITIALIZER("flt_minor<16ms"),
+	COUNTER_INITIALIZER("flt_minor>=16ms"),
+};
+static struct counter majorlat_count[FAULTLAT_BUCKETS] = {
+	COUNTER_INITIALIZER("flt_major<1us"),
+	COUNTER_INITIALIZER("flt_major<2us"),
+	COUNTER_INITIALIZER("flt_major<4us"),
+	COUNTER_INITIALIZER("flt_major<8us"),
+	COUNTER_INITIALIZER("flt_major<16us"),
+	COUNTER_INITIALIZER("flt_major<32us"),
+	COUNTER_INITIALIZER("flt_major<64us"),
+	COUNTER_INITIALIZER("flt_major<128us"),
+	COUNTER_INITIALIZER("flt_major<256us"),
+	COUNTER_INITIALIZER("flt_major<512us"),
+	COUNTER_INITIALIZER("flt_major<1ms"),
+	COUNTER_INITIALIZER("flt_major<2ms"),
+	COUNTER_INITIALIZER("flt_major<4ms"),
+	COUNTER_INITIALIZER("flt_major<8ms"),
+	COUNTER_INITIALIZER("flt_major<16ms"),
+	COUNTER_INITIALIZER("flt_major>=16ms"),
+};
+
+void
+vm_bootstrap(void)
+{
+	coremap_bootstrap();
+	shootdown_lock = lock_create("shootdown");
+	if (shootdown_lock == NULL) {
+		panic("vm_bootstrap: Out of memory\n");
+	}
+	as_bootstrap();
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+
+	/*
+	 * Kernel pages can't be paged out, but user pages can: if
+	 * there's no memory, page some out and try again, for as long
+	 * as that frees anything.
+	 */
+	while ((pa = coremap_alloc(npages, COREMAP_KERNEL)) == 0) {
+		if (!page_reclaim()) {
+			return 0;
+		}
+	}
+	pageout_wakeup();
+	return PADDR_TO_KVADDR(pa);
+}
+
+void 
+free_kpages(vaddr_t addr)
+{
+	KASSERT(addr >= MIPS_KSEG0 && addr < MIPS_KSEG1);
+	coremap_free(addr - MIPS_KSEG0);
+}
+
+void
+vm_tlb_flush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	curcpu->c_tlbnext = 0;
+	COUNTER_INC(&flush_count);
+
+	/* tlb_write clobbered the current ASID; put it back. */
+	tlb_setpid(curcpu->c_asid << TLBHI_PIDSHIFT);
+
+	splx(spl);
+}
+
+int
+vm_tlb_asinit(struct addrspace *as)
+{
+	unsigned i, n;
+
+	n = cpu_count();
+	as->as_asids = kmalloc(n * sizeof(as->as_asids[0]));
+	if (as->as_asids == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<n; i++) {
+		as->as_asids[i] = 0;
+	}
+	return 0;
+}
+
+void
+vm_tlb_ascleanup(struct addrspace *as)
+{
+	/*
+	 * This cpu's TLB (or another's) may still have entries tagged
+	 * with our IDs. That's all right: an ID isn't handed out
+	 * again until the next generation, which begins by flushing.
+	 */
+	kfree(as->as_asids);
+}
+
+void
+vm_tlb_activate(struct addrspace *as)
+{
+	struct cpu *c;
+	uint32_t asid;
+	int spl;
+
+	if (as == NULL) {
+		/* Kernel only; whatever ASID is loaded will do. */
+		return;
+	}
+
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	asid = as->as_asids[c->c_number];
+	if (asid == 0 || ASID_GEN(asid) != c->c_asidgen) {
+		if (c->c_asidnext == 0 || c->c_asidnext == NUM_TLBPID) {
+			/* Out of IDs: start a new generation. */
+			c->c_asidgen++;
+			c->c_asidnext = 1;
+			COUNTER_INC(&asidgen_count);
+			vm_tlb_flush();
+		}
+		asid = ASID(c->c_asidgen, c->c_asidnext);
+		c->c_asidnext++;
+		as->as_asids[c->c_number] = asid;
+	}
+
+	c->c_asid = ASID_ID(asid);
+	tlb_setpid(c->c_asid << TLBHI_PIDSHIFT);
+
+	splx(spl);
+}
+
+/*
+ * Load a translation into the TLB. If there's already an entry for
+ * the page (e.g. a read-only one being upgraded) replace it;
+ * otherwise take the next slot.
+ */
+static
+void
+vm_tlb_load(vaddr_t vaddr, paddr_t paddr, bool writeable)
+{
+	uint32_t ehi, elo;
+	int slot, spl;
+
+	elo = paddr | TLBLO_VALID;
+	if (writeable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	spl = splhigh();
+
+	ehi = vaddr | (curcpu->c_asid << TLBHI_PIDSHIFT);
+	COUNTER_INC(&refill_count);
+
+	slot = tlb_probe(ehi, 0);
+	if (slot < 0) {
+		slot = curcpu->c_tlbnext;
+		curcpu->c_tlbnext = (slot + 1) % NUM_TLB;
+	}
+	tlb_write(ehi, elo, slot);
+
+	splx(spl);
+}
+
+/*
+ * Drop this cpu's TLB entry for VADDR in AS, if it has one. If AS
+ * has no ID of the current generation here, it can't have any
+ * entries either.
+ */
+void
+vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr)
+{
+	struct cpu *c;
+	uint32_t asid;
+	int slot, spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	asid = as->as_asids[c->c_number];
+	if (asid != 0 && ASID_GEN(asid) == c->c_asidgen) {
+		slot = tlb_probe(vaddr | (ASID_ID(asid) << TLBHI_PIDSHIFT), 0);
+		if (slot >= 0) {
+			tlb_write(TLBHI_INVALID(slot), TLBLO_INVALID(), slot);
+		}
+		/* tlb_probe clobbered the current ASID; put it back. */
+		tlb_setpid(c->c_asid << TLBHI_PIDSHIFT);
+	}
+
+	splx(spl);
+}
+
+/*
+ * Return true if cpu C might have TLB entries for AS. It can't if AS
+ * never ran there, or if its ID there is from an older generation,
+ * since each generation starts with a flush. (Reading c_asidgen
+ * unlocked can only make us say yes when we needn't.)
+ */
+static
+bool
+vm_tlb_maybe_on(struct addrspace *as, struct cpu *c)
+{
+	uint32_t asid;
+
+	asid = as->as_asids[c->c_number];
+	return asid != 0 && ASID_GEN(asid) == c->c_asidgen;
+}
+
+/*
+ * Drop the TLB entries for the N mappings TS[] on all cpus, and wait
+ * until that's done. The caller must keep the mappings from being
+ * loaded again (by holding their as_locks) and must not hold any
+ * spinlocks, since we sleep on shootdown_lock and wait for the other
+ * cpus to take an interrupt.
+ */
+void
+vm_tlb_shootdown_many(const struct tlbshootdown *ts, unsigned n)
+{
+	struct tlbshootdown *batch = shootdown_batch;
+	unsigned *tickets = shootdown_tickets;
+	bool *sent = shootdown_sent;
+	struct cpu *c;
+	unsigned i, j, ncpus;
+	int nbatch, spl;
+
+	ncpus = cpu_count();
+	KASSERT(ncpus <= MAXCPUS);
+
+	lock_acquire(shootdown_lock);
+
+	/* Stay on this cpu while deciding who is "other". */
+	spl = splhigh();
+	for (i=0; i<ncpus; i++) {
+		sent[i] = false;
+		c = cpu_get(i);
+		if (c == curcpu->c_self) {
+			if (n > TLBSHOOTDOWN_MAX) {
+				vm_tlb_flush();
+				continue;
+			}
+			for (j=0; j<n; j++) {
+				vm_tlb_invalidate(ts[j].ts_as, ts[j].ts_vaddr);
+			}
+			continue;
+		}
+
+		/* Collect the ones this cpu might have. */
+		nbatch = 0;
+		for (j=0; j<n; j++) {
+			if (!vm_tlb_maybe_on(ts[j].ts_as, c)) {
+				continue;
+			}
+			if (nbatch == TLBSHOOTDOWN_MAX) {
+				nbatch = TLBSHOOTDOWN_ALL;
+				break;
+			}
+			batch[nbatch++] = ts[j];
+		}
+		if (nbatch == 0) {
+			continue;
+		}
+		if (nbatch == TLBSHOOTDOWN_ALL) {
+			COUNTER_INC(&shootall_count);
+		}
+		COUNTER_INC(&shootipi_count);
+		tickets[i] = ipi_tlbshootdown_batch(c, batch, nbatch);
+		sent[i] = true;
+	}
+	splx(spl);
+
+	/* Now wait for them all; we take IPIs ourselves meanwhile. */
+	for (i=0; i<ncpus; i++) {
+		if (!sent[i]) {
+			continue;
+		}
+		c = cpu_get(i);
+		while (c->c_shootdown_seq == tickets[i]) {
+			/* spin */
+		}
+	}
+	lock_release(shootdown_lock);
+}
+
+void
+vm_tlb_shootdown(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+
+	ts.ts_as = as;
+	ts.ts_vaddr = vaddr;
+	vm_tlb_shootdown_many(&ts, 1);
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	vm_tlb_flush();
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	vm_tlb_invalidate(ts->ts_as, ts->ts_vaddr);
+}
+
+/*
+ * Put a fault that started at SECS1/NSECS1 in the right histogram.
+ */
+static
+void
+vm_faultlat(time_t secs1, uint32_t nsecs1, bool major)
+{
+	time_t secs2, secs;
+	uint32_t nsecs2, nsecs;
+	unsigned usecs, b;
+
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	usecs = secs > 0 ? 0xffffffff : nsecs / 1000;
+
+	for (b = 0; b < FAULTLAT_BUCKETS - 1; b++) {
+		if (usecs < (1U << b)) {
+			break;
+		}
+	}
+	if (major) {
+		COUNTER_INC(&majorlat_count[b]);
+	}
+	else {
+		COUNTER_INC(&minorlat_count[b]);
+	}
+}
+
+/*
+ * Print the fault latency histograms.
+ */
+void
+vm_printfaultstats(void)
+{
+	unsigned b;
+
+	kprintf("vm_fault: %llu faults\n",
+		(unsigned long long) counter_read(&fault_count));
+	kprintf("%-10s %12s %12s\n", "latency", "minor", "major");
+	for (b = 0; b < FAULTLAT_BUCKETS; b++) {
+		/* Skip the "flt_minor" in the counter name. */
+		kprintf("%-10s %12llu %12llu\n",
+			minorlat_count[b].ctr_name + 9,
+			(unsigned long long) counter_read(&minorlat_count[b]),
+			(unsigned long long) counter_read(&majorlat_count[b]));
+	}
+}
+
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct vm_region *vr;
+	paddr_t paddr;
+	bool writeable;
+	time_t secs;
+	uint32_t nsecs;
+	unsigned nmajor;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+	COUNTER_INC(&fault_count);
+
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
+
+	as = curthread->t_addrspace;
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably a kernel
+		 * fault early in boot. Return EFAULT so as to panic
+		 * instead of getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	if (faultaddress >= USERSPACETOP) {
+		return EFAULT;
+	}
+
+	gettime(&secs, &nsecs);
+
+	/*
+	 * Hold the address space lock until the TLB is loaded, so the
+	 * pager can't take the page away in between.
+	 */
+	lock_acquire(&as->as_lock);
+	as->as_stats.vs_tlbfaults++;
+	nmajor = as->as_stats.vs_filefaults + as->as_stats.vs_swapfaults;
+
+	vr = as_findregion(as, faultaddress);
+	if (vr == NULL) {
+		result = EFAULT;
+		goto out;
+	}
+	writeable = (vr->vr_perms & VR_WRITE) != 0;
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+		/*
+		 * Pages in writeable regions are always mapped
+		 * writeable, so this is a write to a read-only one.
+		 */
+		result = EFAULT;
+		goto out;
+	    case VM_FAULT_WRITE:
+		if (!writeable) {
+			result = EFAULT;
+			goto out;
+		}
+		break;
+	    case VM_FAULT_READ:
+		if ((vr->vr_perms & (VR_READ | VR_EXEC)) == 0) {
+			result = EFAULT;
+			goto out;
+		}
+		break;
+	    default:
+		result = EINVAL;
+		goto out;
+	}
+
+	/* Find the page, reading it in if it's new or on swap. */
+	result = as_getpage(as, vr, faultaddress, &paddr);
+	if (result) {
+		goto out;
+	}
+
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	vm_tlb_load(faultaddress, paddr, writeable);
+
+ out:
+	nmajor = as->as_stats.vs_filefaults + as->as_stats.vs_swapfaults -
+		nmajor;
+	lock_release(&as->as_lock);
+	vm_faultlat(secs, nsecs, nmajor > 0);
+	return result;
+}
@@ -39,6 +39,31 @@
  * supported, although such support could be added without undue
  * difficulty.
  *
+ * Output from threads goes into a ring buffer, cs_obuf, which the
+ * device drains a character at a time: each transmit-complete
+ * interrupt (con_start) hands it the next one. So writers only wait
+ * when the ring is full, and writing a whole buffer costs one trip
+ * through the lock rather than one per character. cs_obusy is true
+ * while the device has a character in hand; when it's false, the
+ * next writer has to get it going. Writers waiting for room are woken
+ * once the ring is half empty, not for every character sent.
+ *
+ * Polled output (in interrupt handlers, or with interrupts off) can't
+ * wait for the ring, so it empties the ring by polling first and then
+ * sends its own character, which keeps the output in order.
+ *
+ * Input collects in another ring, cs_ibuf, filled by the receive
+ * interrupt (con_input). Readers may take everything from cs_itail
+ * up to cs_iline. In raw mode (the default) every character is
+ * available as soon as it arrives, and a read returns, as it always
+ * has, at a newline or when the caller's buffer is full. In canonical
+ * mode the interrupt handler does the line
+ * editing and echoing itself: the line being typed sits between
+ * cs_iline and cs_ihead, where backspace, ^U, and ^W can still get
+ * at it, and only moves below cs_iline when it's finished with a
+ * newline (or ^D). A read then gets a whole line at a time. The mode
+ * is set with the CONIOC_SETCANON ioctl.
+ *
  * Note that nothing happens until we have a device to write to. A
  * buffer of size DELAYBUFSIZE is used to hold output that is
  * generated before this point. This means that (1) using kprintf for
@@ -51,9 +76,12 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <kern/ioctl.h>
+#include <copyinout.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -108,19 +136,111 @@ flush_delay_buf(void)
 
 //////////////////////////////////////////////////
 
+/*
+ * Room left in the output ring. One slot is always left empty, so
+ * that head == tail means the ring is empty rather than full.
+ */
+static
+unsigned
+con_ospace(struct con_softc *cs)
+{
+	return (cs->cs_otail + CONSOLE_OUTPUT_BUFFER_SIZE - cs->cs_ohead - 1)
+		% CONSOLE_OUTPUT_BUFFER_SIZE;
+}
+
+/*
+ * If the device is idle and there's output waiting, hand it the next
+ * character. Call with cs_olock held.
+ */
+static
+void
+con_ostart(struct con_softc *cs)
+{
+	int ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_olock));
+
+	if (cs->cs_obusy || cs->cs_ohead == cs->cs_otail) {
+		return;
+	}
+	ch = cs->cs_obuf[cs->cs_otail];
+	cs->cs_otail = (cs->cs_otail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	cs->cs_obusy = true;
+	cs->cs_send(cs->cs_devdata, ch);
+}
+
 /*
  * Print a character, using polling instead of interrupts to wait for
- * I/O completion.
+ * I/O completion. Whatever is in the output ring goes first.
  */
 static
 void
 putch_polled(struct con_softc *cs, int ch)
 {
+	if (spinlock_do_i_hold(&cs->cs_olock)) {
+		/* Printing from inside the console code itself (panic?) */
+		cs->cs_sendpolled(cs->cs_devdata, ch);
+		return;
+	}
+
+	spinlock_acquire(&cs->cs_olock);
+	while (cs->cs_ohead != cs->cs_otail) {
+		cs->cs_sendpolled(cs->cs_devdata, cs->cs_obuf[cs->cs_otail]);
+		cs->cs_otail = (cs->cs_otail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	}
 	cs->cs_sendpolled(cs->cs_devdata, ch);
+	wchan_wakeall(cs->cs_owchan);
+	spinlock_release(&cs->cs_olock);
 }
 
 //////////////////////////////////////////////////
 
+/*
+ * Queue LEN characters from BUF for output, waiting for room in the
+ * ring as needed, and get the device going on them. If CRLF is set,
+ * each newline goes out as CR-LF.
+ */
+static
+void
+con_oput(struct con_softc *cs, const char *buf, size_t len, bool crlf)
+{
+	size_t i, n;
+	bool sentcr;
+	char ch;
+
+	spinlock_acquire(&cs->cs_olock);
+	i = 0;
+	sentcr = false;		/* already queued the CR for buf[i] */
+	while (i < len) {
+		n = con_ospace(cs);
+		if (n == 0) {
+			/* The device must be busy, or we'd have room. */
+			KASSERT(cs->cs_obusy);
+			wchan_lock(cs->cs_owchan);
+			spinlock_release(&cs->cs_olock);
+			wchan_sleep(cs->cs_owchan);
+			spinlock_acquire(&cs->cs_olock);
+			continue;
+		}
+		for (; n > 0 && i < len; n--) {
+			ch = buf[i];
+			if (crlf && ch == '\n' && !sentcr) {
+				ch = '\r';
+				sentcr = true;
+			}
+			else {
+				i++;
+				sentcr = false;
+			}
+			cs->cs_obuf[cs->cs_ohead] = ch;
+			cs->cs_ohead = (cs->cs_ohead + 1) %
+				CONSOLE_OUTPUT_BUFFER_SIZE;
+		}
+		con_ostart(cs);
+	}
+	spinlock_release(&cs->cs_olock);
+}
+
 /*
  * Print a character, using interrupts to wait for I/O completion.
  */
@@ -128,12 +248,171 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	char c = ch;
+
+	con_oput(cs, &c, 1, false);
+}
+
+/*
+ * Echo a character typed in canonical mode. This runs in the
+ * interrupt handler, so it can't wait for room; if the output ring is
+ * full the echo is lost.
+ */
+static
+void
+con_echo(struct con_softc *cs, const char *str)
+{
+	spinlock_acquire(&cs->cs_olock);
+	for (; *str != 0 && con_ospace(cs) > 0; str++) {
+		cs->cs_obuf[cs->cs_ohead] = *str;
+		cs->cs_ohead = (cs->cs_ohead + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	}
+	con_ostart(cs);
+	spinlock_release(&cs->cs_olock);
+}
+
+/*
+ * Room left in the input ring. As with the output ring, one slot is
+ * always left empty.
+ */
+static
+unsigned
+con_ispace(struct con_softc *cs)
+{
+	return (cs->cs_itail + CONSOLE_INPUT_BUFFER_SIZE - cs->cs_ihead - 1)
+		% CONSOLE_INPUT_BUFFER_SIZE;
+}
+
+/*
+ * Take back the last character of the line being edited. Call with
+ * cs_ilock held, and only if there is one.
+ */
+static
+void
+con_unput(struct con_softc *cs)
+{
+	KASSERT(cs->cs_ihead != cs->cs_iline);
+	cs->cs_ihead = (cs->cs_ihead + CONSOLE_INPUT_BUFFER_SIZE - 1)
+		% CONSOLE_INPUT_BUFFER_SIZE;
+	con_echo(cs, "\b \b");
+}
+
+/*
+ * Last character of the line being edited, or -1 if it's empty.
+ */
+static
+int
+con_lastch(struct con_softc *cs)
+{
+	if (cs->cs_ihead == cs->cs_iline) {
+		return -1;
+	}
+	return (unsigned char)
+		cs->cs_ibuf[(cs->cs_ihead + CONSOLE_INPUT_BUFFER_SIZE - 1)
+			    % CONSOLE_INPUT_BUFFER_SIZE];
+}
+
+/*
+ * Canonical-mode handling of one input character. Call with cs_ilock
+ * held. The editing keys are the same ones kgets understands.
+ */
+static
+void
+con_canon(struct con_softc *cs, int ch)
+{
+	char echo[2];
+
+	switch (ch) {
+	    case '\r':
+	    case '\n':
+		/*
+		 * Typing always leaves room for the newline; only raw
+		 * input from before a mode switch can fill the ring.
+		 */
+		if (con_ispace(cs) == 0) {
+			con_echo(cs, "\a");
+			break;
+		}
+		cs->cs_ibuf[cs->cs_ihead] = '\n';
+		cs->cs_ihead = (cs->cs_ihead + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+		cs->cs_iline = cs->cs_ihead;
+		con_echo(cs, "\r\n");
+		wchan_wakeall(cs->cs_iwchan);
+		break;
+
+	    case 4:
+		/* ^D - hand over the line as is; on an empty line, EOF */
+		if (cs->cs_ihead == cs->cs_iline) {
+			cs->cs_ieof = true;
+		}
+		cs->cs_iline = cs->cs_ihead;
+		wchan_wakeall(cs->cs_iwchan);
+		break;
+
+	    case '\b':
+	    case 127:
+		if (cs->cs_ihead != cs->cs_iline) {
+			con_unput(cs);
+		}
+		break;
+
+	    case 21:
+		/* ^U - erase line */
+		while (cs->cs_ihead != cs->cs_iline) {
+			con_unput(cs);
+		}
+		break;
+
+	    case 23:
+		/* ^W - erase word */
+		while (con_lastch(cs) == ' ') {
+			con_unput(cs);
+		}
+		while (con_lastch(cs) != -1 && con_lastch(cs) != ' ') {
+			con_unput(cs);
+		}
+		break;
+
+	    default:
+		/* Keep the last slot for the newline. */
+		if (con_ispace(cs) < 2) {
+			con_echo(cs, "\a");
+			break;
+		}
+		cs->cs_ibuf[cs->cs_ihead] = ch;
+		cs->cs_ihead = (cs->cs_ihead + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+		if (ch >= 32 && ch < 127) {
+			echo[0] = ch;
+			echo[1] = 0;
+			con_echo(cs, echo);
+		}
+		break;
+	}
+}
+
+/*
+ * Wait until there's input a reader may take, or an EOF. Call with
+ * cs_ilock held.
+ */
+static
+void
+con_iwait(struct con_softc *cs)
+{
+	KASSERT(spinlock_do_i_hold(&cs->cs_ilock));
+
+	while (cs->cs_itail == cs->cs_iline && !cs->cs_ieof) {
+		wchan_lock(cs->cs_iwchan);
+		spinlock_release(&cs->cs_ilock);
+		wchan_sleep(cs->cs_iwchan);
+		spinlock_acquire(&cs->cs_ilock);
+	}
 }
 
 /*
  * Read a character, using interrupts to wait for I/O completion.
+ * getch has no way to say EOF, so an EOF from ^D with nothing before
+ * it is used up here and ignored, like con_read uses it up, rather
+ * than left behind to end some later read early.
  */
 static
 int
@@ -141,49 +420,62 @@ getch_intr(struct con_softc *cs)
 {
 	unsigned char ret;
 
-	P(cs->cs_rsem);
-	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
-	cs->cs_gotchars_tail =
-		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	spinlock_acquire(&cs->cs_ilock);
+	while (1) {
+		con_iwait(cs);
+		if (cs->cs_itail != cs->cs_iline) {
+			break;
+		}
+		KASSERT(cs->cs_ieof);
+		cs->cs_ieof = false;
+	}
+	ret = cs->cs_ibuf[cs->cs_itail];
+	cs->cs_itail = (cs->cs_itail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	spinlock_release(&cs->cs_ilock);
 	return ret;
 }
 
 /*
  * Called from underlying device when a read-ready interrupt occurs.
  *
- * Note: if gotchars_head == gotchars_tail, the buffer is empty. Thus
- * if gotchars_head+1 == gotchars_tail, the buffer is full. A slightly
- * tidier way to implement this check (that avoids wasting a slot,
- * too) would be with a second semaphore used with a nonblocking P,
- * but we don't have that in OS/161.
+ * In raw mode the character is available right away; if the ring is
+ * full, it's dropped.
  */
 void
 con_input(void *vcs, int ch)
 {
 	struct con_softc *cs = vcs;
-	unsigned nexthead;
 
-	nexthead = (cs->cs_gotchars_head + 1) % CONSOLE_INPUT_BUFFER_SIZE;
-	if (nexthead == cs->cs_gotchars_tail) {
-		/* overflow; drop character */
-		return;
+	spinlock_acquire(&cs->cs_ilock);
+	if (cs->cs_icanon) {
+		con_canon(cs, ch);
 	}
-
-	cs->cs_gotchars[cs->cs_gotchars_head] = ch;
-	cs->cs_gotchars_head = nexthead;
-		
-	V(cs->cs_rsem);
+	else if (con_ispace(cs) > 0) {
+		cs->cs_ibuf[cs->cs_ihead] = ch;
+		cs->cs_ihead = (cs->cs_ihead + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+		cs->cs_iline = cs->cs_ihead;
+		wchan_wakeall(cs->cs_iwchan);
+	}
+	spinlock_release(&cs->cs_ilock);
 }
 
 /*
  * Called from underlying device when a write-done interrupt occurs.
+ * Send the next character, if any, and let writers in if there's
+ * plenty of room now.
  */
 void
 con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_olock);
+	cs->cs_obusy = false;
+	con_ostart(cs);
+	if (con_ospace(cs) >= CONSOLE_OUTPUT_BUFFER_SIZE / 2) {
+		wchan_wakeall(cs->cs_owchan);
+	}
+	spinlock_release(&cs->cs_olock);
 }
 
 //////////////////////////////////////////////////
@@ -245,16 +537,110 @@ con_close(struct device *dev)
 	return 0;
 }
 
+/*
+ * Size of the chunks user output is copied in with. It's on the
+ * stack, so it's kept small; con_oput turns newlines into CR-LF as
+ * it copies into the ring.
+ */
+#define CON_WCHUNK 32
+
+/*
+ * Size of the chunks user input is copied out with. Also on the
+ * stack, so also small.
+ */
+#define CON_RCHUNK 32
+
+/*
+ * Take input off the ring, a chunk at a time, until there's a newline
+ * or the caller's buffer is full. Raw CRs are returned as newlines.
+ * In canonical mode a line that was handed over with ^D has no
+ * newline, so the read also stops when that line runs out; a ^D on
+ * its own ends the read with nothing, and is used up by it.
+ */
+static
+int
+con_read(struct con_softc *cs, struct uio *uio)
+{
+	char buf[CON_RCHUNK];
+	size_t n, got;
+	bool done;
+	char ch;
+	int result;
+
+	got = 0;
+	done = false;
+	while (!done && uio->uio_resid > 0) {
+		spinlock_acquire(&cs->cs_ilock);
+		if (got > 0 && cs->cs_icanon && cs->cs_itail == cs->cs_iline) {
+			spinlock_release(&cs->cs_ilock);
+			break;
+		}
+		con_iwait(cs);
+		if (cs->cs_itail == cs->cs_iline) {
+			KASSERT(cs->cs_ieof);
+			if (got == 0) {
+				/* Nothing before the EOF; it's used up. */
+				cs->cs_ieof = false;
+			}
+			spinlock_release(&cs->cs_ilock);
+			break;
+		}
+		n = 0;
+		while (n < uio->uio_resid && n < sizeof(buf) &&
+		       cs->cs_itail != cs->cs_iline) {
+			ch = cs->cs_ibuf[cs->cs_itail];
+			cs->cs_itail = (cs->cs_itail + 1) %
+				CONSOLE_INPUT_BUFFER_SIZE;
+			if (ch == '\r' && !cs->cs_icanon) {
+				ch = '\n';
+			}
+			buf[n++] = ch;
+			if (ch == '\n') {
+				done = true;
+				break;
+			}
+		}
+		spinlock_release(&cs->cs_ilock);
+
+		/* uiomove can fault, so not with cs_ilock held. */
+		result = uiomove(buf, n, uio);
+		if (result) {
+			return result;
+		}
+		got += n;
+	}
+	return 0;
+}
+
+static
+int
+con_write(struct con_softc *cs, struct uio *uio)
+{
+	char buf[CON_WCHUNK];
+	size_t len;
+	int result;
+
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > sizeof(buf)) {
+			len = sizeof(buf);
+		}
+		result = uiomove(buf, len, uio);
+		if (result) {
+			return result;
+		}
+		con_oput(cs, buf, len, true);
+	}
+	return 0;
+}
+
 static
 int
 con_io(struct device *dev, struct uio *uio)
 {
 	int result;
-	char ch;
 	struct lock *lk;
 
-	(void)dev;  // unused
-
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
 	}
@@ -265,46 +651,45 @@ con_io(struct device *dev, struct uio *uio)
 	KASSERT(lk != NULL);
 	lock_acquire(lk);
 
-	while (uio->uio_resid > 0) {
-		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
-			if (ch=='\r') {
-				ch = '\n';
-			}
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				break;
-			}
-		}
-		else {
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
-		}
+	if (uio->uio_rw==UIO_READ) {
+		result = con_read(dev->d_data, uio);
+	}
+	else {
+		result = con_write(dev->d_data, uio);
 	}
+
 	lock_release(lk);
-	return 0;
+	return result;
 }
 
 static
 int
 con_ioctl(struct device *dev, int op, userptr_t data)
 {
-	/* No ioctls. */
-	(void)dev;
-	(void)op;
-	(void)data;
-	return EINVAL;
+	struct con_softc *cs = dev->d_data;
+	int canon, result;
+
+	switch (op) {
+	    case CONIOC_GETCANON:
+		spinlock_acquire(&cs->cs_ilock);
+		canon = cs->cs_icanon;
+		spinlock_release(&cs->cs_ilock);
+		return copyout(&canon, data, sizeof(canon));
+
+	    case CONIOC_SETCANON:
+		result = copyin(data, &canon, sizeof(canon));
+		if (result) {
+			return result;
+		}
+		spinlock_acquire(&cs->cs_ilock);
+		/* A half-typed line goes to the reader as raw input. */
+		cs->cs_iline = cs->cs_ihead;
+		cs->cs_icanon = canon != 0;
+		wchan_wakeall(cs->cs_iwchan);
+		spinlock_release(&cs->cs_ilock);
+		return 0;
+	}
+	return EIOCTL;
 }
 
 static
@@ -345,7 +730,7 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct wchan *iwc, *owc;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -361,33 +746,42 @@ config_con(struct con_softc *cs, int unit)
 	}
 	KASSERT(the_console==NULL);
 
-	rsem = sem_create("console read", 0);
-	if (rsem == NULL) {
+	iwc = wchan_create("console read");
+	if (iwc == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
-		sem_destroy(rsem);
+	owc = wchan_create("console write");
+	if (owc == NULL) {
+		wchan_destroy(iwc);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(iwc);
+		wchan_destroy(owc);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(iwc);
+		wchan_destroy(owc);
 		return ENOMEM;
 	}
 
-	cs->cs_rsem = rsem; 
-	cs->cs_wsem = wsem; 
-	cs->cs_gotchars_head = 0;
-	cs->cs_gotchars_tail = 0;
+	spinlock_init(&cs->cs_ilock);
+	cs->cs_iwchan = iwc;
+	cs->cs_ihead = 0;
+	cs->cs_iline = 0;
+	cs->cs_itail = 0;
+	cs->cs_icanon = false;
+	cs->cs_ieof = false;
+
+	spinlock_init(&cs->cs_olock);
+	cs->cs_owchan = owc;
+	cs->cs_ohead = 0;
+	cs->cs_otail = 0;
+	cs->cs_obusy = false;
 
 	the_console = cs;
 	con_userlock_read = rlk;
@@ -35,9 +35,15 @@
  *
  * devdata, send, and sendpolled are provided by the underlying
  * device, and are to be initialized by the attach routine.
+ *
+ * Input goes through the ring cs_ibuf and output through the ring
+ * cs_obuf; see console.c.
  */
 
-#define CONSOLE_INPUT_BUFFER_SIZE 32
+#include <spinlock.h>
+
+#define CONSOLE_INPUT_BUFFER_SIZE 256
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -46,11 +52,21 @@ struct con_softc {
 	void (*cs_sendpolled)(void *devdata, int ch);
 
 	/* initialized by config routine */
-	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
-	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
-	unsigned cs_gotchars_head;	/* next slot to put a char in */
-	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+	struct spinlock cs_ilock;	/* protects the input fields */
+	struct wchan *cs_iwchan;	/* readers waiting for input */
+	char cs_ibuf[CONSOLE_INPUT_BUFFER_SIZE];
+	unsigned cs_ihead;		/* next slot to put a char in */
+	unsigned cs_iline;		/* end of input readers may take */
+	unsigned cs_itail;		/* next slot to take a char out */
+	bool cs_icanon;			/* canonical (line-edited) input */
+	bool cs_ieof;			/* ^D on an empty line */
+
+	struct spinlock cs_olock;	/* protects the output fields */
+	struct wchan *cs_owchan;	/* writers waiting for room */
+	char cs_obuf[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_ohead;		/* next slot to put a char in */
+	unsigned cs_otail;		/* next slot to take a char out */
+	bool cs_obusy;			/* device is sending a char */
 };
 
 /*
@@ -48,6 +48,8 @@
 #include <array.h>
 #include <uio.h>
 #include <synch.h>
+#include <vm.h>
+#include <slab.h>
 #include <lamebus/emu.h>
 #include <platform/bus.h>
 #include <vfs.h>
@@ -90,6 +92,9 @@
 #define EMU_RES_UNKNOWN      12
 #define EMU_RES_UNSUPP       13
 
+/* Where emufs vnodes come from; shared by all emu devices. */
+static struct kmem_cache *emufs_vnode_cache;
+
 ////////////////////////////////////////////////////////////
 //
 // Hardware ops
@@ -128,7 +133,7 @@ emu_irq(void *dev)
 	sc->e_result = emu_rreg(sc, REG_RESULT);
 	emu_wreg(sc, REG_RESULT, 0);
 
-	V(sc->e_sem);
+	V(&sc->e_sem);
 }
 
 /*
@@ -166,7 +171,7 @@ static
 int
 emu_waitdone(struct emu_softc *sc)
 {
-	P(sc->e_sem);
+	P(&sc->e_sem);
 	return translate_err(sc, sc->e_result);
 }
 
@@ -202,7 +207,7 @@ emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
 	/* mode isn't supported (yet?) */
 	(void)mode;
 
-	lock_acquire(sc->e_lock);
+	lock_acquire(&sc->e_lock);
 
 	strcpy(sc->e_iobuf, name);
 	emu_wreg(sc, REG_IOLEN, strlen(name));
@@ -215,7 +220,7 @@ emu_open(struct emu_softc *sc, uint32_t handle, const char *name,
 		*newisdir = emu_rreg(sc, REG_IOLEN)>0;
 	}
 
-	lock_release(sc->e_lock);
+	lock_release(&sc->e_lock);
 	return result;
 }
 
@@ -232,9 +237,9 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 	bool mine;
 	int retries = 0;
 
-	mine = lock_do_i_hold(sc->e_lock);
+	mine = lock_do_i_hold(&sc->e_lock);
 	if (!mine) {
-		lock_acquire(sc->e_lock);
+		lock_acquire(&sc->e_lock);
 	}
 
 	while (1) {
@@ -254,11 +259,34 @@ emu_close(struct emu_softc *sc, uint32_t handle)
 	}
 
 	if (!mine) {
-		lock_release(sc->e_lock);
+		lock_release(&sc->e_lock);
 	}
 	return result;
 }
 
+/*
+ * Transfers to and from user memory can take page faults, and a page
+ * fault can read from a file on this device. So we must not touch
+ * user memory while holding e_lock; user transfers go through a
+ * bounce buffer instead. Kernel transfers use e_iobuf directly.
+ *
+ * The bounce buffer is at most a page, so it never needs contiguous
+ * physical pages; *LEN is cut down to match, and the loops in
+ * emufs_read and emufs_write pick up the rest.
+ */
+static
+void *
+emu_getbounce(struct uio *uio, uint32_t *len)
+{
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		return NULL;
+	}
+	if (*len > PAGE_SIZE) {
+		*len = PAGE_SIZE;
+	}
+	return kmalloc(*len);
+}
+
 /*
  * Common code for read and readdir.
  */
@@ -267,11 +295,18 @@ int
 emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	   uint32_t op, struct uio *uio)
 {
+	void *bounce;
+	uint32_t got;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_READ);
 
-	lock_acquire(sc->e_lock);
+	bounce = emu_getbounce(uio, &len);
+	if (bounce == NULL && uio->uio_segflg != UIO_SYSSPACE) {
+		return ENOMEM;
+	}
+
+	lock_acquire(&sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
@@ -282,12 +317,27 @@ emu_doread(struct emu_softc *sc, uint32_t handle, uint32_t len,
 		goto out;
 	}
 	
-	result = uiomove(sc->e_iobuf, emu_rreg(sc, REG_IOLEN), uio);
+	got = emu_rreg(sc, REG_IOLEN);
+	if (bounce != NULL) {
+		memcpy(bounce, sc->e_iobuf, got);
+	}
+	else {
+		result = uiomove(sc->e_iobuf, got, uio);
+	}
 
 	uio->uio_offset = emu_rreg(sc, REG_OFFSET);
 
  out:
-	lock_release(sc->e_lock);
+	lock_release(&sc->e_lock);
+	if (bounce != NULL) {
+		if (result == 0) {
+			off_t offset = uio->uio_offset;
+
+			result = uiomove(bounce, got, uio);
+			uio->uio_offset = offset;
+		}
+		kfree(bounce);
+	}
 	return result;
 }
 
@@ -321,26 +371,48 @@ int
 emu_write(struct emu_softc *sc, uint32_t handle, uint32_t len,
 	  struct uio *uio)
 {
+	off_t offset = uio->uio_offset;
+	void *bounce;
 	int result;
 
 	KASSERT(uio->uio_rw == UIO_WRITE);
 
-	lock_acquire(sc->e_lock);
+	bounce = emu_getbounce(uio, &len);
+	if (bounce != NULL) {
+		result = uiomove(bounce, len, uio);
+		if (result) {
+			kfree(bounce);
+			return result;
+		}
+	}
+	else if (uio->uio_segflg != UIO_SYSSPACE) {
+		return ENOMEM;
+	}
+
+	lock_acquire(&sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
-	emu_wreg(sc, REG_OFFSET, uio->uio_offset);
+	emu_wreg(sc, REG_OFFSET, offset);
 
-	result = uiomove(sc->e_iobuf, len, uio);
-	if (result) {
-		goto out;
+	if (bounce != NULL) {
+		memcpy(sc->e_iobuf, bounce, len);
+	}
+	else {
+		result = uiomove(sc->e_iobuf, len, uio);
+		if (result) {
+			goto out;
+		}
 	}
 
 	emu_wreg(sc, REG_OPER, EMU_OP_WRITE);
 	result = emu_waitdone(sc);
 
  out:
-	lock_release(sc->e_lock);
+	lock_release(&sc->e_lock);
+	if (bounce != NULL) {
+		kfree(bounce);
+	}
 	return result;
 }
 
@@ -353,7 +425,7 @@ emu_getsize(struct emu_softc *sc, uint32_t handle, off_t *retval)
 {
 	int result;
 
-	lock_acquire(sc->e_lock);
+	lock_acquire(&sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_OPER, EMU_OP_GETSIZE);
@@ -362,7 +434,7 @@ emu_getsize(struct emu_softc *sc, uint32_t handle, off_t *retval)
 		*retval = emu_rreg(sc, REG_IOLEN);
 	}
 
-	lock_release(sc->e_lock);
+	lock_release(&sc->e_lock);
 	return result;
 }
 
@@ -375,14 +447,14 @@ emu_trunc(struct emu_softc *sc, uint32_t handle, off_t len)
 {
 	int result;
 
-	lock_acquire(sc->e_lock);
+	lock_acquire(&sc->e_lock);
 
 	emu_wreg(sc, REG_HANDLE, handle);
 	emu_wreg(sc, REG_IOLEN, len);
 	emu_wreg(sc, REG_OPER, EMU_OP_TRUNC);
 	result = emu_waitdone(sc);
 
-	lock_release(sc->e_lock);
+	lock_release(&sc->e_lock);
 	return result;
 }
 
@@ -477,10 +549,10 @@ emufs_reclaim(struct vnode *v)
 	 */
 
 	vfs_biglock_acquire();
-	lock_acquire(ef->ef_emu->e_lock);
+	lock_acquire(&ef->ef_emu->e_lock);
 
 	if (ev->ev_v.vn_refcount != 1) {
-		lock_release(ef->ef_emu->e_lock);
+		lock_release(&ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
@@ -488,7 +560,7 @@ emufs_reclaim(struct vnode *v)
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
 	if (result) {
-		lock_release(ef->ef_emu->e_lock);
+		lock_release(&ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return result;
 	}
@@ -512,10 +584,10 @@ emufs_reclaim(struct vnode *v)
 	vnodearray_remove(ef->ef_vnodes, ix);
 	VOP_CLEANUP(&ev->ev_v);
 
-	lock_release(ef->ef_emu->e_lock);
+	lock_release(&ef->ef_emu->e_lock);
 	vfs_biglock_release();
 
-	kfree(ev);
+	kmem_cache_free(emufs_vnode_cache, ev);
 	return 0;
 }
 
@@ -837,13 +909,15 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * Files can be mapped; the pages are read in with emufs_read.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 //////////////////////////////
@@ -1154,7 +1228,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	int result;
 
 	vfs_biglock_acquire();
-	lock_acquire(ef->ef_emu->e_lock);
+	lock_acquire(&ef->ef_emu->e_lock);
 
 	num = vnodearray_num(ef->ef_vnodes);
 	for (i=0; i<num; i++) {
@@ -1165,7 +1239,7 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 			VOP_INCREF(&ev->ev_v);
 
-			lock_release(ef->ef_emu->e_lock);
+			lock_release(&ef->ef_emu->e_lock);
 			vfs_biglock_release();
 			*ret = ev;
 			return 0;
@@ -1174,9 +1248,9 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 
 	/* Didn't have one; create it */
 
-	ev = kmalloc(sizeof(struct emufs_vnode));
+	ev = kmem_cache_alloc(emufs_vnode_cache);
 	if (ev==NULL) {
-		lock_release(ef->ef_emu->e_lock);
+		lock_release(&ef->ef_emu->e_lock);
 		return ENOMEM;
 	}
 
@@ -1186,9 +1260,9 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	result = VOP_INIT(&ev->ev_v, isdir ? &emufs_dirops : &emufs_fileops,
 			   &ef->ef_fs, ev);
 	if (result) {
-		lock_release(ef->ef_emu->e_lock);
+		lock_release(&ef->ef_emu->e_lock);
 		vfs_biglock_release();
-		kfree(ev);
+		kmem_cache_free(emufs_vnode_cache, ev);
 		return result;
 	}
 
@@ -1196,13 +1270,13 @@ emufs_loadvnode(struct emufs_fs *ef, uint32_t handle, int isdir,
 	if (result) {
 		/* note: VOP_CLEANUP undoes VOP_INIT - it does not kfree */
 		VOP_CLEANUP(&ev->ev_v);
-		lock_release(ef->ef_emu->e_lock);
+		lock_release(&ef->ef_emu->e_lock);
 		vfs_biglock_release();
-		kfree(ev);
+		kmem_cache_free(emufs_vnode_cache, ev);
 		return result;
 	}
 
-	lock_release(ef->ef_emu->e_lock);
+	lock_release(&ef->ef_emu->e_lock);
 	vfs_biglock_release();
 
 	*ret = ev;
@@ -1334,16 +1408,17 @@ config_emu(struct emu_softc *sc, int emuno)
 {
 	char name[32];
 
-	sc->e_lock = lock_create("emufs-lock");
-	if (sc->e_lock == NULL) {
-		return ENOMEM;
-	}
-	sc->e_sem = sem_create("emufs-sem", 0);
-	if (sc->e_sem == NULL) {
-		lock_destroy(sc->e_lock);
-		sc->e_lock = NULL;
-		return ENOMEM;
+	if (emufs_vnode_cache == NULL) {
+		emufs_vnode_cache = kmem_cache_create("emufs_vnode",
+					sizeof(struct emufs_vnode), 0,
+					NULL, NULL);
+		if (emufs_vnode_cache == NULL) {
+			return ENOMEM;
+		}
 	}
+
+	lock_init(&sc->e_lock, "emufs-lock");
+	sem_init(&sc->e_sem, "emufs-sem", 0);
 	sc->e_iobuf = bus_map_area(sc->e_busdata, sc->e_buspos, EMU_BUFFER);
 
 	snprintf(name, sizeof(name), "emu%d", emuno);
@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_EMU_H_
 #define _LAMEBUS_EMU_H_
 
+#include <synch.h>
 
 #define EMU_MAXIO       16384
 #define EMU_ROOTHANDLE  0
@@ -47,8 +48,8 @@ struct emu_softc {
 	int e_unit;
 
 	/* Initialized by config_emu() */
-	struct lock *e_lock;
-	struct semaphore *e_sem;
+	struct lock e_lock;
+	struct semaphore e_sem;
 	void *e_iobuf;
 
 	/* Written by the interrupt handler */
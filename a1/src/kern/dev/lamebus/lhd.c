@@ -29,12 +29,39 @@
 
 /*
  * LAMEbus hard disk (lhd) driver.
+ *
+ * The disk itself only does one sector at a time, through a one-sector
+ * buffer on the card. To keep it busy anyway, callers don't drive it
+ * directly: lhd_io copies the data into (or out of) a kernel buffer
+ * and puts a request on a per-disk queue, and the interrupt handler
+ * moves the data between that buffer and the card and starts the next
+ * sector as soon as one finishes. The caller just waits for its whole
+ * request to be done.
+ *
+ * The queue is served in C-LOOK order: the disk sweeps up through the
+ * sectors, taking the next request at or above the last sector it
+ * did, and when there's nothing further up it goes back to the lowest
+ * one. A new request that starts right where a queued one ends (or
+ * ends where one starts), in the same direction, is merged with it
+ * into a run, which is always served in one go. Requests can also be
+ * merged onto the end of the run in progress, so several threads
+ * reading through a file together stream off the disk without a
+ * seek. Runs are capped at LHD_MAXRUN sectors so one stream can't
+ * starve everyone else.
+ *
+ * The kernel buffers are allocated once, LHD_NBUFS of them per disk,
+ * in config_lhd. Allocating one per request would mean the pager,
+ * writing to swap because memory is short, had to allocate memory to
+ * do it. A caller waits for a free buffer if they're all in use.
  */
 
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <cpu.h>
+#include <current.h>
+#include <counter.h>
 #include <synch.h>
 #include <platform/bus.h>
 #include <vfs.h>
@@ -59,6 +86,35 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Most sectors in one request (one transfer buffer, a page) */
+#define LHD_MAXSECT     8
+
+/* Most sectors in a run of merged requests */
+#define LHD_MAXRUN      128
+
+/*
+ * One caller's transfer. The queue is a list of runs, linked through
+ * lr_next and sorted by starting sector; the requests within a run
+ * follow one another on the disk and are linked through lr_chain.
+ * lr_runlen is only meaningful for the first request of a run.
+ */
+struct lhd_req {
+	uint32_t lr_sector;		/* First sector */
+	uint32_t lr_nsect;		/* Number of sectors */
+	bool lr_write;			/* Direction */
+	char *lr_buf;			/* Kernel buffer, lr_nsect sectors */
+	int lr_result;			/* Result, set on completion */
+	struct semaphore lr_done;	/* Posted on completion */
+	uint32_t lr_runlen;		/* Sectors in the run */
+	struct lhd_req *lr_chain;	/* Next request in the same run */
+	struct lhd_req *lr_next;	/* Next run in the queue */
+};
+
+static struct counter lhd_sectors = COUNTER_INITIALIZER("lhd_sectors");
+static struct counter lhd_reqs = COUNTER_INITIALIZER("lhd_reqs");
+static struct counter lhd_merges = COUNTER_INITIALIZER("lhd_merges");
+static struct counter lhd_runs = COUNTER_INITIALIZER("lhd_runs");
+
 /*
  * Shortcut for reading a register.
  */
@@ -95,21 +151,209 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the disk on the current sector of the current request. Call
+ * with lh_lock held.
+ */
+static
+void
+lhd_startsect(struct lhd_softc *lh)
+{
+	struct lhd_req *req = lh->lh_cur;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(lh->lh_curidx < req->lr_nsect);
+
+	/*
+	 * Are we writing? If so, transfer the data to the
+	 * on-card buffer.
+	 */
+	if (req->lr_write) {
+		memcpy(lh->lh_buf, req->lr_buf + lh->lh_curidx * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, req->lr_sector + lh->lh_curidx);
+	lh->lh_pos = req->lr_sector + lh->lh_curidx + 1;
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+	COUNTER_INC(&lhd_sectors);
+}
+
+/*
+ * The disk is free: take the next run off the queue in C-LOOK order
+ * and start it, if there is one. Call with lh_lock held.
+ */
+static
+void
+lhd_startrun(struct lhd_softc *lh)
+{
+	struct lhd_req **pp, **next;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(lh->lh_cur == NULL);
+
+	if (lh->lh_queue == NULL) {
+		return;
+	}
+
+	/* First run at or above the head; failing that, the lowest. */
+	next = &lh->lh_queue;
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		if ((*pp)->lr_sector >= lh->lh_pos) {
+			next = pp;
+			break;
+		}
+	}
+
+	lh->lh_cur = *next;
+	*next = lh->lh_cur->lr_next;
+	lh->lh_cur->lr_next = NULL;
+	lh->lh_curidx = 0;
+	lh->lh_runlen = lh->lh_cur->lr_runlen;
+	COUNTER_INC(&lhd_runs);
+	lhd_startsect(lh);
+}
+
+/*
+ * Add a request to the queue, merging it with a run it adjoins if
+ * possible, and start the disk if it was idle. Call with lh_lock held.
+ */
+static
+void
+lhd_enqueue(struct lhd_softc *lh, struct lhd_req *req)
+{
+	struct lhd_req **pp, *run, *tail;
+	uint32_t end = req->lr_sector + req->lr_nsect;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	req->lr_runlen = req->lr_nsect;
+	req->lr_chain = NULL;
+	req->lr_next = NULL;
+	COUNTER_INC(&lhd_reqs);
+
+	/* Onto the end of the run in progress? */
+	if (lh->lh_cur != NULL && lh->lh_cur->lr_write == req->lr_write &&
+	    lh->lh_runlen + req->lr_nsect <= LHD_MAXRUN) {
+		for (tail = lh->lh_cur; tail->lr_chain != NULL;
+		     tail = tail->lr_chain) {
+			/* nothing */
+		}
+		if (tail->lr_sector + tail->lr_nsect == req->lr_sector) {
+			tail->lr_chain = req;
+			lh->lh_runlen += req->lr_nsect;
+			COUNTER_INC(&lhd_merges);
+			return;
+		}
+	}
+
+	/* Onto either end of a queued run? */
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		run = *pp;
+		if (run->lr_write != req->lr_write ||
+		    run->lr_runlen + req->lr_nsect > LHD_MAXRUN) {
+			continue;
+		}
+		if (end == run->lr_sector) {
+			req->lr_chain = run;
+			req->lr_next = run->lr_next;
+			req->lr_runlen += run->lr_runlen;
+			run->lr_next = NULL;
+			*pp = req;
+			COUNTER_INC(&lhd_merges);
+			return;
+		}
+		for (tail = run; tail->lr_chain != NULL;
+		     tail = tail->lr_chain) {
+			/* nothing */
+		}
+		if (tail->lr_sector + tail->lr_nsect == req->lr_sector) {
+			tail->lr_chain = req;
+			run->lr_runlen += req->lr_nsect;
+			COUNTER_INC(&lhd_merges);
+			return;
+		}
+	}
+
+	/* No; it's a run of its own. Keep the queue sorted. */
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		if ((*pp)->lr_sector > req->lr_sector) {
+			break;
+		}
+	}
+	req->lr_next = *pp;
+	*pp = req;
+
+	if (lh->lh_cur == NULL) {
+		lhd_startrun(lh);
+	}
+}
+
+/*
+ * Record that an I/O has completed: finish off the sector, and start
+ * the disk on the next one, whether it's in the same request, the
+ * next request of the run, or the next run in the queue. Then report
+ * the request's completion if it's done.
+ *
+ * An error ends the request it happens in, but not the rest of the
+ * run; those requests are independent.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_req *req;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	req = lh->lh_cur;
+	if (req == NULL) {
+		/* Not ours; nothing was started. */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/*
+	 * Are we reading? If so, and if we succeeded,
+	 * transfer the data out of the on-card buffer.
+	 */
+	if (err == 0 && !req->lr_write) {
+		memcpy(req->lr_buf + lh->lh_curidx * LHD_SECTSIZE, lh->lh_buf,
+		       LHD_SECTSIZE);
+	}
+	lh->lh_curidx++;
+
+	if (err == 0 && lh->lh_curidx < req->lr_nsect) {
+		lhd_startsect(lh);
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/* This request is finished; move on before waking its owner. */
+	lh->lh_cur = req->lr_chain;
+	lh->lh_curidx = 0;
+	if (lh->lh_cur != NULL) {
+		lhd_startsect(lh);
+	}
+	else {
+		lhd_startrun(lh);
+	}
+
+	/* After the V, req belongs to its owner again. */
+	req->lr_result = err;
+	V(&req->lr_done);
+
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register and report completion, which starts the next sector.
  */
 void
 lhd_irq(void *vlh)
@@ -126,7 +370,7 @@ lhd_irq(void *vlh)
 	    case LHD_OK:
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
-		lhd_wreg(lh, LHD_REG_STAT, 0);
+		lhd_wreg(lh, LHD_REG_STAT, LHD_IDLE);
 		lhd_iodone(lh, lhd_code_to_errno(lh, val));
 		break;
 	}
@@ -206,8 +450,7 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	struct lhd_req req;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,59 +463,61 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	P(&lh->lh_bufsem);
+	spinlock_acquire(&lh->lh_lock);
+	KASSERT(lh->lh_nbufs > 0);
+	req.lr_buf = lh->lh_bufs[--lh->lh_nbufs];
+	spinlock_release(&lh->lh_lock);
+
+	req.lr_write = uio->uio_rw == UIO_WRITE;
+	sem_init(&req.lr_done, "lhd-done", 0);
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	/* Loop over the sectors we were asked to do, a request at a time. */
+	result = 0;
+	while (len > 0) {
+		req.lr_sector = sector;
+		req.lr_nsect = len < LHD_MAXSECT ? len : LHD_MAXSECT;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		if (req.lr_write) {
+			result = uiomove(req.lr_buf,
+					 req.lr_nsect * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
+		spinlock_acquire(&lh->lh_lock);
+		lhd_enqueue(lh, &req);
+		spinlock_release(&lh->lh_lock);
 
 		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+		P(&req.lr_done);
 
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		result = req.lr_result;
+		if (result == 0 && !req.lr_write) {
+			result = uiomove(req.lr_buf,
+					 req.lr_nsect * LHD_SECTSIZE, uio);
 		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
 		if (result) {
-			return result;
+			break;
 		}
+
+		sector += req.lr_nsect;
+		len -= req.lr_nsect;
 	}
 
-	return 0;
+	sem_cleanup(&req.lr_done);
+
+	spinlock_acquire(&lh->lh_lock);
+	lh->lh_bufs[lh->lh_nbufs++] = req.lr_buf;
+	spinlock_release(&lh->lh_lock);
+	V(&lh->lh_bufsem);
+
+	return result;
 }
 
 /*
@@ -282,6 +527,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	unsigned i;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -289,17 +535,26 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_curidx = 0;
+	lh->lh_runlen = 0;
+	lh->lh_pos = 0;
+
+	/* Get the transfer buffers. */
+	for (i=0; i<LHD_NBUFS; i++) {
+		lh->lh_bufs[i] = kmalloc(LHD_MAXSECT * LHD_SECTSIZE);
+		if (lh->lh_bufs[i] == NULL) {
+			while (i > 0) {
+				kfree(lh->lh_bufs[--i]);
+			}
+			return ENOMEM;
+		}
 	}
+	lh->lh_nbufs = LHD_NBUFS;
+	sem_init(&lh->lh_bufsem, "lhd-bufs", LHD_NBUFS);
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
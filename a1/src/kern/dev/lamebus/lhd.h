@@ -31,12 +31,22 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <spinlock.h>
+#include <synch.h>
+
+struct lhd_req;		/* Private to lhd.c */
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * Number of transfer buffers per disk, and so of requests that can be
+ * in the queue at once
+ */
+#define LHD_NBUFS     4
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +61,15 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the queue and lh_bufs */
+	char *lh_bufs[LHD_NBUFS];	/* Free transfer buffers */
+	unsigned lh_nbufs;		/* Number of them */
+	struct semaphore lh_bufsem;	/* Counts lh_nbufs */
+	struct lhd_req *lh_queue;	/* Waiting runs, sorted by sector */
+	struct lhd_req *lh_cur;		/* Request the disk is working on */
+	uint32_t lh_curidx;		/* Sector within lh_cur */
+	uint32_t lh_runlen;		/* Sectors in the current run */
+	uint32_t lh_pos;		/* Sector after the last one started */
 
 	struct device lh_dev;		/* VFS device structure */
 };
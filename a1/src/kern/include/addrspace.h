@@ -36,16 +36,87 @@
 
 
 #include <vm.h>
+#include <synch.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
+struct textobj;
 
 
+#if !OPT_DUMBVM
+/*
+ * A region of an address space: a page-aligned range of virtual
+ * addresses with uniform permissions. Regions never overlap; the
+ * address space keeps them in a list sorted by address.
+ *
+ * The MIPS can't refuse to execute a page that is readable, so
+ * VR_EXEC is recorded but is the same as VR_READ in practice.
+ *
+ * VR_MMAP marks regions made by mmap, which are the only ones munmap
+ * will take away.
+ *
+ * Pages are brought in when first touched. If vr_vnode is set, the
+ * bytes from vr_filevaddr to vr_filevaddr+vr_filesz come from that
+ * file, starting at vr_fileoff; everything else is zero-filled.
+ * Read-only file-backed regions share their pages with other
+ * processes running the same program through vr_text; see
+ * textcache.h.
+ */
+struct vm_region {
+	vaddr_t vr_base;		/* first address */
+	size_t vr_npages;		/* length */
+	unsigned vr_perms;		/* VR_* below */
+	struct vnode *vr_vnode;		/* file backing, or NULL */
+	off_t vr_fileoff;		/* file offset of vr_filevaddr */
+	vaddr_t vr_filevaddr;		/* where the file data goes */
+	size_t vr_filesz;		/* how much of it there is */
+	struct textobj *vr_text;	/* shared pages, or NULL */
+	struct vm_region *vr_next;	/* next region up */
+};
+
+#define VR_READ		4
+#define VR_WRITE	2
+#define VR_EXEC		1
+#define VR_MMAP		8	/* not a permission; see above */
+
+/* Size of the user stack */
+#define VM_STACKPAGES	1024
+
+/*
+ * What an address space has been up to, for getrusage. Page faults
+ * are counted by how the page was found: zero-filled, read from a
+ * file (including program text nobody had read in yet), mapped from
+ * the textcache, or read back from swap. TLB faults count every trip
+ * through vm_fault, including those that just reload a page that was
+ * already there. Resident pages include shared ones.
+ */
+struct vmstats {
+	unsigned vs_tlbfaults;		/* calls to vm_fault */
+	unsigned vs_zerofaults;		/* pages zero-filled */
+	unsigned vs_filefaults;		/* pages read from a file */
+	unsigned vs_textfaults;		/* pages shared from the textcache */
+	unsigned vs_swapfaults;		/* pages read from swap */
+	unsigned vs_resident;		/* pages in memory now */
+	unsigned vs_maxresident;	/* most there have ever been */
+};
+#endif
+
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
  *
- * You write this.
+ * Without dumbvm, as_lock protects the regions and page table. The
+ * thread using the address space takes it in vm_fault and the other
+ * as_* functions; the pager (vm/swap.c) takes it to page out one of
+ * its pages, but only if it can get it without waiting.
+ *
+ * as_stats is covered by as_lock too. The pager updates vs_resident
+ * when it takes pages away.
+ *
+ * The heap is an ordinary read/write region, just above the program's
+ * own, that starts out empty and grows and shrinks with sbrk. Its
+ * size in pages is always enough to cover as_heapbreak.
  */
 
 struct addrspace {
@@ -58,7 +129,13 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Put stuff here for your VM system */
+        struct lock as_lock;            /* see above */
+        struct vm_region *as_regions;   /* sorted by address */
+        struct pagetable *as_pt;        /* where the pages are */
+        uint32_t *as_asids;             /* per-cpu TLB tags; see vm.c */
+        struct vm_region *as_heap;      /* heap region, or NULL */
+        vaddr_t as_heapbreak;           /* current break */
+        struct vmstats as_stats;        /* see above */
 #endif
 };
 
@@ -94,6 +171,38 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_findregion - return the region containing VADDR, or NULL.
+ *                (Not with dumbvm.)
+ *
+ *    as_define_file - arrange for FILESZ bytes at VADDR, in a region
+ *                already defined, to be read in from file V at
+ *                OFFSET when first touched. (Not with dumbvm.)
+ *
+ *    as_getpage - return the physical page for VADDR in region VR,
+ *                bringing it in first if need be. (Not with dumbvm.)
+ *
+ *    as_sbrk   - move the heap break by AMOUNT bytes, handing back the
+ *                old break; fails with EINVAL if it would go below
+ *                the start of the heap and ENOMEM if the heap would
+ *                run into something else. (Not with dumbvm.)
+ *
+ *    as_mmap   - map LEN bytes of file V from OFFSET somewhere free,
+ *                with permissions PERMS (VR_*), handing back the
+ *                address. (Not with dumbvm.)
+ *
+ *    as_munmap - remove the mapping of LEN bytes at ADDR made by
+ *                as_mmap. (Not with dumbvm.)
+ *
+ *    as_getstats - hand back a copy of the address space's statistics.
+ *                (Not with dumbvm.)
+ *
+ *    as_fillpage - fill the page at PA with what belongs at VADDR in
+ *                region VR: file data and/or zeros. (Not with
+ *                dumbvm.)
+ *
+ *    as_bootstrap - initialize; called from vm_bootstrap. (Not with
+ *                dumbvm.)
  */
 
 struct addrspace *as_create(void);
@@ -110,6 +219,25 @@ int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
+#if !OPT_DUMBVM
+struct vm_region *as_findregion(struct addrspace *as, vaddr_t vaddr);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 size_t filesz, struct vnode *v,
+                                 off_t offset);
+int               as_getpage(struct addrspace *as, struct vm_region *vr,
+                             vaddr_t vaddr, paddr_t *ret);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, size_t len,
+                          unsigned perms, struct vnode *v, off_t offset,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+void              as_getstats(struct addrspace *as, struct vmstats *ret);
+int               as_fillpage(struct vm_region *vr, vaddr_t vaddr,
+                              paddr_t pa);
+void              as_bootstrap(void);
+#endif
+
 
 /*
  * Functions in loadelf.c
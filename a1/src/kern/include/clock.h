@@ -73,5 +73,48 @@ void getinterval(time_t secs1, uint32_t nsecs,
  */
 void clocksleep(int seconds);
 
+/*
+ * Callouts: call a function from the timer interrupt some number of
+ * hardclock ticks in the future. Callouts are run by CPU 0, in
+ * interrupt context, so the function must not sleep.
+ *
+ * callout_init prepares a callout to call FUNC(DATA). It allocates
+ * nothing; the struct callout is normally embedded in whatever it's
+ * for, or on the stack of the thread waiting on it.
+ *
+ * callout_reset arranges for the callout to fire TICKS ticks from now
+ * (at least one), replacing any previous setting.
+ *
+ * callout_stop cancels the callout. It returns true if the callout
+ * was pending and is now cancelled, false if it had already fired
+ * (or was never set). If the function is running on another CPU,
+ * callout_stop waits for it to finish, so on return it is safe to
+ * free or reuse the callout.
+ *
+ * callout_ticks returns the number of ticks since boot, as counted
+ * by CPU 0.
+ *
+ * MSEC_TO_TICKS converts milliseconds to ticks, rounding up.
+ */
+struct callout {
+	struct callout *co_next;	/* Next on the pending list */
+	unsigned co_when;		/* Tick at which to fire */
+	void (*co_func)(void *);	/* What to call */
+	void *co_data;			/* Argument for co_func */
+	volatile int co_state;		/* CO_IDLE, CO_PENDING, CO_RUNNING */
+};
+
+#define CO_IDLE		0
+#define CO_PENDING	1
+#define CO_RUNNING	2
+
+#define MSEC_TO_TICKS(ms) \
+	((unsigned)(((uint64_t)(ms) * HZ + 999) / 1000))
+
+void callout_init(struct callout *co, void (*func)(void *), void *data);
+void callout_reset(struct callout *co, unsigned ticks);
+bool callout_stop(struct callout *co);
+unsigned callout_ticks(void);
+
 
 #endif /* _CLOCK_H_ */
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _COUNTER_H_
+#define _COUNTER_H_
+
+/*
+ * Per-cpu statistics counters.
+ *
+ * Each counter has one slot in every struct cpu. Incrementing touches
+ * only the current cpu's slot, so it takes no lock and causes no
+ * cross-cpu cache traffic; counter_read adds up the slots of all
+ * cpus. The price is that an increment may occasionally be lost if
+ * it races with an interrupt on the same cpu or the thread migrates
+ * halfway through. That's fine for statistics, which is all these
+ * are for.
+ *
+ * Define a counter where you need it, for example
+ *
+ *      static struct counter kmalloc_calls =
+ *              COUNTER_INITIALIZER("kmalloc");
+ *
+ * and bump it with COUNTER_INC(&kmalloc_calls). Counters register
+ * themselves the first time they're used, so there is no bootstrap
+ * ordering to worry about; they're listed by the "kc" menu command.
+ *
+ * COUNTER_INC and COUNTER_ADD use curcpu, so like any other code
+ * that does, the file using them must include <current.h>. The
+ * definition of struct cpu comes with this header.
+ */
+
+/* Number of counter slots per cpu. Slot 0 means "not registered". */
+#define COUNTERS_MAX	96
+
+struct counter {
+	const char *ctr_name;		/* Name for printing */
+	volatile unsigned ctr_slot;	/* Index into c_counters[], or 0 */
+};
+
+#define COUNTER_INITIALIZER(name)	{ (name), 0 }
+
+/*
+ * struct cpu holds the slots, and <cpu.h> includes this file for
+ * COUNTERS_MAX, so this has to come after the definitions above.
+ */
+#include <cpu.h>
+
+/* Assign a slot to a counter. Called from COUNTER_ADD as needed. */
+void counter_attach(struct counter *ctr);
+
+/*
+ * Add N to, or increment, a counter on the current cpu. Before the
+ * cpu structures exist (very early in boot) this does nothing.
+ */
+#define COUNTER_ADD(ctr, n) \
+	do { \
+		if (CURCPU_EXISTS()) { \
+			if ((ctr)->ctr_slot == 0) { \
+				counter_attach(ctr); \
+			} \
+			curcpu->c_counters[(ctr)->ctr_slot] += (n); \
+		} \
+	} while (0)
+
+#define COUNTER_INC(ctr)	COUNTER_ADD(ctr, 1)
+
+/* Return the total of a counter over all cpus. */
+uint64_t counter_read(struct counter *ctr);
+
+/* Print all registered counters, per cpu and total. */
+void counter_printstats(void);
+
+
+#endif /* _COUNTER_H_ */
@@ -33,6 +33,7 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <counter.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
@@ -60,6 +61,12 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	uint64_t c_counters[COUNTERS_MAX]; /* Statistics; see counter.h */
+	struct kmalloc_magazine *c_kmag; /* Free blocks; see kmalloc.c */
+	unsigned c_tlbnext;		/* Next TLB slot to replace */
+	uint32_t c_asid;		/* Address space ID in use */
+	uint32_t c_asidgen;		/* Generation of ASIDs; see vm.c */
+	uint32_t c_asidnext;		/* Next ASID to hand out */
 
 	/*
 	 * Accessed by other cpus.
@@ -69,6 +76,18 @@ struct cpu {
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
 
+	/*
+	 * Accessed by other cpus.
+	 * Lock-free; see below.
+	 *
+	 * c_inbox is a stack of threads woken up by other cpus,
+	 * linked through t_inboxnext. Any cpu may push onto it with
+	 * atomic_cas_ptr; only this cpu takes things off, by swapping
+	 * the whole list out and moving it to c_runqueue. This lets a
+	 * remote wakeup avoid bouncing c_runqueue_lock between cpus.
+	 */
+	struct thread *volatile c_inbox;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the IPI lock.
@@ -82,10 +101,14 @@ struct cpu {
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
+	 *
+	 * c_shootdown_seq counts batches of shootdowns processed, so
+	 * the sender can tell when its request has been done.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	volatile unsigned c_shootdown_seq;
 	struct spinlock c_ipi_lock;
 };
 
@@ -109,6 +132,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Look at the set of cpus: cpu_count returns the number of cpus, and
+ * cpu_get returns the cpu whose c_number is NUM.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned num);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -152,6 +182,10 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * It returns the target's c_shootdown_seq as of when the request was
+ * queued; the request is done once that changes.
+ * ipi_tlbshootdown_batch is the same for N mappings at once, sent
+ * with one IPI. N may be TLBSHOOTDOWN_ALL to flush the whole TLB.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -165,7 +199,10 @@ void cpu_halt(void);
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_batch(struct cpu *target,
+				const struct tlbshootdown *mappings, int n);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _FILE_H_
+#define _FILE_H_
+
+/*
+ * Open files and per-process file descriptor tables.
+ *
+ * An openfile is what open() creates: a vnode plus the access mode
+ * and the current seek position. Descriptors refer to openfiles, and
+ * several descriptors can refer to the same one - after dup2, or in
+ * a parent and child after fork - in which case they share the seek
+ * position. of_lock protects the position, and is held across each
+ * read or write so that concurrent I/O through shared descriptors
+ * doesn't lose updates. The reference count has its own spinlock,
+ * since it changes from fork and exit in other processes.
+ *
+ * A filetable maps descriptors to openfiles: entry FD is the openfile
+ * for FD, or NULL. Only the thread that owns a filetable (processes
+ * have one thread) ever looks at it or changes it, so it needs no
+ * lock, and looking up a descriptor is just an array index.
+ */
+
+#include <kern/errno.h>
+#include <limits.h>
+#include <spinlock.h>
+
+struct vnode;
+struct lock;
+
+struct openfile {
+	struct vnode *of_vnode;		/* the file */
+	int of_accmode;			/* O_RDONLY, O_WRONLY, or O_RDWR */
+	bool of_append;			/* O_APPEND: write at the end */
+	struct lock *of_lock;		/* protects of_offset */
+	off_t of_offset;		/* seek position */
+	struct spinlock of_countlock;	/* protects of_refcount */
+	unsigned of_refcount;		/* descriptors referring to us */
+};
+
+struct filetable {
+	struct openfile *ft_files[OPEN_MAX];
+};
+
+/*
+ * Functions in file.c:
+ *
+ *    openfile_open    - open PATH with open() FLAGS and MODE. PATH
+ *                       may be modified, as with vfs_open. Returns
+ *                       an openfile with one reference.
+ *    openfile_incref  - add a reference.
+ *    openfile_decref  - drop a reference; the last one closes the
+ *                       file.
+ *
+ *    filetable_create - make an empty filetable.
+ *    filetable_copy   - make a filetable referring to the same
+ *                       openfiles as SRC (for fork).
+ *    filetable_destroy - drop all the openfiles and free the table.
+ *    filetable_stdio  - open the console as descriptors 0, 1, and 2.
+ *    filetable_place  - put OF in the lowest free descriptor and
+ *                       hand it back. Fails with EMFILE if there
+ *                       isn't one. Takes over the caller's
+ *                       reference.
+ *    filetable_get    - hand back the openfile for FD, or fail with
+ *                       EBADF. Adds no reference. (Inline.)
+ */
+int openfile_open(char *path, int flags, mode_t mode, struct openfile **ret);
+void openfile_incref(struct openfile *of);
+void openfile_decref(struct openfile *of);
+
+struct filetable *filetable_create(void);
+int filetable_copy(struct filetable *src, struct filetable **ret);
+void filetable_destroy(struct filetable *ft);
+int filetable_stdio(struct filetable *ft);
+int filetable_place(struct filetable *ft, struct openfile *of, int *fd);
+int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
+
+/* Inlining support; see cdefs.h */
+#ifndef FILE_INLINE
+#define FILE_INLINE INLINE
+#endif
+
+FILE_INLINE
+int
+filetable_get(struct filetable *ft, int fd, struct openfile **ret)
+{
+	if (fd < 0 || fd >= OPEN_MAX || ft->ft_files[fd] == NULL) {
+		return EBADF;
+	}
+	*ret = ft->ft_files[fd];
+	return 0;
+}
+
+
+#endif /* _FILE_H_ */
@@ -34,6 +34,11 @@
  * ioctl operation codes
  */
 
-/* (none yet) */
+/*
+ * Console line discipline. The argument points to an int: nonzero
+ * for canonical (line-edited) input, zero for raw input.
+ */
+#define CONIOC_GETCANON	1	/* get input mode */
+#define CONIOC_SETCANON	2	/* set input mode */
 
 #endif /* _KERN_IOCTL_H_*/
@@ -67,6 +67,18 @@ struct rusage {
 	__counter_t ru_nsignals;	/* signals delivered (count) */
 	__counter_t ru_nvcsw;		/* voluntary context switches (count)*/
 	__counter_t ru_nivcsw;		/* involuntary ditto (count) */
+
+	/*
+	 * OS/161 extensions: where the VM faults came from. Zero-fill
+	 * and textcache faults are the minor ones, file and swap
+	 * faults the major ones.
+	 */
+	__counter_t ru_tlbflt;		/* TLB faults (count) */
+	__counter_t ru_zeroflt;		/* zero-filled pages (count) */
+	__counter_t ru_fileflt;		/* pages read from files (count) */
+	__counter_t ru_textflt;		/* pages shared from others (count) */
+	__counter_t ru_swapflt;		/* pages read from swap (count) */
+	__size_t ru_rss;		/* current RSS (kb) */
 };
 
 /* limit codes for getrusage/setrusage */
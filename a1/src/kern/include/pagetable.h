@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page tables for user address spaces.
+ *
+ * A virtual page number is split into a top-level index, which picks
+ * a second-level table, and a second-level index, which picks a page
+ * table entry within it. Each second-level table is one page and
+ * maps 4M of address space; they are allocated only when something
+ * in that range is mapped, so a sparse address space costs little.
+ *
+ * A page table entry holds the physical address of the page (or,
+ * if the page is out on swap, the swap slot number) in its high bits
+ * and flags in its low bits. An entry of 0 means nothing is mapped
+ * there yet.
+ *
+ * Functions:
+ *     pt_create  - Create an empty page table, or NULL if out of
+ *                  memory.
+ *     pt_destroy - Destroy a page table and free every page and swap
+ *                  slot it refers to, except shared (PTE_SHARED)
+ *                  pages, which belong to the text cache.
+ *     pt_lookup  - Return a pointer to the entry for VADDR. If there
+ *                  is no second-level table covering VADDR, return
+ *                  NULL, unless CREATE is set, in which case one is
+ *                  allocated (and NULL means out of memory).
+ */
+
+#include <vm.h>
+
+/* Page table entry fields */
+#define PTE_FRAME	0xfffff000	/* physical page */
+#define PTE_VALID	0x00000001	/* the page is in memory at PTE_FRAME */
+#define PTE_SWAPPED	0x00000002	/* the page is on swap */
+#define PTE_SHARED	0x00000004	/* valid, but the text cache's page */
+
+#define PTE_SWAPSLOT(pte)	((pte) >> 12)
+#define PTE_MKSWAP(slot)	(((slot) << 12) | PTE_SWAPPED)
+
+#define PT_L2BITS	10
+#define PT_L2SIZE	(1 << PT_L2BITS)	/* entries per second level */
+#define PT_L1SIZE	(USERSPACETOP / PAGE_SIZE / PT_L2SIZE)
+
+#define PT_L1INDEX(va)	((va) >> (12 + PT_L2BITS))
+#define PT_L2INDEX(va)	(((va) >> 12) & (PT_L2SIZE - 1))
+
+struct pagetable {
+	uint32_t *pt_l1[PT_L1SIZE];	/* second-level tables, or NULL */
+};
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+uint32_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+
+
+#endif /* _PAGETABLE_H_ */
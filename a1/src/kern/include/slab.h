@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+/*
+ * Object caches ("slab allocator").
+ *
+ * A kmem_cache hands out objects of one fixed size, carved out of
+ * whole pages ("slabs"). Each cache may have a constructor and a
+ * destructor. The constructor is run when an object is first carved
+ * out of a new slab, and the destructor when the slab is eventually
+ * given back; in between, the object stays constructed. That is,
+ * kmem_cache_alloc returns a constructed object, and callers must
+ * put it back in the same state before calling kmem_cache_free. This
+ * is meant for state that is expensive or fiddly to set up and tear
+ * down, like embedded spinlocks and lists.
+ *
+ * Successive slabs in a cache start their objects at different
+ * offsets ("colors") within the page, so that the same object in
+ * different slabs doesn't always land on the same cache lines.
+ *
+ * Objects must be smaller than a page (minus some overhead).
+ *
+ * Functions:
+ *     kmem_cache_create  - Create a cache for objects of size SIZE
+ *                          aligned to ALIGN (0 for the default).
+ *                          CTOR and DTOR may be NULL. NAME should be
+ *                          a string constant. Returns NULL if out of
+ *                          memory.
+ *     kmem_cache_destroy - Destroy a cache. All its objects must
+ *                          have been freed.
+ *     kmem_cache_alloc   - Get an object, or NULL if out of memory.
+ *     kmem_cache_free    - Return an object to its cache.
+ *     kmem_cache_printstats - Print statistics for all caches.
+ */
+
+struct kmem_cache;
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align,
+				     void (*ctor)(void *obj),
+				     void (*dtor)(void *obj));
+void kmem_cache_destroy(struct kmem_cache *kc);
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+void kmem_cache_printstats(void);
+
+
+#endif /* _SLAB_H_ */
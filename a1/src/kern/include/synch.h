@@ -36,22 +36,35 @@
 
 
 #include <spinlock.h>
+#include <wchan.h>
+
+/*
+ * Allocation.
+ *
+ * Each of the primitives below can be made in two ways. The _create
+ * functions allocate the object and a copy of its name and may fail;
+ * use the matching _destroy. The _init functions set up an object
+ * that is embedded in some larger structure (or is static), do no
+ * allocation at all, and cannot fail; the name is not copied, so it
+ * should be a string constant. Use the matching _cleanup.
+ */
 
 /*
  * Dijkstra-style semaphore.
  *
- * The name field is for easier debugging. A copy of the name is made
- * internally.
+ * The name field is for easier debugging.
  */
 struct semaphore {
-        char *sem_name;
-	struct wchan *sem_wchan;
+        const char *sem_name;
+	struct wchan sem_wchan;
 	struct spinlock sem_lock;
         volatile int sem_count;
 };
 
 struct semaphore *sem_create(const char *name, int initial_count);
 void sem_destroy(struct semaphore *);
+void sem_init(struct semaphore *, const char *name, int initial_count);
+void sem_cleanup(struct semaphore *);
 
 /*
  * Operations (both atomic):
@@ -69,17 +82,27 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
- * The name field is for easier debugging. A copy of the name is
- * (should be) made internally.
+ * The name field is for easier debugging.
  */
 struct lock {
-        char *lk_name;
-	struct wchan *lk_wchan;
+        const char *lk_name;
+	struct wchan lk_wchan;
 	struct spinlock lk_lock;
 	struct thread *volatile lk_holder;
+
+	/*
+	 * Priority inheritance. lk_waiters is the list (through
+	 * t_pinext) of threads blocked on this lock; lk_heldnext links
+	 * the holder's t_heldlocks list. Both are protected by the
+	 * priority inheritance spinlock, as is lk_holder when it
+	 * changes.
+	 */
+	struct thread *lk_waiters;
+	struct lock *lk_heldnext;
 };
 
 struct lock *lock_create(const char *name);
+void lock_init(struct lock *, const char *name);
 void lock_acquire(struct lock *);
 
 /*
@@ -90,12 +113,23 @@ void lock_acquire(struct lock *);
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock; 
  *                   false otherwise.
+ *    lock_tryacquire - Get the lock if nobody holds it, without
+ *                   sleeping. Returns true if it got the lock. Safe
+ *                   to call with spinlocks held.
+ *
+ * A thread that blocks in lock_acquire lends its priority to the
+ * holder, and through it to whatever the holder is itself blocked on,
+ * so a low-priority holder cannot be starved by medium-priority
+ * threads while a high-priority one waits. The loan is returned in
+ * lock_release, which wakes the highest-priority waiter first.
  *
  * These operations must be atomic. You get to write them.
  */
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
+bool lock_tryacquire(struct lock *);
 void lock_destroy(struct lock *);
+void lock_cleanup(struct lock *);
 
 
 /*
@@ -108,17 +142,18 @@ void lock_destroy(struct lock *);
  * These CVs are expected to support Mesa semantics, that is, no
  * guarantees are made about scheduling.
  *
- * The name field is for easier debugging. A copy of the name is
- * (should be) made internally.
+ * The name field is for easier debugging.
  */
 
 struct cv {
-        char *cv_name;
-	struct wchan *cv_wchan;
+        const char *cv_name;
+	struct wchan cv_wchan;
 };
 
 struct cv *cv_create(const char *name);
 void cv_destroy(struct cv *);
+void cv_init(struct cv *, const char *name);
+void cv_cleanup(struct cv *);
 
 /*
  * Operations:
@@ -137,5 +172,20 @@ void cv_wait(struct cv *cv, struct lock *lock);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
+/*
+ * Timed variants.
+ *
+ * P_timed, lock_acquire_timed and cv_wait_timed behave like P,
+ * lock_acquire and cv_wait, except that they give up after MSECS
+ * milliseconds (rounded up to whole hardclock ticks) and return
+ * ETIMEDOUT. They return 0 on success. A timeout of 0 makes P_timed
+ * and lock_acquire_timed just poll. cv_wait_timed always sleeps at
+ * least one tick and always reacquires the lock before returning,
+ * timed out or not.
+ */
+int P_timed(struct semaphore *, unsigned msecs);
+int lock_acquire_timed(struct lock *, unsigned msecs);
+int cv_wait_timed(struct cv *cv, struct lock *lock, unsigned msecs);
+
 
 #endif /* _SYNCH_H_ */
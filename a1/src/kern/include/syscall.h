@@ -32,6 +32,7 @@
 
 
 struct trapframe; /* from <machine/trapframe.h> */
+struct vnode;     /* from <vnode.h> */
 
 /*
  * The system call dispatcher.
@@ -50,6 +51,14 @@ void syscall(struct trapframe *tf);
  */
 void enter_forked_process(void *data1, unsigned long unused);
 
+/*
+ * The trapframe copy sys_fork passes to the child comes from an
+ * object cache; fork_bootstrap sets it up, and the child gives the
+ * copy back with fork_trapframe_free.
+ */
+void fork_bootstrap(void);
+void fork_trapframe_free(struct trapframe *tf);
+
 /* Enter user mode. Does not return. */
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
@@ -67,13 +76,23 @@ int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_read(int fd, userptr_t buf, size_t size, int *retval);
 int sys_write(int fd, userptr_t buf, size_t size, int *retval);
 
-/*
- * ASST1 - Prototypes for new bootstrap/shutdown functions needed by syscalls
- */
-void dumb_consoleIO_bootstrap(void);
+/* File descriptors */
+int sys_open(userptr_t path, int flags, mode_t mode, int *retval);
+int sys_close(int fd);
+int sys_lseek(int fd, off_t pos, int whence, off_t *retval);
+int sys_dup2(int oldfd, int newfd, int *retval);
+int sys_ioctl(int fd, int op, userptr_t data);
+int file_getvnode(int fd, struct vnode **ret);
 
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t *retval, pid_t pid, int *status, int options);
 int sys_kill(pid_t pid, int sig);
 
+/* Memory management (not with dumbvm) */
+int sys_sbrk(intptr_t amount, int *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_getrusage(int who, userptr_t usage);
+
 #endif /* _SYSCALL_H_ */
@@ -58,6 +58,8 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int pitest(int, char **);
+int timedtest(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -65,13 +67,21 @@ int readstress(int, char **);
 int writestress(int, char **);
 int writestress2(int, char **);
 int longstress(int, char **);
+int diskbench(int, char **);
 int printfile(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallocbench(int, char **);
 int nettest(int, char **);
 
+/* VM tests (not with dumbvm) */
+int swaptest(int, char **);
+int texttest(int, char **);
+int zerotest(int, char **);
+int shoottest(int, char **);
+
 /* Routine for running a user-level program. */
 int runprogram(char *progname, int argc, char **argv);
 
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+
+/*
+ * Shared program text (not with dumbvm).
+ *
+ * Read-only file-backed regions - program text, and read-only mmaps -
+ * don't get private pages. Instead their pages come from a textobj,
+ * one per file (vnode) and region layout, which is shared by every
+ * address space with that program loaded or that part of the file
+ * mapped. The layout is taken relative to the start of the region, so
+ * the same mapping at different addresses in different processes
+ * still shares. The first process to touch a page reads it in; the
+ * rest just map the same page. These pages are mapped with PTE_SHARED
+ * set, and are kept until the last region using the textobj goes
+ * away. They are not paged out, so only a fixed share of memory may
+ * be held in textobjs; beyond that, these pages are private like any
+ * others.
+ *
+ * Functions:
+ *     textcache_bootstrap - Initialize; called from as_bootstrap.
+ *     textcache_get       - Return the textobj for the file-backed
+ *                           region VR, creating it if need be, with
+ *                           a reference added. Returns NULL if out of
+ *                           memory; the region then just gets private
+ *                           pages like any other.
+ *     textcache_incref    - Add a reference (for as_copy).
+ *     textcache_release   - Drop a reference.
+ *     textcache_getpage   - Return in *RET the page for VADDR in
+ *                           region VR, which uses textobj TO, reading
+ *                           it in if nobody has yet, in which case
+ *                           *READIN is set to true. Returns an errno
+ *                           value. Sets *RET to 0 if the textcache is
+ *                           full; the caller should then use a private
+ *                           page.
+ */
+
+struct textobj;
+struct vm_region;
+
+void textcache_bootstrap(void);
+struct textobj *textcache_get(struct vm_region *vr);
+void textcache_incref(struct textobj *to);
+void textcache_release(struct textobj *to);
+int textcache_getpage(struct textobj *to, struct vm_region *vr,
+		      vaddr_t vaddr, paddr_t *ret, bool *readin);
+
+
+#endif /* _TEXTCACHE_H_ */
@@ -41,6 +41,8 @@
 
 struct addrspace;
 struct cpu;
+struct filetable;
+struct lock;
 struct vnode;
 
 /* get machine-dependent defs */
@@ -56,6 +58,11 @@ struct vnode;
 /* Macro to test if two addresses are on the same kernel stack */
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
+/* Thread priorities. Larger numbers are more important. */
+#define PRI_MIN		0
+#define PRI_DEFAULT	10
+#define PRI_MAX		31
+
 
 /* States a thread can be in. */
 typedef enum {
@@ -83,6 +90,7 @@ struct thread {
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
+	struct thread *t_inboxnext;	/* Link for t_cpu's c_inbox */
 
 	/*
 	 * Interrupt state fields.
@@ -101,6 +109,24 @@ struct thread {
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
 
+	/*
+	 * Scheduling fields.
+	 *
+	 * t_priority is the base priority set with thread_setpriority.
+	 * t_effpriority is what the scheduler actually uses; it is
+	 * t_priority raised by priority inheritance to that of the
+	 * most important thread waiting on any lock we hold.
+	 *
+	 * The priority inheritance fields (t_effpriority, t_waitlock,
+	 * t_pinext, t_heldlocks) are protected by the priority
+	 * inheritance spinlock in synch.c.
+	 */
+	int t_priority;			/* Base priority */
+	int t_effpriority;		/* Effective (inherited) priority */
+	struct lock *t_waitlock;	/* Lock we're blocked on, if any */
+	struct thread *t_pinext;	/* Next waiter on t_waitlock */
+	struct lock *t_heldlocks;	/* Locks we hold */
+
 	/*
 	 * Public fields
 	 */
@@ -113,6 +139,7 @@ struct thread {
 
 	/* VFS */
 	struct vnode *t_cwd;		/* current working directory */
+	struct filetable *t_filetable;	/* open files; see file.h */
 
 	/* add more here as needed */
 };
@@ -157,6 +184,19 @@ void thread_exit(int status);
  */
 void thread_yield(void);
 
+/*
+ * Set the base priority of the current thread. The effective priority
+ * may remain higher while we hold locks more important threads are
+ * waiting for. PRI must be between PRI_MIN and PRI_MAX.
+ */
+void thread_setpriority(int pri);
+
+/*
+ * Re-sort T into its cpu's run queue after its effective priority
+ * went up. Used by priority inheritance.
+ */
+void thread_requeue(struct thread *t);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
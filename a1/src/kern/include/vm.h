@@ -55,6 +55,92 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Physical page allocator (see vm/coremap.c).
+ *
+ * coremap_bootstrap takes over the rest of RAM from ram_stealmem;
+ * until it is called, coremap_alloc just steals memory.
+ * coremap_alloc gets NPAGES contiguous pages, charged to the kernel
+ * or to user address spaces; coremap_free frees a whole allocation
+ * given its first page.
+ */
+#define COREMAP_KERNEL	0
+#define COREMAP_USER	1
+
+void coremap_bootstrap(void);
+paddr_t coremap_alloc(unsigned long npages, int how);
+void coremap_free(paddr_t pa);
+void coremap_printstats(void);
+
+/*
+ * Support for paging (not with dumbvm; see coremap.c for details).
+ *
+ * coremap_setowner records where a user page is mapped, and makes it
+ * eligible for paging out. coremap_touch marks a user page as
+ * recently used. coremap_pickvictim chooses a page to page out;
+ * coremap_unbusy puts it back if it isn't paged out after all.
+ * coremap_nfree returns the number of free pages.
+ */
+struct addrspace;
+void coremap_setowner(paddr_t pa, struct addrspace *as, vaddr_t vaddr);
+void coremap_touch(paddr_t pa);
+paddr_t coremap_pickvictim(struct addrspace **as, vaddr_t *vaddr,
+			   bool *locked);
+void coremap_unbusy(paddr_t pa);
+unsigned coremap_nfree(void);
+
+/*
+ * Paging (vm/swap.c; not with dumbvm).
+ *
+ * swap_bootstrap opens the swap disk and starts the pageout thread.
+ * page_alloc gets a user page (busy; see above), paging other pages
+ * out if need be; it returns 0 if there's no memory and no swap
+ * space either. page_reclaim pages something out to make room for
+ * a kernel allocation; it returns false if it couldn't (or can't
+ * sleep here). pageout_wakeup starts the pageout thread if free
+ * memory is getting low. swap_pagein reads swap slot SLOT into the
+ * page at PA; swap_free releases the slot.
+ */
+void swap_bootstrap(void);
+paddr_t page_alloc(void);
+bool page_reclaim(void);
+void pageout_wakeup(void);
+int swap_pagein(unsigned slot, paddr_t pa);
+void swap_free(unsigned slot);
+
+/*
+ * Pre-zeroed pages (vm/zeropool.c; not with dumbvm).
+ *
+ * page_alloc_zeroed is page_alloc for a page that is to be zero
+ * filled; it takes one from the pool if it can. zeropool_get takes
+ * a page from the pool, or returns 0 if it's empty. zeropool_idle is
+ * called by idle cpus to refill the pool.
+ */
+paddr_t page_alloc_zeroed(void);
+paddr_t zeropool_get(void);
+bool zeropool_idle(void);
+
+/*
+ * TLB management (machine-dependent; not with dumbvm).
+ *
+ * vm_tlb_flush invalidates this cpu's whole TLB. vm_tlb_asinit and
+ * vm_tlb_ascleanup set up and tear down an address space's TLB
+ * state; vm_tlb_activate makes an address space current on this cpu.
+ * vm_tlb_invalidate drops this cpu's TLB entry for VADDR in AS, if
+ * any; vm_tlb_shootdown does so on all cpus, and waits until it's
+ * done. vm_tlb_shootdown_many does the same for N mappings at once.
+ */
+void vm_tlb_flush(void);
+int vm_tlb_asinit(struct addrspace *as);
+void vm_tlb_ascleanup(struct addrspace *as);
+void vm_tlb_activate(struct addrspace *as);
+void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr);
+void vm_tlb_shootdown(struct addrspace *as, vaddr_t vaddr);
+void vm_tlb_shootdown_many(const struct tlbshootdown *ts, unsigned n);
+
+/* Print vm_fault's latency histograms (not with dumbvm). */
+void vm_printfaultstats(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
@@ -34,8 +34,19 @@
  * Wait channel.
  */
 
+#include <spinlock.h>
+#include <threadlist.h>
 
-struct wchan; /* Opaque */
+/*
+ * The structure is only public so wait channels can be embedded in
+ * other structures (such as the synchronization primitives) without
+ * a separate allocation. Don't touch the fields outside thread.c.
+ */
+struct wchan {
+	const char *wc_name;		/* name for this channel */
+	struct threadlist wc_threads;	/* list of waiting threads */
+	struct spinlock wc_lock;	/* lock for mutual exclusion */
+};
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -49,6 +60,13 @@ struct wchan *wchan_create(const char *name);
  */
 void wchan_destroy(struct wchan *wc);
 
+/*
+ * Same as wchan_create and wchan_destroy, but for a wait channel
+ * that lives inside some other structure. Doesn't allocate.
+ */
+void wchan_init(struct wchan *wc, const char *name);
+void wchan_cleanup(struct wchan *wc);
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -71,6 +89,13 @@ void wchan_unlock(struct wchan *wc);
  */
 void wchan_sleep(struct wchan *wc);
 
+/*
+ * Like wchan_sleep, but give up after TICKS hardclock ticks (see
+ * clock.h) if nobody wakes us first. Returns ETIMEDOUT in that case,
+ * or 0 if woken normally.
+ */
+int wchan_sleep_timed(struct wchan *wc, unsigned ticks);
+
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
  * The queue should not already be locked.
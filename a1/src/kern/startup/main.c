@@ -50,6 +50,7 @@
 #include <version.h>
 #include <pid.h> /* to bootstrap process ID system - New for ASST1 */
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-dumbvm.h"
 
 
 /*
@@ -128,7 +129,10 @@ boot(void)
 	 * come before additional cpus are brought online.
 	 */
 	pid_bootstrap(); 
-	dumb_consoleIO_bootstrap(); /* And initialize for user console IO */
+	fork_bootstrap();
+#if !OPT_DUMBVM
+	swap_bootstrap();	/* needs devices, vfs and thread_fork */
+#endif
 
 	thread_start_cpus();
 
@@ -36,11 +36,16 @@
 #include <lib.h>
 #include <uio.h>
 #include <clock.h>
+#include <counter.h>
 #include <thread.h>
 #include <vfs.h>
 #include <syscall.h>
 #include <test.h>
 #include <pid.h>
+#include <slab.h>
+#include <vm.h>
+#include <heapprof.h>
+#include "opt-dumbvm.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -513,6 +518,70 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_slabstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kmem_cache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+
+	return 0;
+}
+
+#if OPT_HEAPPROF
+static
+int
+cmd_heapprof(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	heapprof_printstats();
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_counters(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	counter_printstats();
+
+	return 0;
+}
+
+#if !OPT_DUMBVM
+static
+int
+cmd_vmfaultstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printfaultstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -574,6 +643,7 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] kmalloc benchmark             ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -583,11 +653,20 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Priority inheritance test     ",
+	"[sy5] Timed wait test               ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress        (4)     ",
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS long stress        (4)     ",
+	"[fs6] Disk throughput benchmark     ",
+#if !OPT_DUMBVM
+	"[vm1] Swap test                     ",
+	"[vm2] Text sharing test             ",
+	"[vm3] Zero page test                ",
+	"[vm4] TLB shootdown test            ",
+#endif
 	NULL
 };
 
@@ -612,6 +691,15 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[ks] Object cache stats             ",
+	"[cm] Physical memory stats          ",
+	"[kc] Kernel counters                ",
+#if !OPT_DUMBVM
+	"[vf] VM fault latency               ",
+#endif
+#if OPT_HEAPPROF
+	"[kp] Kernel heap profile            ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -660,12 +748,22 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "ks",         cmd_slabstats },
+	{ "cm",         cmd_coremapstats },
+	{ "kc",         cmd_counters },
+#if !OPT_DUMBVM
+	{ "vf",         cmd_vmfaultstats },
+#endif
+#if OPT_HEAPPROF
+	{ "kp",         cmd_heapprof },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	mallocbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -677,6 +775,8 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	pitest },
+	{ "sy5",	timedtest },
 
 	/* ASST1 tests */
 	/* For testing the wait implementation. */
@@ -688,6 +788,15 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
+	{ "fs6",	diskbench },
+
+	/* VM tests */
+#if !OPT_DUMBVM
+	{ "vm1",	swaptest },
+	{ "vm2",	texttest },
+	{ "vm3",	zerotest },
+	{ "vm4",	shoottest },
+#endif
 
 	{ NULL, NULL }
 };
@@ -1,50 +1,28 @@
 /*
  * File-related system call implementations.
  * New for ASST1
- * Only crippled version of read/write for console I/O.
+ * Descriptors are looked up in the calling process's filetable; see
+ * file.h.
  */
 
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/unistd.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
+#include <limits.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <thread.h>
 #include <current.h>
+#include <copyinout.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <file.h>
 #include <kern/fcntl.h>
 #include <syscall.h>
 
-/* dumb_consoleIO_bootstrap
- * Initialize a vnode for the console device so that
- * user programs can use it.
- */
-struct vnode *cons_vnode;
-
-void dumb_consoleIO_bootstrap() 
-{
-  int result;
-  char path[5];
-
-  /* The path passed to vfs_open must be mutable. 
-   * vfs_open may modify it.
-   */
-  
-  strcpy(path, "con:");
-  result = vfs_open(path, O_RDWR, 0, &cons_vnode);
-
-  if (result) {
-    /* Tough one... if there's no console, there's not
-     * much point printing a warning...
-     * but maybe the bootstrap was just called in the wrong place
-     */
-    kprintf("Warning: could not initialize console vnode\n");
-    kprintf("User programs will not be able to read/write\n");
-    cons_vnode = NULL;
-  }
-}
-
 /*
  * mk_useruio
  * sets up the uio for a USERSPACE transfer. 
@@ -67,39 +45,111 @@ mk_useruio(struct iovec *iov, struct uio *u,
 	u->uio_space = curthread->t_addrspace;
 }
 
+/*
+ * getfile
+ * looks up a descriptor of the current process.
+ */
+static
+int
+getfile(int fd, struct openfile **ret)
+{
+	if (curthread->t_filetable == NULL) {
+		return EBADF;
+	}
+	return filetable_get(curthread->t_filetable, fd, ret);
+}
+
+/*
+ * sys_open
+ * opens a file and hands back the lowest free descriptor for it.
+ */
+int
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
+{
+	struct openfile *of;
+	char *path;
+	int result;
+
+	if (curthread->t_filetable == NULL) {
+		return EMFILE;
+	}
+
+	path = kmalloc(PATH_MAX);
+	if (path == NULL) {
+		return ENOMEM;
+	}
+	result = copyinstr(upath, path, PATH_MAX, NULL);
+	if (result) {
+		kfree(path);
+		return result;
+	}
+
+	result = openfile_open(path, flags, mode, &of);
+	kfree(path);
+	if (result) {
+		return result;
+	}
+
+	result = filetable_place(curthread->t_filetable, of, retval);
+	if (result) {
+		openfile_decref(of);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * sys_close
+ * drops a descriptor.
+ */
+int
+sys_close(int fd)
+{
+	struct openfile *of;
+	int result;
+
+	result = getfile(fd, &of);
+	if (result) {
+		return result;
+	}
+	curthread->t_filetable->ft_files[fd] = NULL;
+	openfile_decref(of);
+	return 0;
+}
+
 /*
  * sys_read
- * calls VOP_READ.
+ * calls VOP_READ at the file's seek position, and advances it.
  */
 int
 sys_read(int fd, userptr_t buf, size_t size, int *retval)
 {
+	struct openfile *of;
 	struct uio user_uio;
 	struct iovec user_iov;
 	int result;
-	int offset = 0;
 
-	/* Make sure we were able to init the cons_vnode */
-	if (cons_vnode == NULL) {
-	  return ENODEV;
+	result = getfile(fd, &of);
+	if (result) {
+		return result;
 	}
-
-	/* better be a valid file descriptor */
-	/* Right now, only stdin (0), stdout (1) and stderr (2)
-	 * are supported, and they can't be redirected to a file
-	 */
-	if (fd < 0 || fd > 2) {
-	  return EBADF;
+	if (of->of_accmode == O_WRONLY) {
+		return EBADF;
 	}
 
+	lock_acquire(of->of_lock);
+
 	/* set up a uio with the buffer, its size, and the current offset */
-	mk_useruio(&user_iov, &user_uio, buf, size, offset, UIO_READ);
+	mk_useruio(&user_iov, &user_uio, buf, size, of->of_offset, UIO_READ);
 
 	/* does the read */
-	result = VOP_READ(cons_vnode, &user_uio);
+	result = VOP_READ(of->of_vnode, &user_uio);
 	if (result) {
+		lock_release(of->of_lock);
 		return result;
 	}
+	of->of_offset = user_uio.uio_offset;
+	lock_release(of->of_lock);
 
 	/*
 	 * The amount read is the size of the buffer originally, minus
@@ -112,36 +162,48 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 
 /*
  * sys_write
- * calls VOP_WRITE.
+ * calls VOP_WRITE at the file's seek position (or its end, for
+ * O_APPEND), and advances it.
  */
 int
 sys_write(int fd, userptr_t buf, size_t size, int *retval)
 {
+	struct openfile *of;
 	struct uio user_uio;
 	struct iovec user_iov;
+	struct stat st;
 	int result;
-	int offset = 0;
 
-	/* Make sure we were able to init the cons_vnode */
-	if (cons_vnode == NULL) {
-	  return ENODEV;
+	result = getfile(fd, &of);
+	if (result) {
+		return result;
+	}
+	if (of->of_accmode == O_RDONLY) {
+		return EBADF;
 	}
 
-	/* Right now, only stdin (0), stdout (1) and stderr (2)
-	 * are supported, and they can't be redirected to a file
-	 */
-	if (fd < 0 || fd > 2) {
-	  return EBADF;
+	lock_acquire(of->of_lock);
+
+	if (of->of_append) {
+		result = VOP_STAT(of->of_vnode, &st);
+		if (result) {
+			lock_release(of->of_lock);
+			return result;
+		}
+		of->of_offset = st.st_size;
 	}
 
 	/* set up a uio with the buffer, its size, and the current offset */
-	mk_useruio(&user_iov, &user_uio, buf, size, offset, UIO_WRITE);
+	mk_useruio(&user_iov, &user_uio, buf, size, of->of_offset, UIO_WRITE);
 
 	/* does the write */
-	result = VOP_WRITE(cons_vnode, &user_uio);
+	result = VOP_WRITE(of->of_vnode, &user_uio);
 	if (result) {
+		lock_release(of->of_lock);
 		return result;
 	}
+	of->of_offset = user_uio.uio_offset;
+	lock_release(of->of_lock);
 
 	/*
 	 * the amount written is the size of the buffer originally,
@@ -152,3 +214,128 @@ sys_write(int fd, userptr_t buf, size_t size, int *retval)
 	return 0;
 }
 
+/*
+ * sys_lseek
+ * moves the seek position, if the file can seek.
+ */
+int
+sys_lseek(int fd, off_t pos, int whence, off_t *retval)
+{
+	struct openfile *of;
+	struct stat st;
+	off_t newpos;
+	int result;
+
+	result = getfile(fd, &of);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(of->of_lock);
+	switch (whence) {
+	    case SEEK_SET:
+		newpos = pos;
+		break;
+	    case SEEK_CUR:
+		newpos = of->of_offset + pos;
+		break;
+	    case SEEK_END:
+		result = VOP_STAT(of->of_vnode, &st);
+		if (result) {
+			lock_release(of->of_lock);
+			return result;
+		}
+		newpos = st.st_size + pos;
+		break;
+	    default:
+		lock_release(of->of_lock);
+		return EINVAL;
+	}
+	if (newpos < 0) {
+		lock_release(of->of_lock);
+		return EINVAL;
+	}
+	result = VOP_TRYSEEK(of->of_vnode, newpos);
+	if (result) {
+		lock_release(of->of_lock);
+		return result;
+	}
+	of->of_offset = newpos;
+	lock_release(of->of_lock);
+
+	*retval = newpos;
+	return 0;
+}
+
+/*
+ * sys_dup2
+ * makes NEWFD refer to the same open file as OLDFD, closing whatever
+ * NEWFD referred to before.
+ */
+int
+sys_dup2(int oldfd, int newfd, int *retval)
+{
+	struct filetable *ft;
+	struct openfile *of;
+	int result;
+
+	result = getfile(oldfd, &of);
+	if (result) {
+		return result;
+	}
+	if (newfd < 0 || newfd >= OPEN_MAX) {
+		return EBADF;
+	}
+
+	ft = curthread->t_filetable;
+	if (ft->ft_files[newfd] != of) {
+		openfile_incref(of);
+		if (ft->ft_files[newfd] != NULL) {
+			openfile_decref(ft->ft_files[newfd]);
+		}
+		ft->ft_files[newfd] = of;
+	}
+	*retval = newfd;
+	return 0;
+}
+
+/*
+ * sys_ioctl
+ * passes OP and its argument to the file's vnode.
+ */
+int
+sys_ioctl(int fd, int op, userptr_t data)
+{
+	struct openfile *of;
+	int result;
+
+	result = getfile(fd, &of);
+	if (result) {
+		return result;
+	}
+	return VOP_IOCTL(of->of_vnode, op, data);
+}
+
+/*
+ * file_getvnode
+ * hands back the vnode open on a file descriptor, for calls like
+ * mmap that work on the file itself rather than through read and
+ * write. The file must be open for reading.
+ * No reference is added; the caller takes its own if it keeps it.
+ */
+int
+file_getvnode(int fd, struct vnode **ret)
+{
+	struct openfile *of;
+	int result;
+
+	result = getfile(fd, &of);
+	if (result) {
+		return result;
+	}
+	if (of->of_accmode == O_WRONLY) {
+		return EACCES;
+	}
+	*ret = of->of_vnode;
+	return 0;
+}
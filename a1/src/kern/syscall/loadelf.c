@@ -42,8 +42,9 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Without dumbvm, "loading" a chunk just tells the VM system where
+ * in the file it is (as_define_file); the pages are read in when the
+ * program first touches them.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -60,6 +61,7 @@
 #include <vnode.h>
 #include <elf.h>
 
+#if OPT_DUMBVM
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -143,6 +145,29 @@ load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
 	
 	return result;
 }
+#else
+/*
+ * Map a segment at virtual address VADDR, as above, except that the
+ * file data is read in later on demand. The region itself has
+ * already been defined.
+ */
+static
+int
+map_segment(struct vnode *v, off_t offset, vaddr_t vaddr, 
+	    size_t memsize, size_t filesize)
+{
+	if (filesize > memsize) {
+		kprintf("ELF: warning: segment filesize > segment memsize\n");
+		filesize = memsize;
+	}
+
+	DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n", 
+	      (unsigned long) filesize, (unsigned long) vaddr);
+
+	return as_define_file(curthread->t_addrspace, vaddr, filesize,
+			      v, offset);
+}
+#endif
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -284,9 +309,14 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_DUMBVM
 		result = load_segment(v, ph.p_offset, ph.p_vaddr, 
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
+#else
+		result = map_segment(v, ph.p_offset, ph.p_vaddr, 
+				     ph.p_memsz, ph.p_filesz);
+#endif
 		if (result) {
 			return result;
 		}
@@ -11,6 +11,7 @@
 #include <pid.h>
 #include <machine/trapframe.h>
 #include <syscall.h>
+#include <slab.h>
 #include <limits.h>
 #include <kern/wait.h> 
 #include <copyinout.h>
@@ -22,6 +23,26 @@
  * 
  * create a new process, which begins executing in md_forkentry().
  */
+/* Cache for trapframe copies in flight from sys_fork to the child. */
+static struct kmem_cache *trapframe_cache;
+
+void
+fork_bootstrap(void)
+{
+	trapframe_cache = kmem_cache_create("trapframe",
+					    sizeof(struct trapframe), 0,
+					    NULL, NULL);
+	if (trapframe_cache == NULL) {
+		panic("fork_bootstrap: Out of memory\n");
+	}
+}
+
+void
+fork_trapframe_free(struct trapframe *tf)
+{
+	kmem_cache_free(trapframe_cache, tf);
+}
+
 int
 sys_fork(struct trapframe *tf, pid_t *retval)
 {
@@ -34,7 +55,7 @@ sys_fork(struct trapframe *tf, pid_t *retval)
 	 * before the child runs. The child will free the copy.
 	 */
 
-	ntf = kmalloc(sizeof(struct trapframe));
+	ntf = kmem_cache_alloc(trapframe_cache);
 	if (ntf==NULL) {
 		return ENOMEM;
 	}
@@ -43,7 +64,7 @@ sys_fork(struct trapframe *tf, pid_t *retval)
 	result = thread_fork(curthread->t_name, enter_forked_process, 
 			     ntf, 0, retval);
 	if (result) {
-		kfree(ntf);
+		fork_trapframe_free(ntf);
 		return result;
 	}
 
@@ -42,6 +42,7 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <vfs.h>
+#include <file.h>
 #include <syscall.h>
 #include <test.h>
 #include <copyinout.h>
@@ -89,6 +90,18 @@ runprogram(char *progname, int argc, char **argv)
 	/* Done with the file now. */
 	vfs_close(v);
 
+	/* Give it standard input, output, and error on the console. */
+	KASSERT(curthread->t_filetable == NULL);
+	curthread->t_filetable = filetable_create();
+	if (curthread->t_filetable == NULL) {
+		return ENOMEM;
+	}
+	result = filetable_stdio(curthread->t_filetable);
+	if (result) {
+		/* thread_exit destroys curthread->t_filetable */
+		return result;
+	}
+
 	/* Define the user stack in the address space */
 	result = as_define_stack(curthread->t_addrspace, &stackptr);
 	if (result) {
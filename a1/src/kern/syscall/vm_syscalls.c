@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Memory-management system calls (not with dumbvm).
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/time.h>
+#include <kern/resource.h>
+#include <lib.h>
+#include <thread.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/*
+ * sbrk: move the heap break. Returns the old break.
+ */
+int
+sys_sbrk(intptr_t amount, int *retval)
+{
+	struct addrspace *as;
+	vaddr_t oldbreak;
+	int result;
+
+	as = curthread->t_addrspace;
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	result = as_sbrk(as, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+	*retval = (int)oldbreak;
+	return 0;
+}
+
+/*
+ * mmap: map part of an open file into memory. Returns the address.
+ *
+ * ADDR is only a hint, and is ignored; MAP_FIXED isn't supported.
+ * Shared writeable mappings aren't either, since nothing writes
+ * pages back to the file.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int *retval)
+{
+	struct addrspace *as;
+	struct vnode *v;
+	vaddr_t base;
+	unsigned perms;
+	int result;
+
+	(void)addr;
+
+	as = curthread->t_addrspace;
+	if (as == NULL) {
+		return ENOMEM;
+	}
+
+	if (len == 0 || offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0) {
+		return EINVAL;
+	}
+	if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0) {
+		return EINVAL;
+	}
+	switch (flags) {
+	    case MAP_PRIVATE:
+		break;
+	    case MAP_SHARED:
+		if (prot & PROT_WRITE) {
+			return EUNIMP;
+		}
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	perms = 0;
+	if (prot & PROT_READ) {
+		perms |= VR_READ;
+	}
+	if (prot & PROT_WRITE) {
+		perms |= VR_WRITE;
+	}
+	if (prot & PROT_EXEC) {
+		perms |= VR_EXEC;
+	}
+
+	result = file_getvnode(fd, &v);
+	if (result) {
+		return result;
+	}
+	result = as_mmap(as, len, perms, v, offset, &base);
+	if (result) {
+		return result;
+	}
+	*retval = (int)base;
+	return 0;
+}
+
+/*
+ * munmap: remove a mapping made by mmap.
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	as = curthread->t_addrspace;
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_munmap(as, (vaddr_t)addr, len);
+}
+
+/*
+ * getrusage: report resource usage. Only the VM fields are kept
+ * track of, and only for the calling process; the rest are zero.
+ */
+int
+sys_getrusage(int who, userptr_t usage)
+{
+	struct addrspace *as;
+	struct vmstats vs;
+	struct rusage ru;
+
+	if (who != RUSAGE_SELF) {
+		return EINVAL;
+	}
+
+	bzero(&ru, sizeof(ru));
+	as = curthread->t_addrspace;
+	if (as != NULL) {
+		as_getstats(as, &vs);
+		ru.ru_maxrss = vs.vs_maxresident * (PAGE_SIZE / 1024);
+		ru.ru_minflt = vs.vs_zerofaults + vs.vs_textfaults;
+		ru.ru_majflt = vs.vs_filefaults + vs.vs_swapfaults;
+		ru.ru_inblock = vs.vs_filefaults + vs.vs_swapfaults;
+		ru.ru_tlbflt = vs.vs_tlbfaults;
+		ru.ru_zeroflt = vs.vs_zerofaults;
+		ru.ru_fileflt = vs.vs_filefaults;
+		ru.ru_textflt = vs.vs_textfaults;
+		ru.ru_swapflt = vs.vs_swapfaults;
+		ru.ru_rss = vs.vs_resident * (PAGE_SIZE / 1024);
+	}
+	return copyout(&ru, usage, sizeof(ru));
+}
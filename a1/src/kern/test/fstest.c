@@ -41,6 +41,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <thread.h>
@@ -48,6 +49,7 @@
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <clock.h>
 #include <test.h>
 
 #define SLOGAN   "HODIE MIHI - CRAS TIBI\n"
@@ -535,6 +537,174 @@ dolongstress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Raw disk throughput benchmark.
+ *
+ * Reads the first DBENCH_NCHUNKS chunks of a raw disk device (e.g.
+ * lhd1raw:) three ways: sequentially from one thread; with NTHREADS
+ * threads taking every NTHREADS'th chunk, so neighboring requests
+ * arrive from different threads at once; and with NTHREADS threads
+ * each reading its share in scattered order, which leaves it to the
+ * disk queue to sort them out. It only reads, so it's safe to run on
+ * a disk with a filesystem on it. The "kc" menu command shows how
+ * many requests the driver merged.
+ */
+
+#define DBENCH_CHUNK    4096
+#define DBENCH_NCHUNKS  256
+
+static struct vnode *dbench_vn;
+static unsigned dbench_nchunks;
+static unsigned dbench_nthreads;
+static bool dbench_scatter;
+static volatile int dbench_errors;
+
+static
+void
+diskbench_thread(void *unused, unsigned long num)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	unsigned i, chunk;
+	int err;
+
+	(void)unused;
+
+	buf = kmalloc(DBENCH_CHUNK);
+	if (buf == NULL) {
+		kprintf("*** Thread %lu: out of memory\n", num);
+		dbench_errors++;
+		V(threadsem);
+		return;
+	}
+
+	for (i = num; i < dbench_nchunks; i += dbench_nthreads) {
+		chunk = i;
+		if (dbench_scatter) {
+			/*
+			 * A permutation, as long as dbench_nchunks
+			 * isn't a multiple of 97.
+			 */
+			chunk = (i * 97) % dbench_nchunks;
+		}
+		uio_kinit(&iov, &ku, buf, DBENCH_CHUNK,
+			  (off_t)chunk * DBENCH_CHUNK, UIO_READ);
+		err = VOP_READ(dbench_vn, &ku);
+		if (err) {
+			kprintf("*** Thread %lu: chunk %u: %s\n", num, chunk,
+				strerror(err));
+			dbench_errors++;
+			break;
+		}
+	}
+
+	kfree(buf);
+	V(threadsem);
+}
+
+static
+void
+diskbench_pass(const char *what, unsigned nthreads, bool scatter)
+{
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+	unsigned long kbytes, msecs;
+	unsigned i;
+	int err;
+
+	dbench_nthreads = nthreads;
+	dbench_scatter = scatter;
+	dbench_errors = 0;
+
+	gettime(&secs1, &nsecs1);
+
+	for (i=0; i<nthreads; i++) {
+		err = thread_fork("diskbench",
+				  diskbench_thread, NULL, i,
+				  NULL);
+		if (err) {
+			panic("diskbench: thread_fork failed: %s\n",
+			      strerror(err));
+		}
+	}
+
+	for (i=0; i<nthreads; i++) {
+		P(threadsem);
+	}
+
+	gettime(&secs2, &nsecs2);
+
+	if (dbench_errors) {
+		kprintf("*** %s: failed\n", what);
+		return;
+	}
+
+	if (nsecs2 < nsecs1) {
+		nsecs2 += 1000000000;
+		secs2--;
+	}
+	msecs = (secs2 - secs1) * 1000 + (nsecs2 - nsecs1) / 1000000;
+	if (msecs == 0) {
+		msecs = 1;
+	}
+	kbytes = (unsigned long)dbench_nchunks * DBENCH_CHUNK / 1024;
+
+	kprintf("%s, %u thread(s): %lu KB in %lu ms: %lu KB/sec\n",
+		what, nthreads, kbytes, msecs, kbytes * 1000 / msecs);
+}
+
+static
+void
+dodiskbench(const char *device)
+{
+	char name[32];
+	struct stat st;
+	int err;
+
+	init_threadsem();
+
+	kprintf("*** Starting disk throughput benchmark on %s:\n", device);
+
+	/* vfs_open destroys the string it's passed */
+	snprintf(name, sizeof(name), "%s:", device);
+	err = vfs_open(name, O_RDONLY, 0664, &dbench_vn);
+	if (err) {
+		kprintf("Could not open %s: %s\n", device, strerror(err));
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	err = VOP_STAT(dbench_vn, &st);
+	if (err) {
+		kprintf("Could not stat %s: %s\n", device, strerror(err));
+		kprintf("*** Test failed\n");
+		vfs_close(dbench_vn);
+		return;
+	}
+	dbench_nchunks = DBENCH_NCHUNKS;
+	if (st.st_size / DBENCH_CHUNK < dbench_nchunks) {
+		dbench_nchunks = st.st_size / DBENCH_CHUNK;
+	}
+	if (dbench_nchunks == 0) {
+		kprintf("%s is too small (or not a raw disk)\n", device);
+		kprintf("*** Test failed\n");
+		vfs_close(dbench_vn);
+		return;
+	}
+
+	diskbench_pass("sequential", 1, false);
+	diskbench_pass("interleaved", NTHREADS, false);
+	diskbench_pass("scattered", NTHREADS, true);
+
+	vfs_close(dbench_vn);
+	dbench_vn = NULL;
+
+	kprintf("*** Disk throughput benchmark done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -542,7 +712,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[12345] filesystem:\n");
+		kprintf("Usage: fs[123456] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -574,6 +744,7 @@ DEFTEST(readstress);
 DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(longstress);
+DEFTEST(diskbench);
 
 ////////////////////////////////////////////////////////////
 
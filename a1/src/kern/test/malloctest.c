@@ -32,6 +32,7 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <clock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -138,3 +139,103 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * kmalloc throughput benchmark.
+ *
+ * NTHREADS threads each repeatedly allocate a batch of BENCH_BATCH
+ * blocks, cycling through all the subpage sizes, and then free them
+ * again. We report the combined allocation and free rate, which is
+ * mostly a measure of how well kmalloc scales across cpus.
+ */
+
+#define BENCH_ROUNDS  500
+#define BENCH_BATCH   16
+
+static const size_t benchsizes[] = { 12, 24, 48, 100, 200, 500, 1000, 2000 };
+#define NBENCHSIZES (sizeof(benchsizes) / sizeof(benchsizes[0]))
+
+static
+void
+mallocbenchthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	void *ptrs[BENCH_BATCH];
+	unsigned i, j;
+
+	for (i=0; i<BENCH_ROUNDS; i++) {
+		for (j=0; j<BENCH_BATCH; j++) {
+			ptrs[j] = kmalloc(benchsizes[(num+i+j) % NBENCHSIZES]);
+			if (ptrs[j] == NULL) {
+				kprintf("thread %lu: kmalloc returned NULL\n",
+					num);
+				while (j-- > 0) {
+					kfree(ptrs[j]);
+				}
+				V(sem);
+				return;
+			}
+		}
+		for (j=0; j<BENCH_BATCH; j++) {
+			kfree(ptrs[j]);
+		}
+	}
+	V(sem);
+}
+
+int
+mallocbench(int nargs, char **args)
+{
+	struct semaphore *sem;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+	unsigned long ops, msecs;
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	sem = sem_create("mallocbench", 0);
+	if (sem == NULL) {
+		panic("mallocbench: sem_create failed\n");
+	}
+
+	kprintf("Starting kmalloc benchmark with %d threads...\n", NTHREADS);
+
+	gettime(&secs1, &nsecs1);
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("mallocbench",
+				     mallocbenchthread, sem, i,
+				     NULL);
+		if (result) {
+			panic("mallocbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	for (i=0; i<NTHREADS; i++) {
+		P(sem);
+	}
+
+	gettime(&secs2, &nsecs2);
+	sem_destroy(sem);
+
+	if (nsecs2 < nsecs1) {
+		nsecs2 += 1000000000;
+		secs2--;
+	}
+	msecs = (secs2 - secs1) * 1000 + (nsecs2 - nsecs1) / 1000000;
+	if (msecs == 0) {
+		msecs = 1;
+	}
+	ops = 2UL * NTHREADS * BENCH_ROUNDS * BENCH_BATCH;
+
+	kprintf("%lu kmalloc/kfree operations in %lu ms: %lu ops/sec\n",
+		ops, msecs, ops * 1000 / msecs);
+	kprintf("kmalloc benchmark done\n");
+
+	return 0;
+}
@@ -32,9 +32,11 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
+#include <current.h>
 #include <synch.h>
 #include <test.h>
 #include <kern/sysexits.h>
@@ -304,3 +306,351 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Sleep for about MSECS milliseconds.
+ */
+static
+void
+timednap(unsigned msecs)
+{
+	struct semaphore sem;
+
+	sem_init(&sem, "timednap", 0);
+	(void)P_timed(&sem, msecs);
+	sem_cleanup(&sem);
+}
+
+/*
+ * Milliseconds since SECS/NSECS.
+ */
+static
+unsigned
+timedelapsed(time_t secs, uint32_t nsecs)
+{
+	time_t nowsecs;
+	uint32_t nownsecs;
+
+	gettime(&nowsecs, &nownsecs);
+	getinterval(secs, nsecs, nowsecs, nownsecs, &nowsecs, &nownsecs);
+	return nowsecs * 1000 + nownsecs / 1000000;
+}
+
+static
+void
+timedtestthread(void *junk, unsigned long num)
+{
+	int result;
+
+	(void)junk;
+
+	switch (num) {
+	    case 0:
+		/* testlock is held by the main thread; this must time out */
+		result = lock_acquire_timed(testlock, 100);
+		if (result != ETIMEDOUT) {
+			kprintf("lock_acquire_timed: expected ETIMEDOUT, "
+				"got %d\n", result);
+			if (result == 0) {
+				lock_release(testlock);
+			}
+			testval1 = 1;
+		}
+		break;
+
+	    case 1:
+		/* The main thread is in cv_wait_timed; wake it early */
+		timednap(50);
+		lock_acquire(testlock);
+		cv_signal(testcv, testlock);
+		lock_release(testlock);
+		break;
+
+	    case 2:
+		/* Hold testlock briefly while the main thread waits */
+		lock_acquire(testlock);
+		V(donesem);
+		timednap(50);
+		lock_release(testlock);
+		break;
+	}
+	V(donesem);
+}
+
+/*
+ * Check the timed waits: each should give up when nothing happens,
+ * and return normally when something does.
+ */
+int
+timedtest(int nargs, char **args)
+{
+	struct semaphore sem;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting timed wait test...\n");
+
+	testval1 = 0;
+	sem_init(&sem, "timedtest", 0);
+
+	gettime(&secs1, &nsecs1);
+	result = P_timed(&sem, 200);
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs2, &nsecs2);
+	if (result != ETIMEDOUT) {
+		kprintf("P_timed: expected ETIMEDOUT, got %d\n", result);
+		testval1 = 1;
+	}
+	else if (secs2 == 0 && nsecs2 < 190000000) {
+		kprintf("P_timed: gave up after only %u ns\n", nsecs2);
+		testval1 = 1;
+	}
+
+	V(&sem);
+	result = P_timed(&sem, 0);
+	if (result != 0) {
+		kprintf("P_timed: expected success, got %d\n", result);
+		testval1 = 1;
+	}
+
+	lock_acquire(testlock);
+	result = thread_fork("timedtest", timedtestthread, NULL, 0, NULL);
+	if (result) {
+		panic("timedtest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(donesem);
+
+	result = cv_wait_timed(testcv, testlock, 100);
+	if (result != ETIMEDOUT) {
+		kprintf("cv_wait_timed: expected ETIMEDOUT, got %d\n", result);
+		testval1 = 1;
+	}
+	if (!lock_do_i_hold(testlock)) {
+		kprintf("cv_wait_timed: returned without the lock\n");
+		testval1 = 1;
+	}
+
+	/*
+	 * Now get woken before the deadline. The call should return
+	 * 0 and cancel its timeout. Then wait on the same CV again,
+	 * longer than the first deadline: a timeout left over from
+	 * the first wait would wake us early.
+	 */
+	result = thread_fork("timedtest", timedtestthread, NULL, 1, NULL);
+	if (result) {
+		panic("timedtest: thread_fork failed: %s\n", strerror(result));
+	}
+	result = cv_wait_timed(testcv, testlock, 300);
+	if (result != 0) {
+		kprintf("cv_wait_timed: expected to be signaled, got %d\n",
+			result);
+		testval1 = 1;
+	}
+	gettime(&secs1, &nsecs1);
+	result = cv_wait_timed(testcv, testlock, 1000);
+	if (result != ETIMEDOUT) {
+		kprintf("cv_wait_timed: expected ETIMEDOUT, got %d\n", result);
+		testval1 = 1;
+	}
+	else if (timedelapsed(secs1, nsecs1) < 950) {
+		kprintf("cv_wait_timed: woken after %u ms by a stale "
+			"timeout\n", timedelapsed(secs1, nsecs1));
+		testval1 = 1;
+	}
+	lock_release(testlock);
+	P(donesem);
+
+	/* And a lock that is released before the deadline. */
+	result = thread_fork("timedtest", timedtestthread, NULL, 2, NULL);
+	if (result) {
+		panic("timedtest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(donesem);
+	gettime(&secs1, &nsecs1);
+	result = lock_acquire_timed(testlock, 1000);
+	if (result != 0) {
+		kprintf("lock_acquire_timed: expected the lock, got %d\n",
+			result);
+		testval1 = 1;
+	}
+	else {
+		if (timedelapsed(secs1, nsecs1) >= 950) {
+			kprintf("lock_acquire_timed: got the lock only at "
+				"the deadline\n");
+			testval1 = 1;
+		}
+		lock_release(testlock);
+	}
+	P(donesem);
+
+	sem_cleanup(&sem);
+
+	kprintf("Timed wait test %s\n", testval1 ? "failed" : "done.");
+	return 0;
+}
+
+/*
+ * Priority inheritance test.
+ *
+ * A low-priority thread takes a lock; then a medium-priority thread
+ * starts hogging the cpu, and a high-priority thread blocks on the
+ * lock. Without inheritance the holder never gets to run until the
+ * hog gives up, and the high-priority thread waits for the hog. With
+ * it, the holder is boosted to the waiter's priority, runs ahead of
+ * the hog, releases the lock, and drops back to its own priority.
+ */
+
+#define PI_LOW		(PRI_DEFAULT - 5)
+#define PI_MEDIUM	PRI_DEFAULT
+#define PI_HIGH		(PRI_DEFAULT + 5)
+#define PI_HOGMSECS	3000	/* How long the hog runs, at most */
+
+static struct semaphore *pi_heldsem;
+static volatile bool pi_highdone;
+static volatile bool pi_hogdone;
+static volatile int pi_boosted;
+static volatile int pi_after;
+
+/*
+ * True once MSECS milliseconds have passed since SECS/NSECS.
+ */
+static
+bool
+pi_expired(time_t secs, uint32_t nsecs, unsigned msecs)
+{
+	time_t nowsecs;
+	uint32_t nownsecs;
+
+	gettime(&nowsecs, &nownsecs);
+	getinterval(secs, nsecs, nowsecs, nownsecs, &nowsecs, &nownsecs);
+	return nowsecs * 1000 + nownsecs / 1000000 >= msecs;
+}
+
+static
+void
+pi_lowthread(void *junk, unsigned long num)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	(void)junk;
+	(void)num;
+
+	thread_setpriority(PI_LOW);
+	lock_acquire(testlock);
+	V(pi_heldsem);
+
+	/* Wait (busily, like real work would) to be boosted. */
+	gettime(&secs, &nsecs);
+	while (curthread->t_effpriority == PI_LOW &&
+	       !pi_expired(secs, nsecs, PI_HOGMSECS)) {
+		/* spin */
+	}
+	pi_boosted = curthread->t_effpriority;
+
+	lock_release(testlock);
+	pi_after = curthread->t_effpriority;
+	V(donesem);
+}
+
+static
+void
+pi_hogthread(void *junk, unsigned long num)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	(void)junk;
+	(void)num;
+
+	thread_setpriority(PI_MEDIUM);
+	gettime(&secs, &nsecs);
+	while (!pi_highdone && !pi_expired(secs, nsecs, PI_HOGMSECS)) {
+		/* spin */
+	}
+	pi_hogdone = true;
+	V(donesem);
+}
+
+static
+void
+pi_highthread(void *junk, unsigned long num)
+{
+	bool hogdone;
+
+	(void)junk;
+	(void)num;
+
+	thread_setpriority(PI_HIGH);
+	lock_acquire(testlock);
+	hogdone = pi_hogdone;
+	pi_highdone = true;
+	lock_release(testlock);
+
+	if (hogdone) {
+		kprintf("pitest: high-priority thread waited for the hog\n");
+		testval1 = 1;
+	}
+	V(donesem);
+}
+
+int
+pitest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting priority inheritance test...\n");
+
+	pi_heldsem = sem_create("pitest", 0);
+	if (pi_heldsem == NULL) {
+		panic("pitest: sem_create failed\n");
+	}
+	testval1 = 0;
+	pi_highdone = false;
+	pi_hogdone = false;
+	pi_boosted = pi_after = -1;
+
+	result = thread_fork("pitest-low", pi_lowthread, NULL, 0, NULL);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(pi_heldsem);
+
+	result = thread_fork("pitest-hog", pi_hogthread, NULL, 0, NULL);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	result = thread_fork("pitest-high", pi_highthread, NULL, 0, NULL);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+
+	for (i=0; i<3; i++) {
+		P(donesem);
+	}
+	sem_destroy(pi_heldsem);
+
+	kprintf("pitest: holder priority %d, boosted to %d, "
+		"back to %d after release\n", PI_LOW, pi_boosted, pi_after);
+	if (pi_boosted != PI_HIGH) {
+		kprintf("pitest: holder was not boosted to %d\n", PI_HIGH);
+		testval1 = 1;
+	}
+	if (pi_after != PI_LOW) {
+		kprintf("pitest: holder kept the boost after release\n");
+		testval1 = 1;
+	}
+
+	kprintf("Priority inheritance test %s\n",
+		testval1 ? "failed" : "done.");
+	return 0;
+}
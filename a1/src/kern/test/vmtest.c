@@ -0,0 +1,659 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Tests for the VM system (not with dumbvm).
+ *
+ * These run in the menu thread, which has no address space of its
+ * own: each test gives it a scratch one for the duration, with a
+ * read/write region at VMT_BASE, and touches user memory through
+ * copyin and copyout so that the accesses fault just as a user
+ * program's would.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <copyinout.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <vm.h>
+#include <test.h>
+
+#define VMT_BASE	0x10000000	/* where the test region goes */
+#define VMT_KEXTRA	32		/* kernel pages past free memory */
+#define VMT_TEXTBASE	0x20000000	/* where texttest maps the file */
+#define VMT_TEXTPAGES	8		/* most pages texttest looks at */
+#define VMT_TEXTFILE	"/bin/sh"	/* default file for texttest */
+#define VMT_ZEROPAGES	32		/* pages zerotest uses */
+#define VMT_NTHREADS	4		/* threads in shoottest */
+#define VMT_NPASSES	3		/* times each thread goes over its pages */
+
+/*
+ * Make an address space with one read/write region of NPAGES pages
+ * at VMT_BASE. Returns NULL if that fails.
+ */
+static
+struct addrspace *
+vmt_create(unsigned npages)
+{
+	struct addrspace *as;
+
+	as = as_create();
+	if (as == NULL) {
+		return NULL;
+	}
+	if (as_define_region(as, VMT_BASE, npages * PAGE_SIZE, 1, 1, 0)) {
+		as_destroy(as);
+		return NULL;
+	}
+	return as;
+}
+
+/*
+ * Make AS (which may be NULL) the current thread's address space.
+ */
+static
+void
+vmt_switch(struct addrspace *as)
+{
+	curthread->t_addrspace = as;
+	as_activate(as);
+}
+
+/*
+ * The word that goes at each end of page PAGE on pass PASS.
+ */
+static
+uint32_t
+vmt_pattern(unsigned page, unsigned pass)
+{
+	return (page * 2654435761U) ^ (pass << 24) ^ 0x5a5a5a5a;
+}
+
+/*
+ * Write the pattern for PASS at both ends of pages FIRST through
+ * FIRST+N-1 of the test region.
+ */
+static
+int
+vmt_write(unsigned first, unsigned n, unsigned pass)
+{
+	vaddr_t va;
+	uint32_t val;
+	unsigned i;
+	int result;
+
+	for (i = first; i < first + n; i++) {
+		val = vmt_pattern(i, pass);
+		va = VMT_BASE + i * PAGE_SIZE;
+		result = copyout(&val, (userptr_t)va, sizeof(val));
+		if (result == 0) {
+			result = copyout(&val,
+					 (userptr_t)(va + PAGE_SIZE - sizeof(val)),
+					 sizeof(val));
+		}
+		if (result) {
+			kprintf("vmtest: page %u: write: %s\n", i,
+				strerror(result));
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Check that pages FIRST through FIRST+N-1 still have the pattern
+ * vmt_write put there on pass PASS.
+ */
+static
+int
+vmt_check(unsigned first, unsigned n, unsigned pass)
+{
+	vaddr_t va;
+	uint32_t lo, hi;
+	unsigned i;
+	int result;
+
+	for (i = first; i < first + n; i++) {
+		va = VMT_BASE + i * PAGE_SIZE;
+		result = copyin((const_userptr_t)va, &lo, sizeof(lo));
+		if (result == 0) {
+			result = copyin((const_userptr_t)
+					(va + PAGE_SIZE - sizeof(hi)),
+					&hi, sizeof(hi));
+		}
+		if (result) {
+			kprintf("vmtest: page %u: read: %s\n", i,
+				strerror(result));
+			return result;
+		}
+		if (lo != vmt_pattern(i, pass) || hi != vmt_pattern(i, pass)) {
+			kprintf("vmtest: page %u: expected 0x%x, found 0x%x "
+				"and 0x%x\n", i, vmt_pattern(i, pass), lo, hi);
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Swap test.
+ *
+ * Fill twice as much user memory as there is free, so that most of
+ * it has to go out to swap, and check that it all comes back intact.
+ * Then, with user pages filling memory, allocate more kernel pages
+ * than are free; alloc_kpages has to page user memory out to make
+ * room for them. Needs a swap disk.
+ */
+int
+swaptest(int nargs, char **args)
+{
+	struct addrspace *as;
+	vaddr_t *kpages;
+	unsigned npages, nk, i;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	npages = 2 * coremap_nfree();
+	kprintf("Starting swap test: %u pages, %u free...\n", npages,
+		coremap_nfree());
+
+	KASSERT(curthread->t_addrspace == NULL);
+	as = vmt_create(npages);
+	if (as == NULL) {
+		kprintf("swaptest: Out of memory\n");
+		return ENOMEM;
+	}
+	vmt_switch(as);
+
+	/* Twice over, so pages go out and come back more than once. */
+	result = vmt_write(0, npages, 0);
+	if (result == 0) {
+		result = vmt_check(0, npages, 0);
+	}
+	if (result == 0) {
+		result = vmt_write(0, npages, 1);
+	}
+	if (result == 0) {
+		result = vmt_check(0, npages, 1);
+	}
+	if (result) {
+		vmt_switch(NULL);
+		as_destroy(as);
+		kprintf("Swap test failed\n");
+		return result;
+	}
+
+	nk = coremap_nfree() + VMT_KEXTRA;
+	kprintf("swaptest: allocating %u kernel pages, %u free...\n", nk,
+		coremap_nfree());
+	kpages = kmalloc(nk * sizeof(vaddr_t));
+	if (kpages == NULL) {
+		vmt_switch(NULL);
+		as_destroy(as);
+		kprintf("swaptest: Out of memory\n");
+		return ENOMEM;
+	}
+	for (i = 0; i < nk; i++) {
+		kpages[i] = alloc_kpages(1);
+		if (kpages[i] == 0) {
+			kprintf("swaptest: alloc_kpages failed after %u "
+				"pages\n", i);
+			result = ENOMEM;
+			break;
+		}
+	}
+	while (i-- > 0) {
+		free_kpages(kpages[i]);
+	}
+	kfree(kpages);
+
+	/* The pages paged out for the kernel should come back too. */
+	if (result == 0) {
+		result = vmt_check(0, npages, 1);
+	}
+
+	vmt_switch(NULL);
+	as_destroy(as);
+	if (result) {
+		kprintf("Swap test failed\n");
+		return result;
+	}
+	kprintf("Swap test done\n");
+	return 0;
+}
+
+/*
+ * Map the first NPAGES pages of V read-only into AS at VA, the way
+ * load_elf maps program text, read them through the mapping, and
+ * check them against BUF, which holds what the file has there.
+ */
+static
+int
+vmt_maptext(struct addrspace *as, struct vnode *v, const char *buf,
+	    unsigned npages, char *page, vaddr_t va)
+{
+	unsigned i, j;
+	int result;
+
+	result = as_define_region(as, va, npages * PAGE_SIZE, 1, 0, 0);
+	if (result == 0) {
+		result = as_define_file(as, va, npages * PAGE_SIZE, v, 0);
+	}
+	if (result) {
+		kprintf("texttest: map: %s\n", strerror(result));
+		return result;
+	}
+	vmt_switch(as);
+	for (i = 0; i < npages; i++) {
+		result = copyin((const_userptr_t)(va + i * PAGE_SIZE),
+				page, PAGE_SIZE);
+		if (result) {
+			kprintf("texttest: page %u: read: %s\n", i,
+				strerror(result));
+			break;
+		}
+		for (j = 0; j < PAGE_SIZE; j++) {
+			if (page[j] != buf[i * PAGE_SIZE + j]) {
+				break;
+			}
+		}
+		if (j < PAGE_SIZE) {
+			kprintf("texttest: page %u: wrong contents at "
+				"offset %u\n", i, j);
+			result = EIO;
+			break;
+		}
+	}
+	vmt_switch(NULL);
+	return result;
+}
+
+/*
+ * Return the page table entry for VA in AS.
+ */
+static
+uint32_t
+vmt_getpte(struct addrspace *as, vaddr_t va)
+{
+	uint32_t *pte;
+	uint32_t ret;
+
+	lock_acquire(&as->as_lock);
+	pte = pt_lookup(as->as_pt, va, false);
+	ret = pte != NULL ? *pte : 0;
+	lock_release(&as->as_lock);
+	return ret;
+}
+
+/*
+ * Text sharing test.
+ *
+ * Map the start of a file (by default VMT_TEXTFILE) read-only in two
+ * address spaces, at different addresses, and check that both see
+ * the file's contents and that both map the same physical pages
+ * from the textcache.
+ */
+int
+texttest(int nargs, char **args)
+{
+	char path[] = VMT_TEXTFILE;
+	char *name, *buf, *page;
+	struct addrspace *as1, *as2;
+	struct vnode *v;
+	struct stat st;
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t va1, va2;
+	uint32_t pte1, pte2;
+	unsigned npages, i;
+	int result;
+
+	KASSERT(curthread->t_addrspace == NULL);
+
+	name = nargs > 1 ? args[1] : path;
+	kprintf("Starting text sharing test on %s...\n", name);
+
+	/* vfs_open may scribble on the name, but we're done with it. */
+	result = vfs_open(name, O_RDONLY, 0, &v);
+	if (result) {
+		kprintf("texttest: %s: %s\n", name, strerror(result));
+		return result;
+	}
+	result = VOP_STAT(v, &st);
+	if (result) {
+		vfs_close(v);
+		kprintf("texttest: stat: %s\n", strerror(result));
+		return result;
+	}
+	npages = st.st_size / PAGE_SIZE;
+	if (npages > VMT_TEXTPAGES) {
+		npages = VMT_TEXTPAGES;
+	}
+	if (npages == 0) {
+		vfs_close(v);
+		kprintf("texttest: file is smaller than a page\n");
+		return EINVAL;
+	}
+
+	buf = kmalloc(npages * PAGE_SIZE);
+	page = kmalloc(PAGE_SIZE);
+	as1 = as_create();
+	as2 = as_create();
+	if (buf == NULL || page == NULL || as1 == NULL || as2 == NULL) {
+		kprintf("texttest: Out of memory\n");
+		result = ENOMEM;
+		goto out;
+	}
+
+	uio_kinit(&iov, &ku, buf, npages * PAGE_SIZE, 0, UIO_READ);
+	result = VOP_READ(v, &ku);
+	if (result == 0 && ku.uio_resid != 0) {
+		result = EIO;
+	}
+	if (result) {
+		kprintf("texttest: read: %s\n", strerror(result));
+		goto out;
+	}
+
+	va1 = VMT_TEXTBASE;
+	va2 = VMT_TEXTBASE + VMT_TEXTPAGES * PAGE_SIZE;
+	result = vmt_maptext(as1, v, buf, npages, page, va1);
+	if (result) {
+		goto out;
+	}
+	result = vmt_maptext(as2, v, buf, npages, page, va2);
+	if (result) {
+		goto out;
+	}
+
+	for (i = 0; i < npages; i++) {
+		pte1 = vmt_getpte(as1, va1 + i * PAGE_SIZE);
+		pte2 = vmt_getpte(as2, va2 + i * PAGE_SIZE);
+		if ((pte1 & PTE_SHARED) == 0 || (pte2 & PTE_SHARED) == 0 ||
+		    (pte1 & PTE_FRAME) != (pte2 & PTE_FRAME)) {
+			kprintf("texttest: page %u: not shared (0x%x, 0x%x)\n",
+				i, pte1, pte2);
+			result = EIO;
+			goto out;
+		}
+	}
+
+ out:
+	if (as2 != NULL) {
+		as_destroy(as2);
+	}
+	if (as1 != NULL) {
+		as_destroy(as1);
+	}
+	if (page != NULL) {
+		kfree(page);
+	}
+	if (buf != NULL) {
+		kfree(buf);
+	}
+	vfs_close(v);
+	if (result) {
+		kprintf("Text sharing test failed\n");
+		return result;
+	}
+	kprintf("Text sharing test done\n");
+	return 0;
+}
+
+/*
+ * Check that PAGE, a page's worth of bytes, is all zeros.
+ */
+static
+bool
+vmt_iszero(const char *page)
+{
+	unsigned i;
+
+	for (i = 0; i < PAGE_SIZE; i++) {
+		if (page[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Zero page test.
+ *
+ * Sleep so the cpu goes idle and fills the zero pool, and check that
+ * it did and that the page we get from it is zero. Then dirty some
+ * user pages, free them, let the pool refill, and check that a new
+ * address space's zero-filled pages really are zero.
+ */
+int
+zerotest(int nargs, char **args)
+{
+	struct addrspace *as;
+	char *page;
+	paddr_t pa;
+	unsigned i;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	KASSERT(curthread->t_addrspace == NULL);
+
+	kprintf("Starting zero page test...\n");
+
+	page = kmalloc(PAGE_SIZE);
+	if (page == NULL) {
+		kprintf("zerotest: Out of memory\n");
+		return ENOMEM;
+	}
+
+	clocksleep(1);
+	pa = zeropool_get();
+	if (pa == 0) {
+		kprintf("zerotest: the pool is empty after idling "
+			"(%u pages free)\n", coremap_nfree());
+		kfree(page);
+		kprintf("Zero page test failed\n");
+		return EIO;
+	}
+	result = vmt_iszero((char *)PADDR_TO_KVADDR(pa)) ? 0 : EIO;
+	coremap_free(pa);
+	if (result) {
+		kprintf("zerotest: page from the pool isn't zero\n");
+		kfree(page);
+		kprintf("Zero page test failed\n");
+		return result;
+	}
+
+	/* Leave some dirty pages behind... */
+	as = vmt_create(VMT_ZEROPAGES);
+	if (as == NULL) {
+		kfree(page);
+		kprintf("zerotest: Out of memory\n");
+		return ENOMEM;
+	}
+	vmt_switch(as);
+	result = vmt_write(0, VMT_ZEROPAGES, 0);
+	vmt_switch(NULL);
+	as_destroy(as);
+	if (result) {
+		kfree(page);
+		kprintf("Zero page test failed\n");
+		return result;
+	}
+
+	/* ...and see that we don't get them back dirty. */
+	clocksleep(1);
+	as = vmt_create(VMT_ZEROPAGES);
+	if (as == NULL) {
+		kfree(page);
+		kprintf("zerotest: Out of memory\n");
+		return ENOMEM;
+	}
+	vmt_switch(as);
+	for (i = 0; i < VMT_ZEROPAGES; i++) {
+		result = copyin((const_userptr_t)(VMT_BASE + i * PAGE_SIZE),
+				page, PAGE_SIZE);
+		if (result) {
+			kprintf("zerotest: page %u: read: %s\n", i,
+				strerror(result));
+			break;
+		}
+		if (!vmt_iszero(page)) {
+			kprintf("zerotest: page %u isn't zero\n", i);
+			result = EIO;
+			break;
+		}
+	}
+	vmt_switch(NULL);
+	as_destroy(as);
+	kfree(page);
+
+	if (result) {
+		kprintf("Zero page test failed\n");
+		return result;
+	}
+	kprintf("Zero page test done\n");
+	return 0;
+}
+
+/*
+ * TLB shootdown test.
+ *
+ * Several threads share one address space, each with its own slice
+ * of a region twice the size of free memory, and keep rewriting and
+ * checking their slices. The pager pages their pages out from under
+ * them while they run (on other cpus, if there are any), so if a
+ * shootdown misses a TLB entry, a thread goes on using a page that
+ * has been freed and reused, and sooner or later finds the wrong
+ * pattern in it. Needs a swap disk, and more than one cpu to test
+ * much.
+ */
+
+struct shootinfo {
+	struct semaphore *si_done;
+	struct addrspace *si_as;
+	unsigned si_npages;		/* pages per thread */
+	int si_result[VMT_NTHREADS];
+};
+
+static
+void
+shootthread(void *vsi, unsigned long num)
+{
+	struct shootinfo *si = vsi;
+	unsigned first, pass;
+	int result;
+
+	/* Borrow the address space; we must give it back before exiting. */
+	vmt_switch(si->si_as);
+
+	first = num * si->si_npages;
+	result = 0;
+	for (pass = 0; pass < VMT_NPASSES && result == 0; pass++) {
+		result = vmt_write(first, si->si_npages, pass);
+		if (result == 0) {
+			result = vmt_check(first, si->si_npages, pass);
+		}
+	}
+	si->si_result[num] = result;
+
+	vmt_switch(NULL);
+	V(si->si_done);
+}
+
+int
+shoottest(int nargs, char **args)
+{
+	struct shootinfo si;
+	unsigned i;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	KASSERT(curthread->t_addrspace == NULL);
+
+	si.si_npages = 2 * coremap_nfree() / VMT_NTHREADS;
+	kprintf("Starting TLB shootdown test: %u threads, %u pages each, "
+		"%u free...\n", VMT_NTHREADS, si.si_npages, coremap_nfree());
+
+	si.si_done = sem_create("shoottest", 0);
+	if (si.si_done == NULL) {
+		panic("shoottest: sem_create failed\n");
+	}
+	si.si_as = vmt_create(VMT_NTHREADS * si.si_npages);
+	if (si.si_as == NULL) {
+		sem_destroy(si.si_done);
+		kprintf("shoottest: Out of memory\n");
+		return ENOMEM;
+	}
+
+	for (i = 0; i < VMT_NTHREADS; i++) {
+		/* We have no address space, so the thread doesn't copy one. */
+		result = thread_fork("shoottest", shootthread, &si, i, NULL);
+		if (result) {
+			panic("shoottest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i = 0; i < VMT_NTHREADS; i++) {
+		P(si.si_done);
+	}
+
+	as_destroy(si.si_as);
+	sem_destroy(si.si_done);
+
+	result = 0;
+	for (i = 0; i < VMT_NTHREADS; i++) {
+		if (si.si_result[i]) {
+			kprintf("shoottest: thread %u: %s\n", i,
+				strerror(si.si_result[i]));
+			result = si.si_result[i];
+		}
+	}
+	if (result) {
+		kprintf("TLB shootdown test failed\n");
+		return result;
+	}
+	kprintf("TLB shootdown test done\n");
+	return 0;
+}
@@ -30,6 +30,8 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <counter.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
@@ -58,6 +60,16 @@
  */
 static struct wchan *lbolt;
 
+static struct counter hardclock_count = COUNTER_INITIALIZER("hardclock");
+
+/*
+ * Pending callouts, sorted by co_when, and the tick count they're
+ * measured against. Both are only advanced by CPU 0.
+ */
+static struct spinlock callout_lock = SPINLOCK_INITIALIZER;
+static struct callout *callouts;
+static volatile unsigned ticks;
+
 /*
  * Setup.
  */
@@ -81,6 +93,45 @@ timerclock(void)
 	wchan_wakeall(lbolt);
 }
 
+/*
+ * Run whatever callouts have come due. Called from hardclock on CPU 0.
+ *
+ * The lock is dropped around each function so that callout functions
+ * can take wchan and runqueue locks without ordering problems;
+ * callout_stop copes with this by waiting out CO_RUNNING.
+ */
+static
+void
+callout_run(void)
+{
+	struct callout *co;
+
+	ticks++;
+
+	/* Unlocked peek; the common case is that nothing is due. */
+	co = callouts;
+	if (co == NULL || (int)(co->co_when - ticks) > 0) {
+		return;
+	}
+
+	spinlock_acquire(&callout_lock);
+	while ((co = callouts) != NULL && (int)(co->co_when - ticks) <= 0) {
+		callouts = co->co_next;
+		co->co_next = NULL;
+		co->co_state = CO_RUNNING;
+		spinlock_release(&callout_lock);
+
+		co->co_func(co->co_data);
+
+		spinlock_acquire(&callout_lock);
+		/* callout_reset may have been called from co_func */
+		if (co->co_state == CO_RUNNING) {
+			co->co_state = CO_IDLE;
+		}
+	}
+	spinlock_release(&callout_lock);
+}
+
 /*
  * This is called HZ times a second (on each processor) by the timer
  * code.
@@ -93,6 +144,11 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	COUNTER_INC(&hardclock_count);
+
+	if (curcpu->c_number == 0) {
+		callout_run();
+	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
@@ -114,3 +170,97 @@ clocksleep(int num_secs)
 		num_secs--;
 	}
 }
+
+////////////////////////////////////////////////////////////
+//
+// Callouts.
+
+void
+callout_init(struct callout *co, void (*func)(void *), void *data)
+{
+	co->co_next = NULL;
+	co->co_when = 0;
+	co->co_func = func;
+	co->co_data = data;
+	co->co_state = CO_IDLE;
+}
+
+/*
+ * Take CO off the pending list. Returns true if it was on it.
+ */
+static
+bool
+callout_unlink(struct callout *co)
+{
+	struct callout **p;
+
+	KASSERT(spinlock_do_i_hold(&callout_lock));
+
+	for (p = &callouts; *p != NULL; p = &(*p)->co_next) {
+		if (*p == co) {
+			*p = co->co_next;
+			co->co_next = NULL;
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+callout_reset(struct callout *co, unsigned nticks)
+{
+	struct callout **p;
+
+	if (nticks == 0) {
+		nticks = 1;
+	}
+
+	spinlock_acquire(&callout_lock);
+	if (co->co_state == CO_PENDING) {
+		callout_unlink(co);
+	}
+	co->co_when = ticks + nticks;
+	co->co_state = CO_PENDING;
+
+	/* Keep the list sorted; equal deadlines fire in FIFO order. */
+	for (p = &callouts; *p != NULL; p = &(*p)->co_next) {
+		if ((int)((*p)->co_when - co->co_when) > 0) {
+			break;
+		}
+	}
+	co->co_next = *p;
+	*p = co;
+	spinlock_release(&callout_lock);
+}
+
+bool
+callout_stop(struct callout *co)
+{
+	bool ret;
+
+	spinlock_acquire(&callout_lock);
+	ret = false;
+	if (co->co_state == CO_PENDING) {
+		ret = callout_unlink(co);
+		KASSERT(ret);
+		co->co_state = CO_IDLE;
+	}
+	while (co->co_state == CO_RUNNING) {
+		/*
+		 * It's running on CPU 0 right now. (It can't be us,
+		 * unless the function is trying to stop itself, which
+		 * would be a bug.) Wait for it to finish.
+		 */
+		KASSERT(curcpu->c_number != 0 || !curthread->t_in_interrupt);
+		spinlock_release(&callout_lock);
+		spinlock_acquire(&callout_lock);
+	}
+	spinlock_release(&callout_lock);
+	return ret;
+}
+
+unsigned
+callout_ticks(void)
+{
+	return ticks;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Per-cpu statistics counters. See counter.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <counter.h>
+
+/*
+ * Registered counters, by slot. Slot 0 is never used, so that a
+ * zero ctr_slot can mean "not registered yet".
+ */
+static struct counter *counters[COUNTERS_MAX];
+static unsigned numcounters = 1;
+static struct spinlock counter_lock = SPINLOCK_INITIALIZER;
+
+void
+counter_attach(struct counter *ctr)
+{
+	spinlock_acquire(&counter_lock);
+	/* Someone may have beaten us to it. */
+	if (ctr->ctr_slot == 0) {
+		if (numcounters == COUNTERS_MAX) {
+			panic("counter_attach: too many counters (%s)\n",
+			      ctr->ctr_name);
+		}
+		counters[numcounters] = ctr;
+		ctr->ctr_slot = numcounters++;
+	}
+	spinlock_release(&counter_lock);
+}
+
+uint64_t
+counter_read(struct counter *ctr)
+{
+	uint64_t total;
+	unsigned i, slot;
+
+	slot = ctr->ctr_slot;
+	if (slot == 0) {
+		return 0;
+	}
+
+	total = 0;
+	for (i=0; i<cpu_count(); i++) {
+		total += cpu_get(i)->c_counters[slot];
+	}
+	return total;
+}
+
+void
+counter_printstats(void)
+{
+	struct counter *ctr;
+	unsigned i, j, n;
+
+	spinlock_acquire(&counter_lock);
+	n = numcounters;
+	spinlock_release(&counter_lock);
+
+	kprintf("%-20s %12s", "counter", "total");
+	for (j=0; j<cpu_count(); j++) {
+		kprintf("      cpu%-3u", j);
+	}
+	kprintf("\n");
+
+	for (i=1; i<n; i++) {
+		ctr = counters[i];
+		kprintf("%-20s %12llu", ctr->ctr_name,
+			(unsigned long long) counter_read(ctr));
+		for (j=0; j<cpu_count(); j++) {
+			kprintf(" %11llu",
+				(unsigned long long) cpu_get(j)->c_counters[i]);
+		}
+		kprintf("\n");
+	}
+}
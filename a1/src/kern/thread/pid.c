@@ -42,6 +42,7 @@
 #include <current.h>
 #include <synch.h>
 #include <pid.h>
+#include <slab.h>
 #include <copyinout.h> 
 
 
@@ -57,7 +58,7 @@ struct pidinfo {
 	pid_t pi_ppid;			// process id of parent thread
 	volatile bool pi_exited;	// true if thread has exited
 	int pi_exitstatus;		// status (only valid if exited)
-	struct cv *pi_cv;		// use to wait for thread exit
+	struct cv pi_cv;		// use to wait for thread exit
 	int pi_flag;			// use to flag pid
 };
 
@@ -70,13 +71,36 @@ struct pidinfo {
  * new pid allocation would cause a hash collision, we just don't
  * use that pid.
  */
-static struct lock *pidlock;		// lock for global exit data
+static struct lock pidlock;		// lock for global exit data
 static struct pidinfo *pidinfo[PROCS_MAX]; // actual pid info
 static pid_t nextpid;			// next candidate pid
 static int nprocs;			// number of allocated pids
+static struct kmem_cache *pidinfo_cache; // where pidinfos come from
 
 
 
+/*
+ * Object cache constructor/destructor for pidinfo: the cv is set up
+ * once per object rather than on every fork.
+ */
+static
+void
+pidinfo_ctor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	cv_init(&pi->pi_cv, "pidinfo cv");
+}
+
+static
+void
+pidinfo_dtor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	cv_cleanup(&pi->pi_cv);
+}
+
 /*
  * Create a pidinfo structure for the specified pid.
  */
@@ -88,17 +112,11 @@ pidinfo_create(pid_t pid, pid_t ppid)
 
 	KASSERT(pid != INVALID_PID);
 
-	pi = kmalloc(sizeof(struct pidinfo));
+	pi = kmem_cache_alloc(pidinfo_cache);
 	if (pi==NULL) {
 		return NULL;
 	}
 
-	pi->pi_cv = cv_create("pidinfo cv");
-	if (pi->pi_cv == NULL) {
-		kfree(pi);
-		return NULL;
-	}
-
 	pi->pi_pid = pid;
 	pi->pi_ppid = ppid;
 	pi->pi_exited = false;
@@ -116,8 +134,8 @@ pidinfo_destroy(struct pidinfo *pi)
 {
 	KASSERT(pi->pi_exited == true);
 	KASSERT(pi->pi_ppid == INVALID_PID);
-	cv_destroy(pi->pi_cv);
-	kfree(pi);
+	/* pi_cv has no waiters left and stays initialized in the cache */
+	kmem_cache_free(pidinfo_cache, pi);
 }
 
 ////////////////////////////////////////////////////////////
@@ -130,9 +148,12 @@ pid_bootstrap(void)
 {
 	int i;
 
-	pidlock = lock_create("pidlock");
-	if (pidlock == NULL) {
-		panic("Out of memory creating pid lock\n");
+	lock_init(&pidlock, "pidlock");
+
+	pidinfo_cache = kmem_cache_create("pidinfo", sizeof(struct pidinfo),
+					  0, pidinfo_ctor, pidinfo_dtor);
+	if (pidinfo_cache == NULL) {
+		panic("Out of memory creating pidinfo cache\n");
 	}
 
 	/* not really necessary - should start zeroed */
@@ -160,7 +181,7 @@ pi_get(pid_t pid)
 
 	KASSERT(pid>=0);
 	KASSERT(pid != INVALID_PID);
-	KASSERT(lock_do_i_hold(pidlock));
+	KASSERT(lock_do_i_hold(&pidlock));
 
 	pi = pidinfo[pid % PROCS_MAX];
 	if (pi==NULL) {
@@ -180,7 +201,7 @@ static
 void
 pi_put(pid_t pid, struct pidinfo *pi)
 {
-	KASSERT(lock_do_i_hold(pidlock));
+	KASSERT(lock_do_i_hold(&pidlock));
 
 	KASSERT(pid != INVALID_PID);
 
@@ -200,7 +221,7 @@ pi_drop(pid_t pid)
 {
 	struct pidinfo *pi;
 
-	KASSERT(lock_do_i_hold(pidlock));
+	KASSERT(lock_do_i_hold(&pidlock));
 
 	pi = pidinfo[pid % PROCS_MAX];
 	KASSERT(pi != NULL);
@@ -220,7 +241,7 @@ static
 void
 inc_nextpid(void)
 {
-	KASSERT(lock_do_i_hold(pidlock));
+	KASSERT(lock_do_i_hold(&pidlock));
 
 	nextpid++;
 	if (nextpid > PID_MAX) {
@@ -241,10 +262,10 @@ pid_alloc(pid_t *retval)
 	KASSERT(curthread->t_pid != INVALID_PID);
 
 	/* lock the table */
-	lock_acquire(pidlock);
+	lock_acquire(&pidlock);
 
 	if (nprocs == PROCS_MAX) {
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return EAGAIN;
 	}
 
@@ -267,7 +288,7 @@ pid_alloc(pid_t *retval)
 
 	pi = pidinfo_create(pid, curthread->t_pid);
 	if (pi==NULL) {
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return ENOMEM;
 	}
 
@@ -275,7 +296,7 @@ pid_alloc(pid_t *retval)
 
 	inc_nextpid();
 
-	lock_release(pidlock);
+	lock_release(&pidlock);
 
 	*retval = pid;
 	return 0;
@@ -292,7 +313,7 @@ pid_unalloc(pid_t theirpid)
 
 	KASSERT(theirpid >= PID_MIN && theirpid <= PID_MAX);
 
-	lock_acquire(pidlock);
+	lock_acquire(&pidlock);
 
 	them = pi_get(theirpid);
 	KASSERT(them != NULL);
@@ -306,7 +327,7 @@ pid_unalloc(pid_t theirpid)
 
 	pi_drop(theirpid);
 
-	lock_release(pidlock);
+	lock_release(&pidlock);
 }
 
 /*
@@ -317,7 +338,7 @@ pid_unalloc(pid_t theirpid)
 int
 pid_detach(pid_t childpid)
 {
-	lock_acquire(pidlock);
+	lock_acquire(&pidlock);
 	
 	struct pidinfo *childThread = pi_get(childpid);
 
@@ -325,7 +346,7 @@ pid_detach(pid_t childpid)
 
 	// No thread could be found corresponding to that specified by childpid.
 	if (childThread == NULL){
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return ESRCH;
 	}
 
@@ -333,19 +354,19 @@ pid_detach(pid_t childpid)
 
 	// Thread childpid is already in the detached state.
 	if (childThread->pi_ppid == INVALID_PID){
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return EINVAL;
 	}
 
 	// Caller is not the parent of childpid.
 	if (childThread->pi_ppid != curthread->t_pid){
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return EINVAL;
 	}
 
 	// childpid is INVALID_PID or BOOTUP_PID.
 	if (childpid == INVALID_PID || childpid == BOOTUP_PID){
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return EINVAL;
 	}
 
@@ -360,7 +381,7 @@ pid_detach(pid_t childpid)
 		childThread->pi_ppid = INVALID_PID;
 	}
 	
-	lock_release(pidlock);
+	lock_release(&pidlock);
 	return 0;
 }
 
@@ -378,7 +399,7 @@ pid_exit(int status, bool dodetach)
 {
 	struct pidinfo *my_pi;
 	
-	lock_acquire(pidlock);
+	lock_acquire(&pidlock);
 
 	my_pi = pi_get(curthread->t_pid);
 	KASSERT(my_pi != NULL);
@@ -389,7 +410,7 @@ pid_exit(int status, bool dodetach)
 
 
 	// Wake up all threads waiting fot the current thread
-	cv_broadcast(my_pi->pi_cv, pidlock);
+	cv_broadcast(&my_pi->pi_cv, &pidlock);
 
 	// Disown children of current thread
 	for(int index = PID_MIN; index <= PID_MAX; index++){
@@ -405,7 +426,7 @@ pid_exit(int status, bool dodetach)
 	if (my_pi->pi_ppid == INVALID_PID) {
 		pi_drop(curthread->t_pid);
 	}
-	lock_release(pidlock);
+	lock_release(&pidlock);
 }
 
 /*
@@ -418,42 +439,42 @@ int
 pid_join(pid_t targetpid, int *status, int flags)
 {
 
-	lock_acquire(pidlock);
+	lock_acquire(&pidlock);
 
 	// Create struct for new thread 
 	struct pidinfo *newThread = pi_get(targetpid);
 
 	// EDEADLK Error Check
 	if (targetpid == curthread->t_pid){
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return -EDEADLK;
 	}
 
 	// ESRCH Error Check
 	if (newThread == NULL){
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return -ESRCH;
 	}
 
 	// EINVAL Error Checks
 
 	if (newThread->pi_ppid == INVALID_PID){
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return -EINVAL;
 	}
 
 	if (targetpid == INVALID_PID || targetpid == BOOTUP_PID || targetpid < 0){
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return -EINVAL;
 	}
 
 	if (flags == WNOHANG){
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return 0;
 	}
 
 	if (newThread->pi_exited != true){
-		cv_wait(newThread->pi_cv, pidlock); 
+		cv_wait(&newThread->pi_cv, &pidlock); 
 	}
 
 	int stat = newThread->pi_exitstatus;
@@ -465,30 +486,30 @@ pid_join(pid_t targetpid, int *status, int flags)
 			// copyout(&stat, (userptr_t)status, sizeof(int));
 		}
 	
-	lock_release(pidlock);
+	lock_release(&pidlock);
 	return targetpid;
 }
 
 int
 pid_set_flag(pid_t pid, int sig)
 {
-	lock_acquire(pidlock);
+	lock_acquire(&pidlock);
 
 	if (pid_valid(pid) != 0){
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return EINVAL;
 	}
 	
 
 	struct pidinfo* pi = pi_get(pid);
 	if (pi == NULL){
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return ESRCH;
 	}
 
 	pi->pi_flag = sig;
 
-	lock_release(pidlock);
+	lock_release(&pidlock);
 	return 0;
 }
 
@@ -499,16 +520,16 @@ pid_get_flag(pid_t pid)
 	if (pid_valid(pid) != 0)
 		return EINVAL;
 
-	lock_acquire(pidlock);
+	lock_acquire(&pidlock);
 	struct pidinfo* pi = pi_get(pid);
 	if (pi == NULL){
-		lock_release(pidlock);
+		lock_release(&pidlock);
 		return ESRCH;
 	}
 
 	int flag = pi->pi_flag;
 
-	lock_release(pidlock);
+	lock_release(&pidlock);
 	return flag;
 }
 
@@ -523,19 +544,19 @@ pid_valid(pid_t pid)
 bool
 pid_isparent(pid_t pid)
 {
-	lock_acquire(pidlock);
+	lock_acquire(&pidlock);
 	if (pid == INVALID_PID || pid < PID_MIN || pid > PID_MAX){
-		lock_release(pidlock);
+		lock_release(&pidlock);
     	return EINVAL;
     }
 
     struct pidinfo* pi = pi_get(curthread->t_pid);
     if (pi == NULL){
-    	lock_release(pidlock);
+    	lock_release(&pidlock);
         return ESRCH;
     }
 
-	lock_release(pidlock);
+	lock_release(&pidlock);
 	return (pi->pi_ppid == pid);
 }
 
@@ -29,12 +29,15 @@
 
 /* Make sure to build out-of-line versions of spinlock inline functions */
 #define SPINLOCK_INLINE   /* empty */
+/* ...and of the atomic operations that live alongside them */
+#define ATOMIC_INLINE   /* empty */
 
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <atomic.h>
 #include <current.h>	/* for curcpu */
 
 /*
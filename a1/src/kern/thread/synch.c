@@ -33,7 +33,9 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
@@ -44,10 +46,33 @@
 //
 // Semaphore.
 
+void
+sem_init(struct semaphore *sem, const char *name, int initial_count)
+{
+        KASSERT(sem != NULL);
+        KASSERT(initial_count >= 0);
+
+        sem->sem_name = name;
+	wchan_init(&sem->sem_wchan, name);
+	spinlock_init(&sem->sem_lock);
+        sem->sem_count = initial_count;
+}
+
+void
+sem_cleanup(struct semaphore *sem)
+{
+        KASSERT(sem != NULL);
+
+	/* wchan_cleanup will assert if anyone's waiting on it */
+	spinlock_cleanup(&sem->sem_lock);
+	wchan_cleanup(&sem->sem_wchan);
+}
+
 struct semaphore *
 sem_create(const char *name, int initial_count)
 {
         struct semaphore *sem;
+        char *namecopy;
 
         KASSERT(initial_count >= 0);
 
@@ -56,22 +81,13 @@ sem_create(const char *name, int initial_count)
                 return NULL;
         }
 
-        sem->sem_name = kstrdup(name);
-        if (sem->sem_name == NULL) {
+        namecopy = kstrdup(name);
+        if (namecopy == NULL) {
                 kfree(sem);
                 return NULL;
         }
 
-	sem->sem_wchan = wchan_create(sem->sem_name);
-	if (sem->sem_wchan == NULL) {
-		kfree(sem->sem_name);
-		kfree(sem);
-		return NULL;
-	}
-
-	spinlock_init(&sem->sem_lock);
-        sem->sem_count = initial_count;
-
+        sem_init(sem, namecopy, initial_count);
         return sem;
 }
 
@@ -80,10 +96,8 @@ sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
 
-	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
-	wchan_destroy(sem->sem_wchan);
-        kfree(sem->sem_name);
+	sem_cleanup(sem);
+        kfree((char *)sem->sem_name);
         kfree(sem);
 }
 
@@ -118,15 +132,49 @@ P(struct semaphore *sem)
 		 * Exercise: how would you implement strict FIFO
 		 * ordering?
 		 */
-		wchan_lock(sem->sem_wchan);
+		wchan_lock(&sem->sem_wchan);
+		spinlock_release(&sem->sem_lock);
+                wchan_sleep(&sem->sem_wchan);
+
+		spinlock_acquire(&sem->sem_lock);
+        }
+        KASSERT(sem->sem_count > 0);
+        sem->sem_count--;
+	spinlock_release(&sem->sem_lock);
+}
+
+int
+P_timed(struct semaphore *sem, unsigned msecs)
+{
+	unsigned deadline, now;
+
+        KASSERT(sem != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+	deadline = callout_ticks() + MSEC_TO_TICKS(msecs);
+
+	spinlock_acquire(&sem->sem_lock);
+        while (sem->sem_count == 0) {
+		/*
+		 * Sleep for whatever is left of the timeout; we may
+		 * be woken and lose the race for the count several
+		 * times before it runs out.
+		 */
+		now = callout_ticks();
+		if ((int)(deadline - now) <= 0) {
+			spinlock_release(&sem->sem_lock);
+			return ETIMEDOUT;
+		}
+		wchan_lock(&sem->sem_wchan);
 		spinlock_release(&sem->sem_lock);
-                wchan_sleep(sem->sem_wchan);
+                wchan_sleep_timed(&sem->sem_wchan, deadline - now);
 
 		spinlock_acquire(&sem->sem_lock);
         }
         KASSERT(sem->sem_count > 0);
         sem->sem_count--;
 	spinlock_release(&sem->sem_lock);
+	return 0;
 }
 
 void
@@ -138,40 +186,160 @@ V(struct semaphore *sem)
 
         sem->sem_count++;
         KASSERT(sem->sem_count > 0);
-	wchan_wakeone(sem->sem_wchan);
+	wchan_wakeone(&sem->sem_wchan);
 
 	spinlock_release(&sem->sem_lock);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Priority inheritance.
+//
+// One spinlock covers all the inheritance state: the priority fields
+// in struct thread and the waiter/held lists in struct lock. Chains of
+// blocked threads cross arbitrary locks, so per-lock protection would
+// require taking several lk_locks at once in no particular order.
+//
+// Lock ordering: lk_lock, then pi_lock, then wchan locks or run queue
+// locks. Never get a lk_lock while holding pi_lock.
+
+static struct spinlock pi_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Work out what T's effective priority should be: its base priority,
+ * or that of the most important thread waiting on a lock it holds.
+ */
+static
+int
+pi_compute(struct thread *t)
+{
+	struct lock *lk;
+	struct thread *w;
+	int pri;
+
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	pri = t->t_priority;
+	for (lk = t->t_heldlocks; lk != NULL; lk = lk->lk_heldnext) {
+		for (w = lk->lk_waiters; w != NULL; w = w->t_pinext) {
+			if (w->t_effpriority > pri) {
+				pri = w->t_effpriority;
+			}
+		}
+	}
+	return pri;
+}
+
+/*
+ * Lend PRI to the holder of LK, and on down the chain if that holder
+ * is itself blocked. Stops as soon as nothing would change, which
+ * also keeps a deadlock cycle from looping forever.
+ */
+static
+void
+pi_donate(struct lock *lk, int pri)
+{
+	struct thread *holder;
+
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	while (lk != NULL) {
+		holder = lk->lk_holder;
+		if (holder == NULL || holder->t_effpriority >= pri) {
+			break;
+		}
+		holder->t_effpriority = pri;
+		thread_requeue(holder);
+		lk = holder->t_waitlock;
+	}
+}
+
+/*
+ * Remove T from the waiter list of the lock it was blocked on.
+ */
+static
+void
+pi_unwait(struct thread *t)
+{
+	struct thread **p;
+	struct lock *lk;
+
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	lk = t->t_waitlock;
+	KASSERT(lk != NULL);
+	for (p = &lk->lk_waiters; *p != NULL; p = &(*p)->t_pinext) {
+		if (*p == t) {
+			*p = t->t_pinext;
+			break;
+		}
+	}
+	t->t_pinext = NULL;
+	t->t_waitlock = NULL;
+}
+
+/*
+ * Set the current thread's base priority. This lives here rather
+ * than in thread.c because it has to take the inheritance into
+ * account.
+ */
+void
+thread_setpriority(int pri)
+{
+	KASSERT(pri >= PRI_MIN && pri <= PRI_MAX);
+
+	spinlock_acquire(&pi_lock);
+	curthread->t_priority = pri;
+	curthread->t_effpriority = pi_compute(curthread);
+	spinlock_release(&pi_lock);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Lock.
 
+void
+lock_init(struct lock *lock, const char *name)
+{
+        KASSERT(lock != NULL);
+
+        lock->lk_name = name;
+	wchan_init(&lock->lk_wchan, name);
+	spinlock_init(&lock->lk_lock);
+	lock->lk_holder = NULL;
+	lock->lk_waiters = NULL;
+	lock->lk_heldnext = NULL;
+}
+
+void
+lock_cleanup(struct lock *lock)
+{
+        KASSERT(lock != NULL);
+
+	KASSERT(lock->lk_holder == NULL);
+	KASSERT(lock->lk_waiters == NULL);
+	spinlock_cleanup(&lock->lk_lock);
+	wchan_cleanup(&lock->lk_wchan);
+}
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
+        char *namecopy;
 
         lock = kmalloc(sizeof(struct lock));
         if (lock == NULL) {
                 return NULL;
         }
 
-        lock->lk_name = kstrdup(name);
-        if (lock->lk_name == NULL) {
+        namecopy = kstrdup(name);
+        if (namecopy == NULL) {
                 kfree(lock);
                 return NULL;
         }
 
-	lock->lk_wchan = wchan_create(lock->lk_name);
-	if (lock->lk_wchan == NULL) {
-		kfree(lock->lk_name);
-		kfree(lock);
-		return NULL;
-	}
-	spinlock_init(&lock->lk_lock);
-	lock->lk_holder = NULL;
-        
+	lock_init(lock, namecopy);
         return lock;
 }
 
@@ -180,14 +348,58 @@ lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
 
-	KASSERT(lock->lk_holder == NULL);
-	spinlock_cleanup(&lock->lk_lock);
-	wchan_destroy(lock->lk_wchan);
-        
-        kfree(lock->lk_name);
+	lock_cleanup(lock);
+        kfree((char *)lock->lk_name);
         kfree(lock);
 }
 
+/*
+ * Get on LOCK's waiter list, if we aren't already, and lend our
+ * priority to the holder. Called with lk_lock held, so the holder
+ * can't release while we're doing this.
+ */
+static
+void
+lock_wait_begin(struct lock *lock)
+{
+	struct thread *cur = curthread;
+
+	KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+
+	spinlock_acquire(&pi_lock);
+	if (cur->t_waitlock == NULL) {
+		cur->t_waitlock = lock;
+		cur->t_pinext = lock->lk_waiters;
+		lock->lk_waiters = cur;
+	}
+	pi_donate(lock, cur->t_effpriority);
+	spinlock_release(&pi_lock);
+}
+
+/*
+ * Become the holder of LOCK. Called with lk_lock held.
+ */
+static
+void
+lock_take(struct lock *lock)
+{
+	struct thread *cur = curthread;
+
+	KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+	KASSERT(lock->lk_holder == NULL);
+
+	spinlock_acquire(&pi_lock);
+	if (cur->t_waitlock != NULL) {
+		pi_unwait(cur);
+	}
+	lock->lk_holder = cur;
+	lock->lk_heldnext = cur->t_heldlocks;
+	cur->t_heldlocks = lock;
+	/* Pick up the priority of anyone still waiting behind us. */
+	cur->t_effpriority = pi_compute(cur);
+	spinlock_release(&pi_lock);
+}
+
 void
 lock_acquire(struct lock *lock)
 {
@@ -196,27 +408,106 @@ lock_acquire(struct lock *lock)
 
 	spinlock_acquire(&lock->lk_lock);
 	while (lock->lk_holder != NULL) {
+		lock_wait_begin(lock);
+
 		/* As in the semaphore. */
-		wchan_lock(lock->lk_wchan);
+		wchan_lock(&lock->lk_wchan);
 		spinlock_release(&lock->lk_lock);
-                wchan_sleep(lock->lk_wchan);
+                wchan_sleep(&lock->lk_wchan);
 
 		spinlock_acquire(&lock->lk_lock);
 	}
+	lock_take(lock);
+	spinlock_release(&lock->lk_lock);
+}
+
+bool
+lock_tryacquire(struct lock *lock)
+{
+	bool ret;
 
-	lock->lk_holder = curthread;
+	DEBUGASSERT(lock != NULL);
+
+	spinlock_acquire(&lock->lk_lock);
+	ret = (lock->lk_holder == NULL);
+	if (ret) {
+		lock_take(lock);
+	}
 	spinlock_release(&lock->lk_lock);
+
+	return ret;
+}
+
+int
+lock_acquire_timed(struct lock *lock, unsigned msecs)
+{
+	struct thread *holder;
+	unsigned deadline, now;
+
+	DEBUGASSERT(lock != NULL);
+        KASSERT(curthread->t_in_interrupt == false);
+
+	deadline = callout_ticks() + MSEC_TO_TICKS(msecs);
+
+	spinlock_acquire(&lock->lk_lock);
+	while (lock->lk_holder != NULL) {
+		now = callout_ticks();
+		if ((int)(deadline - now) <= 0) {
+			/*
+			 * Give up. Take back the priority we lent the
+			 * holder. (Anything further down the chain
+			 * keeps the loan until the holder releases;
+			 * undoing that would mean walking the chain
+			 * recomputing everything, for little gain.)
+			 */
+			spinlock_acquire(&pi_lock);
+			if (curthread->t_waitlock != NULL) {
+				pi_unwait(curthread);
+				holder = lock->lk_holder;
+				holder->t_effpriority = pi_compute(holder);
+			}
+			spinlock_release(&pi_lock);
+			spinlock_release(&lock->lk_lock);
+			return ETIMEDOUT;
+		}
+
+		lock_wait_begin(lock);
+
+		wchan_lock(&lock->lk_wchan);
+		spinlock_release(&lock->lk_lock);
+                wchan_sleep_timed(&lock->lk_wchan, deadline - now);
+
+		spinlock_acquire(&lock->lk_lock);
+	}
+	lock_take(lock);
+	spinlock_release(&lock->lk_lock);
+	return 0;
 }
 
 void
 lock_release(struct lock *lock)
 {
+	struct lock **p;
+
 	DEBUGASSERT(lock != NULL);
 
 	spinlock_acquire(&lock->lk_lock);
 	KASSERT(lock->lk_holder == curthread);
+
+	spinlock_acquire(&pi_lock);
+	for (p = &curthread->t_heldlocks; *p != NULL; p = &(*p)->lk_heldnext) {
+		if (*p == lock) {
+			*p = lock->lk_heldnext;
+			break;
+		}
+	}
+	lock->lk_heldnext = NULL;
 	lock->lk_holder = NULL;
-	wchan_wakeone(lock->lk_wchan);
+	/* Give back whatever this lock's waiters lent us. */
+	curthread->t_effpriority = pi_compute(curthread);
+	spinlock_release(&pi_lock);
+
+	wchan_wakeone(&lock->lk_wchan);
 	spinlock_release(&lock->lk_lock);
 }
 
@@ -239,29 +530,41 @@ lock_do_i_hold(struct lock *lock)
 // CV
 
 
+void
+cv_init(struct cv *cv, const char *name)
+{
+        KASSERT(cv != NULL);
+
+        cv->cv_name = name;
+	wchan_init(&cv->cv_wchan, name);
+}
+
+void
+cv_cleanup(struct cv *cv)
+{
+        KASSERT(cv != NULL);
+
+	wchan_cleanup(&cv->cv_wchan);
+}
+
 struct cv *
 cv_create(const char *name)
 {
         struct cv *cv;
+        char *namecopy;
 
         cv = kmalloc(sizeof(struct cv));
         if (cv == NULL) {
                 return NULL;
         }
 
-        cv->cv_name = kstrdup(name);
-        if (cv->cv_name==NULL) {
+        namecopy = kstrdup(name);
+        if (namecopy == NULL) {
                 kfree(cv);
                 return NULL;
         }
-        
-	cv->cv_wchan = wchan_create(cv->cv_name);
-	if (cv->cv_wchan == NULL) {
-		kfree(cv->cv_name);
-		kfree(cv);
-		return NULL;
-	}
-        
+
+	cv_init(cv, namecopy);
         return cv;
 }
 
@@ -270,31 +573,42 @@ cv_destroy(struct cv *cv)
 {
         KASSERT(cv != NULL);
 
-	wchan_destroy(cv->cv_wchan);
-        
-        kfree(cv->cv_name);
+	cv_cleanup(cv);
+        kfree((char *)cv->cv_name);
         kfree(cv);
 }
 
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
-	wchan_lock(cv->cv_wchan);
+	wchan_lock(&cv->cv_wchan);
+	lock_release(lock);
+	wchan_sleep(&cv->cv_wchan);
+	lock_acquire(lock);
+}
+
+int
+cv_wait_timed(struct cv *cv, struct lock *lock, unsigned msecs)
+{
+	int result;
+
+	wchan_lock(&cv->cv_wchan);
 	lock_release(lock);
-	wchan_sleep(cv->cv_wchan);
+	result = wchan_sleep_timed(&cv->cv_wchan, MSEC_TO_TICKS(msecs));
 	lock_acquire(lock);
+	return result;
 }
 
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
 	(void)lock;
-	wchan_wakeone(cv->cv_wchan);
+	wchan_wakeone(&cv->cv_wchan);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
 	(void)lock;
-	wchan_wakeall(cv->cv_wchan);
+	wchan_wakeall(&cv->cv_wchan);
 }
@@ -35,7 +35,9 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <atomic.h>
 #include <cpu.h>
+#include <counter.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <wchan.h>
@@ -43,10 +45,13 @@
 #include <threadlist.h>
 #include <threadprivate.h>
 #include <current.h>
+#include <clock.h>
 #include <synch.h>
+#include <slab.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <file.h>
 #include <kern/sysexits.h>
 #include <kern/wait.h> /* New include of macros to make exit codes for ASST1 */
 #include <pid.h> /* New include of pid functions for ASST 1 */
@@ -56,21 +61,23 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
-/* Wait channel. */
-struct wchan {
-	const char *wc_name;		/* name for this channel */
-	struct threadlist wc_threads;	/* list of waiting threads */
-	struct spinlock wc_lock;	/* lock for mutual exclusion */
-};
-
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
 static struct cpuarray allcpus;
 
+/* Object caches for threads and wait channels. */
+static struct kmem_cache *thread_cache;
+static struct kmem_cache *wchan_cache;
+
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Statistics. */
+static struct counter switch_count = COUNTER_INITIALIZER("thread_switch");
+static struct counter remote_wakeup_count =
+	COUNTER_INITIALIZER("remote_wakeup");
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -110,6 +117,50 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Object cache constructor and destructor for struct thread. These
+ * handle the parts of the thread that are the same for every thread
+ * and come back to the same state when it's destroyed.
+ */
+static
+void
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+}
+
+/*
+ * Object cache constructor and destructor for wait channels: the
+ * lock and list are set up once and stay that way while the channel
+ * is in the cache.
+ */
+static
+void
+wchan_ctor(void *obj)
+{
+	wchan_init(obj, NULL);
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	wchan_cleanup(obj);
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -122,31 +173,37 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
 
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
+	/* Thread subsystem fields (t_machdep, t_listnode: thread_ctor) */
 	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
+	thread->t_inboxnext = NULL;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Scheduling fields */
+	thread->t_priority = PRI_DEFAULT;
+	thread->t_effpriority = PRI_DEFAULT;
+	thread->t_waitlock = NULL;
+	thread->t_pinext = NULL;
+	thread->t_heldlocks = NULL;
+
 	/* Process ID  - New for ASST 2 */
 	thread->t_pid = INVALID_PID;
 
@@ -155,6 +212,7 @@ thread_create(const char *name)
 
 	/* VFS fields */
 	thread->t_cwd = NULL;
+	thread->t_filetable = NULL;
 
 	/* If you add to struct thread, be sure to initialize here */
 
@@ -187,13 +245,21 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	bzero(c->c_counters, sizeof(c->c_counters));
+	c->c_kmag = NULL;
+	c->c_tlbnext = 0;
+	c->c_asid = 0;
+	c->c_asidgen = 0;
+	c->c_asidnext = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_inbox = NULL;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_seq = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -240,6 +306,21 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Access to the cpu list.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned num)
+{
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Destroy a thread.
  *
@@ -262,22 +343,28 @@ thread_destroy(struct thread *thread)
 
 	/* VFS fields, cleaned up in thread_exit */
 	KASSERT(thread->t_cwd == NULL);
+	KASSERT(thread->t_filetable == NULL);
 
 	/* VM fields, cleaned up in thread_exit */
 	KASSERT(thread->t_addrspace == NULL);
 
+	/* Scheduling fields; a dead thread can't hold or want locks */
+	KASSERT(thread->t_waitlock == NULL);
+	KASSERT(thread->t_heldlocks == NULL);
+
 	/* Thread subsystem fields */
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
-	thread_machdep_cleanup(&thread->t_machdep);
+	/* t_listnode and t_machdep must be back as thread_ctor left them */
+	KASSERT(thread->t_listnode.tln_next == NULL);
+	KASSERT(thread->t_listnode.tln_prev == NULL);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(thread_cache, thread);
 }
 
 /*
@@ -323,6 +410,7 @@ thread_panic(void)
 	 */
 	curcpu->c_runqueue.tl_count = 0;
 	curcpu->c_runqueue.tl_head.tln_next = NULL;
+	curcpu->c_inbox = NULL;
 	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
 
 	/*
@@ -369,6 +457,14 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	thread_cache = kmem_cache_create("thread", sizeof(struct thread), 0,
+					 thread_ctor, thread_dtor);
+	wchan_cache = kmem_cache_create("wchan", sizeof(struct wchan), 0,
+					wchan_ctor, wchan_dtor);
+	if (thread_cache == NULL || wchan_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -441,21 +537,81 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Move threads posted to the current cpu's inbox onto its run queue.
+ * The inbox is a stack, so reverse it first to keep wakeups in
+ * the order they were posted. Must hold the run queue lock.
+ */
+static
+void
+thread_drain_inbox(void)
+{
+	struct thread *list, *t, *fifo;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	do {
+		list = curcpu->c_inbox;
+		if (list == NULL) {
+			return;
+		}
+	} while (!atomic_cas_ptr((void *volatile *)&curcpu->c_inbox,
+				 list, NULL));
+
+	fifo = NULL;
+	while (list != NULL) {
+		t = list;
+		list = t->t_inboxnext;
+		t->t_inboxnext = fifo;
+		fifo = t;
+	}
+	while (fifo != NULL) {
+		t = fifo;
+		fifo = t->t_inboxnext;
+		t->t_inboxnext = NULL;
+		threadlist_addtail(&curcpu->c_runqueue, t);
+	}
+}
+
 /*
  * Make a thread runnable.
  *
- * targetcpu might be curcpu; it might not be, too. 
+ * targetcpu might be curcpu; it might not be, too. If it isn't, and
+ * we don't already hold its run queue lock, post the thread to the
+ * target cpu's inbox instead of locking its run queue; the target
+ * picks it up the next time it goes through thread_switch.
+ *
+ * Reading c_isidle without the lock is safe here: the target sets
+ * c_isidle before it last checks the inbox, so either it sees our
+ * push or we see it idle and send it an interrupt.
  */
 static
 void
 thread_make_runnable(struct thread *target, bool already_have_lock)
 {
 	struct cpu *targetcpu;
+	struct thread *old;
 	bool isidle;
 
 	/* Lock the run queue of the target thread's cpu. */
 	targetcpu = target->t_cpu;
 
+	if (!already_have_lock && CURCPU_EXISTS() &&
+	    targetcpu != curcpu->c_self) {
+		KASSERT(target->t_inboxnext == NULL);
+		do {
+			old = targetcpu->c_inbox;
+			target->t_inboxnext = old;
+		} while (!atomic_cas_ptr(
+				(void *volatile *)&targetcpu->c_inbox,
+				old, target));
+		COUNTER_INC(&remote_wakeup_count);
+		if (targetcpu->c_isidle) {
+			ipi_send(targetcpu, IPI_UNIDLE);
+		}
+		return;
+	}
+
 	if (already_have_lock) {
 		/* The target thread's cpu should be already locked. */
 		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
@@ -524,10 +680,25 @@ thread_fork(const char *name,
 		return result;
 	}
 
+	/* Share open files, if there are any, for sys_fork */
+	if (curthread->t_filetable != NULL) {
+		result = filetable_copy(curthread->t_filetable,
+					&newthread->t_filetable);
+		if (result) {
+			pid_unalloc(newthread->t_pid);
+			thread_destroy(newthread);
+			return result;
+		}
+	}
+
 	/* Copy address space if there is one - new for ASST1, sys_fork */
 	if (curthread->t_addrspace != NULL) {
 		result = as_copy(curthread->t_addrspace, &newthread->t_addrspace);
 		if (result) {
+			if (newthread->t_filetable != NULL) {
+				filetable_destroy(newthread->t_filetable);
+				newthread->t_filetable = NULL;
+			}
  			pid_unalloc(newthread->t_pid); 
 			thread_destroy(newthread);
  			return ENOMEM;
@@ -541,6 +712,10 @@ thread_fork(const char *name,
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
 
+	/* Scheduling fields: base priority only, not anything inherited */
+	newthread->t_priority = curthread->t_priority;
+	newthread->t_effpriority = curthread->t_priority;
+
 	/* VM fields */
 	/* do not clone address space -- let caller decide on that */
 
@@ -622,6 +797,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
+	/* Pick up anything other cpus have woken up for us. */
+	thread_drain_inbox();
+
 	/* Micro-optimization: if nothing to do, just return */
 	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
 		spinlock_release(&curcpu->c_runqueue_lock);
@@ -681,15 +859,27 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
+		thread_drain_inbox();
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+#if OPT_DUMBVM
 			cpu_idle();
+#else
+			/* Zero pages for the VM system instead, if need be. */
+			if (!zeropool_idle()) {
+				cpu_idle();
+			}
+#endif
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	if (next != cur) {
+		COUNTER_INC(&switch_count);
+	}
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -849,6 +1039,10 @@ thread_exit(int exitcode)
 		VOP_DECREF(cur->t_cwd);
 		cur->t_cwd = NULL;
 	}
+	if (cur->t_filetable) {
+		filetable_destroy(cur->t_filetable);
+		cur->t_filetable = NULL;
+	}
 
 	/* VM fields */
 	if (cur->t_addrspace) {
@@ -894,10 +1088,86 @@ thread_yield(void)
 void
 schedule(void)
 {
+	struct threadlist sorted;
+	struct threadlistnode *tln;
+	struct thread *t, *pos;
+
 	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
+	 * Insertion sort on effective priority. The sort is stable, so
+	 * threads of equal priority keep their round-robin order; with
+	 * everyone at PRI_DEFAULT this changes nothing. Run queues are
+	 * short, so quadratic is fine.
 	 */
+	threadlist_init(&sorted);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	while ((t = threadlist_remhead(&curcpu->c_runqueue)) != NULL) {
+		pos = NULL;
+		for (tln = sorted.tl_tail.tln_prev; tln->tln_prev != NULL;
+		     tln = tln->tln_prev) {
+			if (tln->tln_self->t_effpriority >= t->t_effpriority) {
+				pos = tln->tln_self;
+				break;
+			}
+		}
+		if (pos == NULL) {
+			threadlist_addhead(&sorted, t);
+		}
+		else {
+			threadlist_insertafter(&sorted, pos, t);
+		}
+	}
+	while ((t = threadlist_remhead(&sorted)) != NULL) {
+		threadlist_addtail(&curcpu->c_runqueue, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	threadlist_cleanup(&sorted);
+}
+
+/*
+ * Move T to where its effective priority now puts it in its cpu's
+ * run queue, if it's on one. Priority inheritance calls this when it
+ * boosts a thread, so the boost counts right away rather than at the
+ * next schedule(). If T is running, asleep, still in an inbox, or
+ * migrating, there's nothing to do; it gets sorted in when it's next
+ * queued.
+ */
+void
+thread_requeue(struct thread *t)
+{
+	struct cpu *c = t->t_cpu;
+	struct threadlistnode *tln;
+	struct thread *pos;
+	bool found = false;
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	for (tln = c->c_runqueue.tl_head.tln_next; tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		if (tln->tln_self == t) {
+			found = true;
+			break;
+		}
+	}
+	if (found) {
+		threadlist_remove(&c->c_runqueue, t);
+		/* After the last thread at least as important, as in schedule */
+		pos = NULL;
+		for (tln = c->c_runqueue.tl_tail.tln_prev;
+		     tln->tln_prev != NULL; tln = tln->tln_prev) {
+			if (tln->tln_self->t_effpriority >= t->t_effpriority) {
+				pos = tln->tln_self;
+				break;
+			}
+		}
+		if (pos == NULL) {
+			threadlist_addhead(&c->c_runqueue, t);
+		}
+		else {
+			threadlist_insertafter(&c->c_runqueue, pos, t);
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
 }
 
 /*
@@ -1041,14 +1311,23 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
+	wc->wc_name = name;
+	return wc;
+}
+
+/*
+ * Initialize a wait channel in place.
+ */
+void
+wchan_init(struct wchan *wc, const char *name)
+{
 	spinlock_init(&wc->wc_lock);
 	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
-	return wc;
 }
 
 /*
@@ -1057,10 +1336,24 @@ wchan_create(const char *name)
  */
 void
 wchan_destroy(struct wchan *wc)
+{
+	/*
+	 * Check it's idle, and put it back the way wchan_ctor left
+	 * it for the next user.
+	 */
+	wchan_cleanup(wc);
+	wchan_init(wc, NULL);
+	kmem_cache_free(wchan_cache, wc);
+}
+
+/*
+ * Clean up a wait channel set up with wchan_init.
+ */
+void
+wchan_cleanup(struct wchan *wc)
 {
 	spinlock_cleanup(&wc->wc_lock);
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
 }
 
 /*
@@ -1094,16 +1387,101 @@ wchan_sleep(struct wchan *wc)
 }
 
 /*
- * Wake up one thread sleeping on a wait channel.
+ * State shared between wchan_sleep_timed and its callout.
+ */
+struct wchan_timeout {
+	struct wchan *wt_wchan;		/* Channel we're sleeping on */
+	struct thread *wt_thread;	/* Who's sleeping */
+	bool wt_fired;			/* Woken by the timeout */
+};
+
+/*
+ * Callout function for wchan_sleep_timed: if the thread is still on
+ * the channel, take it off and wake it. If it isn't, somebody else
+ * already woke it and we do nothing.
+ */
+static
+void
+wchan_timeout(void *data)
+{
+	struct wchan_timeout *wt = data;
+	struct wchan *wc = wt->wt_wchan;
+	struct threadlistnode *tln;
+	bool found = false;
+
+	spinlock_acquire(&wc->wc_lock);
+	for (tln = wc->wc_threads.tl_head.tln_next; tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		if (tln->tln_self == wt->wt_thread) {
+			found = true;
+			break;
+		}
+	}
+	if (found) {
+		threadlist_remove(&wc->wc_threads, wt->wt_thread);
+		wt->wt_fired = true;
+	}
+	spinlock_release(&wc->wc_lock);
+
+	if (found) {
+		thread_make_runnable(wt->wt_thread, false);
+	}
+}
+
+/*
+ * Sleep on a wait channel for at most TICKS ticks. As with
+ * wchan_sleep, the channel must be locked and will be unlocked on
+ * return.
+ *
+ * The callout lives on our stack; callout_stop guarantees it is done
+ * with it before we return.
+ */
+int
+wchan_sleep_timed(struct wchan *wc, unsigned ticks)
+{
+	struct wchan_timeout wt;
+	struct callout co;
+
+	/* may not sleep in an interrupt handler */
+	KASSERT(!curthread->t_in_interrupt);
+
+	wt.wt_wchan = wc;
+	wt.wt_thread = curthread;
+	wt.wt_fired = false;
+	callout_init(&co, wchan_timeout, &wt);
+	callout_reset(&co, ticks);
+
+	thread_switch(S_SLEEP, wc);
+
+	callout_stop(&co);
+	return wt.wt_fired ? ETIMEDOUT : 0;
+}
+
+/*
+ * Wake up one thread sleeping on a wait channel: the one with the
+ * highest effective priority, or of those, the one that has waited
+ * longest. (The priority is read without the inheritance lock; if it
+ * changes under us we just make a slightly worse choice.)
  */
 void
 wchan_wakeone(struct wchan *wc)
 {
 	struct thread *target;
+	struct threadlistnode *tln;
 
 	/* Lock the channel and grab a thread from it */
 	spinlock_acquire(&wc->wc_lock);
-	target = threadlist_remhead(&wc->wc_threads);
+	target = NULL;
+	for (tln = wc->wc_threads.tl_head.tln_next; tln->tln_next != NULL;
+	     tln = tln->tln_next) {
+		if (target == NULL ||
+		    tln->tln_self->t_effpriority > target->t_effpriority) {
+			target = tln->tln_self;
+		}
+	}
+	if (target != NULL) {
+		threadlist_remove(&wc->wc_threads, target);
+	}
 	/*
 	 * Nobody else can wake up this thread now, so we don't need
 	 * to hang onto the lock.
@@ -1205,26 +1583,42 @@ ipi_broadcast(int code)
 	}
 }
 
-void
+unsigned
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	int n;
+	return ipi_tlbshootdown_batch(target, mapping, 1);
+}
+
+unsigned
+ipi_tlbshootdown_batch(struct cpu *target,
+		       const struct tlbshootdown *mappings, int n)
+{
+	unsigned seq;
+	int i, queued;
+
+	KASSERT(n == TLBSHOOTDOWN_ALL || (n > 0 && n <= TLBSHOOTDOWN_MAX));
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	/* If they don't all fit, flush everything instead. */
+	queued = target->c_numshootdown;
+	if (n == TLBSHOOTDOWN_ALL || queued == TLBSHOOTDOWN_ALL ||
+	    queued + n > TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
 	}
 	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+		for (i=0; i<n; i++) {
+			target->c_shootdown[queued + i] = mappings[i];
+		}
+		target->c_numshootdown = queued + n;
 	}
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
+	seq = target->c_shootdown_seq;
 
 	spinlock_release(&target->c_ipi_lock);
+	return seq;
 }
 
 void
@@ -1256,7 +1650,8 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_UNIDLE)) {
 		/*
 		 * The cpu has already unidled itself to take the
-		 * interrupt; don't need to do anything else.
+		 * interrupt; just collect the woken threads from the
+		 * inbox, below, once the IPI lock is released.
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
@@ -1269,8 +1664,16 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_seq++;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_UNIDLE)) {
+		/* Lock order is runqueue before IPI, so do this last. */
+		spinlock_acquire(&curcpu->c_runqueue_lock);
+		thread_drain_inbox();
+		spinlock_release(&curcpu->c_runqueue_lock);
+	}
 }
@@ -27,51 +27,460 @@
  * SUCH DAMAGE.
  */
 
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <slab.h>
+#include <synch.h>
+#include <cpu.h>
+#include <current.h>
+#include <counter.h>
 #include <addrspace.h>
+#include <pagetable.h>
+#include <textcache.h>
 #include <vm.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
  * used. The cheesy hack versions in dumbvm.c are used instead.
+ *
+ * An address space is a list of regions, which say what addresses
+ * are valid and with what permissions, and a page table, which says
+ * where the pages are. Pages are only allocated when first touched:
+ * vm_fault calls as_getpage, which fills a new page with zeros or,
+ * for the parts of a region backed by a file (the program's text and
+ * data), with data read from the file. So loading a program costs
+ * nothing per page, and pages that are never used are never read.
+ * When memory runs short, the pager (swap.c) writes pages out to swap
+ * and marks their page table entries PTE_SWAPPED; as_getpage reads
+ * them back in. Program text is shared between processes running
+ * the same program; see textcache.c. Files mapped with mmap are just
+ * more file-backed regions, so they are brought in the same way.
+ *
+ * Only the thread that owns an address space uses it, but the pager
+ * can come in from other threads to take its pages away, so the
+ * regions and page table are covered by as_lock.
+ */
+
+/* Where address spaces come from. */
+static struct kmem_cache *addrspace_cache;
+
+/* System-wide totals of the page faults in struct vmstats. */
+static struct counter zerofault_count = COUNTER_INITIALIZER("fault_zero");
+static struct counter filefault_count = COUNTER_INITIALIZER("fault_file");
+static struct counter textfault_count = COUNTER_INITIALIZER("fault_text");
+static struct counter swapfault_count = COUNTER_INITIALIZER("fault_swap");
+
+/*
+ * Object cache constructor/destructor for address spaces: the lock
+ * is set up once per object.
  */
+static
+void
+addrspace_ctor(void *obj)
+{
+	struct addrspace *as = obj;
+
+	lock_init(&as->as_lock, "addrspace");
+}
+
+static
+void
+addrspace_dtor(void *obj)
+{
+	struct addrspace *as = obj;
+
+	lock_cleanup(&as->as_lock);
+}
+
+void
+as_bootstrap(void)
+{
+	addrspace_cache = kmem_cache_create("addrspace",
+					    sizeof(struct addrspace), 0,
+					    addrspace_ctor, addrspace_dtor);
+	if (addrspace_cache == NULL) {
+		panic("as_bootstrap: Out of memory\n");
+	}
+	textcache_bootstrap();
+}
 
 struct addrspace *
 as_create(void)
 {
 	struct addrspace *as;
 
-	as = kmalloc(sizeof(struct addrspace));
+	as = kmem_cache_alloc(addrspace_cache);
 	if (as == NULL) {
 		return NULL;
 	}
 
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kmem_cache_free(addrspace_cache, as);
+		return NULL;
+	}
+	if (vm_tlb_asinit(as)) {
+		pt_destroy(as->as_pt);
+		kmem_cache_free(addrspace_cache, as);
+		return NULL;
+	}
+	as->as_regions = NULL;
+	as->as_heap = NULL;
+	as->as_heapbreak = 0;
+	bzero(&as->as_stats, sizeof(as->as_stats));
+
+	return as;
+}
+
+/*
+ * Insert a region, keeping the list sorted. Fails with EINVAL if it
+ * overlaps an existing one.
+ */
+static
+int
+as_addregion(struct addrspace *as, vaddr_t base, size_t npages,
+	     unsigned perms)
+{
+	struct vm_region **pp, *vr;
+	vaddr_t top = base + npages * PAGE_SIZE;
+
+	for (pp = &as->as_regions; *pp != NULL; pp = &(*pp)->vr_next) {
+		vr = *pp;
+		if (vr->vr_base >= top) {
+			break;
+		}
+		if (vr->vr_base + vr->vr_npages * PAGE_SIZE > base) {
+			return EINVAL;
+		}
+	}
+
+	vr = kmalloc(sizeof(*vr));
+	if (vr == NULL) {
+		return ENOMEM;
+	}
+	vr->vr_base = base;
+	vr->vr_npages = npages;
+	vr->vr_perms = perms;
+	vr->vr_vnode = NULL;
+	vr->vr_fileoff = 0;
+	vr->vr_filevaddr = 0;
+	vr->vr_filesz = 0;
+	vr->vr_text = NULL;
+	vr->vr_next = *pp;
+	*pp = vr;
+	return 0;
+}
+
+/*
+ * Return true if any of the page at VADDR in VR comes from the file.
+ */
+static
+bool
+as_fileinpage(struct vm_region *vr, vaddr_t vaddr)
+{
+	return vr->vr_vnode != NULL &&
+		vaddr + PAGE_SIZE > vr->vr_filevaddr &&
+		vaddr < vr->vr_filevaddr + vr->vr_filesz;
+}
+
+/*
+ * Fill the page at PA, which is to be mapped at VADDR in VR: read in
+ * whatever part of it comes from the file, and zero the rest.
+ */
+int
+as_fillpage(struct vm_region *vr, vaddr_t vaddr, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *kva = (char *)PADDR_TO_KVADDR(pa);
+	vaddr_t lo, hi;
+	int result;
+
+	lo = vaddr;
+	hi = vaddr + PAGE_SIZE;
+	if (vr->vr_vnode != NULL) {
+		if (lo < vr->vr_filevaddr) {
+			lo = vr->vr_filevaddr;
+		}
+		if (hi > vr->vr_filevaddr + vr->vr_filesz) {
+			hi = vr->vr_filevaddr + vr->vr_filesz;
+		}
+	}
+	if (vr->vr_vnode == NULL || lo >= hi) {
+		bzero(kva, PAGE_SIZE);
+		return 0;
+	}
+
+	bzero(kva, lo - vaddr);
+	bzero(kva + (hi - vaddr), vaddr + PAGE_SIZE - hi);
+
+	uio_kinit(&iov, &ku, kva + (lo - vaddr), hi - lo,
+		  vr->vr_fileoff + (lo - vr->vr_filevaddr), UIO_READ);
+	result = VOP_READ(vr->vr_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("vm: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+	return 0;
+}
+
+/*
+ * Count a page newly mapped into AS.
+ */
+static
+void
+as_addresident(struct addrspace *as)
+{
+	as->as_stats.vs_resident++;
+	if (as->as_stats.vs_resident > as->as_stats.vs_maxresident) {
+		as->as_stats.vs_maxresident = as->as_stats.vs_resident;
+	}
+}
+
+/*
+ * Find the page at VADDR in region VR of AS, bringing it in if it
+ * isn't there. The caller holds as_lock.
+ */
+int
+as_getpage(struct addrspace *as, struct vm_region *vr, vaddr_t vaddr,
+	   paddr_t *ret)
+{
+	uint32_t *pte;
+	paddr_t pa;
+	bool readin;
+	int result;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+	KASSERT(lock_do_i_hold(&as->as_lock));
+
+	pte = pt_lookup(as->as_pt, vaddr, true);
+	if (pte == NULL) {
+		return ENOMEM;
+	}
+	if (*pte & PTE_SHARED) {
+		*ret = *pte & PTE_FRAME;
+		return 0;
+	}
+	if (*pte & PTE_VALID) {
+		pa = *pte & PTE_FRAME;
+		coremap_touch(pa);
+		*ret = pa;
+		return 0;
+	}
+	if (vr->vr_text != NULL) {
+		result = textcache_getpage(vr->vr_text, vr, vaddr, &pa,
+					   &readin);
+		if (result) {
+			return result;
+		}
+		if (pa != 0) {
+			if (readin) {
+				as->as_stats.vs_filefaults++;
+				COUNTER_INC(&filefault_count);
+			}
+			else {
+				as->as_stats.vs_textfaults++;
+				COUNTER_INC(&textfault_count);
+			}
+			*pte = pa | PTE_VALID | PTE_SHARED;
+			as_addresident(as);
+			*ret = pa;
+			return 0;
+		}
+		/* The textcache is full; read in a page of our own. */
+	}
+
 	/*
-	 * Initialize as needed.
+	 * Note that page_alloc may page out other pages of ours, but
+	 * not this one, since it isn't in memory.
 	 */
+	if (*pte & PTE_SWAPPED) {
+		pa = page_alloc();
+		if (pa == 0) {
+			return ENOMEM;
+		}
+		result = swap_pagein(PTE_SWAPSLOT(*pte), pa);
+		if (result) {
+			coremap_free(pa);
+			return result;
+		}
+		swap_free(PTE_SWAPSLOT(*pte));
+		as->as_stats.vs_swapfaults++;
+		COUNTER_INC(&swapfault_count);
+	}
+	else if (as_fileinpage(vr, vaddr)) {
+		pa = page_alloc();
+		if (pa == 0) {
+			return ENOMEM;
+		}
+		result = as_fillpage(vr, vaddr, pa);
+		if (result) {
+			coremap_free(pa);
+			return result;
+		}
+		as->as_stats.vs_filefaults++;
+		COUNTER_INC(&filefault_count);
+	}
+	else {
+		/* Nothing from the file: take a page that's zero already. */
+		pa = page_alloc_zeroed();
+		if (pa == 0) {
+			return ENOMEM;
+		}
+		as->as_stats.vs_zerofaults++;
+		COUNTER_INC(&zerofault_count);
+	}
 
-	return as;
+	*pte = pa | PTE_VALID;
+	as_addresident(as);
+	coremap_setowner(pa, as, vaddr);
+	*ret = pa;
+	return 0;
+}
+
+struct vm_region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+	struct vm_region *vr;
+
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vaddr < vr->vr_base) {
+			return NULL;
+		}
+		if (vaddr < vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+			return vr;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Copy the page at VADDR, if there is one, from OLD to NEWAS. Both
+ * are locked.
+ */
+static
+int
+as_copypage(struct addrspace *old, struct addrspace *newas, vaddr_t vaddr)
+{
+	uint32_t *oldpte, *newpte;
+	paddr_t pa;
+	int result;
+
+	oldpte = pt_lookup(old->as_pt, vaddr, false);
+	if (oldpte == NULL || *oldpte == 0) {
+		return 0;
+	}
+	newpte = pt_lookup(newas->as_pt, vaddr, true);
+	if (newpte == NULL) {
+		return ENOMEM;
+	}
+	if (*oldpte & PTE_SHARED) {
+		*newpte = *oldpte;
+		as_addresident(newas);
+		return 0;
+	}
+
+	/*
+	 * Get the new page first: that might page out the old one,
+	 * so only look at where it is afterwards.
+	 */
+	pa = page_alloc();
+	if (pa == 0) {
+		return ENOMEM;
+	}
+	if (*oldpte & PTE_VALID) {
+		memmove((void *)PADDR_TO_KVADDR(pa),
+			(const void *)PADDR_TO_KVADDR(*oldpte & PTE_FRAME),
+			PAGE_SIZE);
+	}
+	else {
+		KASSERT(*oldpte & PTE_SWAPPED);
+		result = swap_pagein(PTE_SWAPSLOT(*oldpte), pa);
+		if (result) {
+			coremap_free(pa);
+			return result;
+		}
+	}
+
+	*newpte = pa | PTE_VALID;
+	as_addresident(newas);
+	coremap_setowner(pa, newas, vaddr);
+	return 0;
 }
 
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *newas;
+	struct vm_region *vr, **tailp, *newvr;
+	vaddr_t va;
+	unsigned i;
+	int result;
 
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
 	}
 
+	lock_acquire(&old->as_lock);
+	tailp = &newas->as_regions;
+	for (vr = old->as_regions; vr != NULL; vr = vr->vr_next) {
+		newvr = kmalloc(sizeof(*newvr));
+		if (newvr == NULL) {
+			lock_release(&old->as_lock);
+			as_destroy(newas);
+			return ENOMEM;
+		}
+		*newvr = *vr;
+		newvr->vr_next = NULL;
+		if (newvr->vr_vnode != NULL) {
+			VOP_INCOPEN(newvr->vr_vnode);
+			VOP_INCREF(newvr->vr_vnode);
+		}
+		if (newvr->vr_text != NULL) {
+			textcache_incref(newvr->vr_text);
+		}
+		if (vr == old->as_heap) {
+			newas->as_heap = newvr;
+		}
+		*tailp = newvr;
+		tailp = &newvr->vr_next;
+	}
+	newas->as_heapbreak = old->as_heapbreak;
+
 	/*
-	 * Write this.
+	 * Nobody else can see newas yet, but the pager can find its
+	 * pages as soon as they're set up, so lock it too.
 	 */
+	lock_acquire(&newas->as_lock);
+	result = 0;
+	for (vr = old->as_regions; vr != NULL && result == 0;
+	     vr = vr->vr_next) {
+		for (i = 0; i < vr->vr_npages; i++) {
+			va = vr->vr_base + i * PAGE_SIZE;
+			result = as_copypage(old, newas, va);
+			if (result) {
+				break;
+			}
+		}
+	}
+	lock_release(&newas->as_lock);
+	lock_release(&old->as_lock);
+	if (result) {
+		as_destroy(newas);
+		return result;
+	}
 
-	(void)old;
-	
 	*ret = newas;
 	return 0;
 }
@@ -79,21 +488,31 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
-	/*
-	 * Clean up as needed.
-	 */
-	
-	kfree(as);
+	struct vm_region *vr;
+
+	lock_acquire(&as->as_lock);
+	while (as->as_regions != NULL) {
+		vr = as->as_regions;
+		as->as_regions = vr->vr_next;
+		if (vr->vr_text != NULL) {
+			textcache_release(vr->vr_text);
+		}
+		if (vr->vr_vnode != NULL) {
+			vfs_close(vr->vr_vnode);
+		}
+		kfree(vr);
+	}
+	/* The pager looks at as_asids while we still own pages. */
+	pt_destroy(as->as_pt);
+	vm_tlb_ascleanup(as);
+	lock_release(&as->as_lock);
+	kmem_cache_free(addrspace_cache, as);
 }
 
 void
 as_activate(struct addrspace *as)
 {
-	/*
-	 * Write this.
-	 */
-
-	(void)as;  // suppress warning until code gets written
+	vm_tlb_activate(as);
 }
 
 /*
@@ -102,61 +521,379 @@ as_activate(struct addrspace *as)
  * VADDR+MEMSIZE.
  *
  * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * write, or execute permission should be set on the segment. Writes
+ * to a segment without WRITEABLE fault.
  */
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this.
-	 */
+	unsigned perms;
 
-	(void)as;
-	(void)vaddr;
-	(void)sz;
-	(void)readable;
-	(void)writeable;
-	(void)executable;
-	return EUNIMP;
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	if (sz == 0 || vaddr >= USERSPACETOP || sz > USERSPACETOP - vaddr) {
+		return EINVAL;
+	}
+
+	perms = 0;
+	if (readable) {
+		perms |= VR_READ;
+	}
+	if (writeable) {
+		perms |= VR_WRITE;
+	}
+	if (executable) {
+		perms |= VR_EXEC;
+	}
+
+	return as_addregion(as, vaddr, sz / PAGE_SIZE, perms);
 }
 
+/*
+ * Arrange for the FILESZ bytes at VADDR to come from V at OFFSET.
+ * They have to be in one region, which must not have been touched
+ * yet.
+ */
 int
-as_prepare_load(struct addrspace *as)
+as_define_file(struct addrspace *as, vaddr_t vaddr, size_t filesz,
+	       struct vnode *v, off_t offset)
 {
-	/*
-	 * Write this.
-	 */
+	struct vm_region *vr;
 
+	if (filesz == 0) {
+		return 0;
+	}
+
+	vr = as_findregion(as, vaddr);
+	if (vr == NULL || vr->vr_vnode != NULL ||
+	    filesz > vr->vr_base + vr->vr_npages * PAGE_SIZE - vaddr) {
+		return EINVAL;
+	}
+
+	/* Keep the file open as long as the region is around. */
+	VOP_INCOPEN(v);
+	VOP_INCREF(v);
+	vr->vr_vnode = v;
+	vr->vr_fileoff = offset;
+	vr->vr_filevaddr = vaddr;
+	vr->vr_filesz = filesz;
+
+	/* Share the pages if they can't be changed. */
+	if ((vr->vr_perms & VR_WRITE) == 0) {
+		vr->vr_text = textcache_get(vr);
+	}
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/* Nothing to do; pages come in as they're touched. */
 	(void)as;
 	return 0;
 }
 
+/*
+ * The program is loaded; put the (empty) heap right above it.
+ */
 int
 as_complete_load(struct addrspace *as)
 {
+	struct vm_region *vr;
+	vaddr_t base;
+	int result;
+
+	base = 0;
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		base = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+	}
+	if (base == 0) {
+		return EINVAL;
+	}
+
+	result = as_addregion(as, base, 0, VR_READ | VR_WRITE);
+	if (result) {
+		return result;
+	}
+	/* It's empty, so as_findregion won't find it; it's the last one. */
+	for (vr = as->as_regions; vr->vr_next != NULL; vr = vr->vr_next) {
+		/* nothing */
+	}
+	KASSERT(vr->vr_base == base && vr->vr_npages == 0);
+	as->as_heap = vr;
+	as->as_heapbreak = base;
+	return 0;
+}
+
+/*
+ * Take the pages of the batch in TS out of the TLBs, then free those
+ * in PAS that are ours.
+ */
+static
+void
+as_dropbatch(const struct tlbshootdown *ts, const paddr_t *pas, unsigned n)
+{
+	unsigned i;
+
+	vm_tlb_shootdown_many(ts, n);
+	for (i=0; i<n; i++) {
+		if (pas[i] != 0) {
+			coremap_free(pas[i]);
+		}
+	}
+}
+
+/*
+ * Throw away the pages from START up to END, in memory or in swap,
+ * and clear their entries. Pages in memory are taken out of the TLBs
+ * a batch at a time before they're freed; shared pages are only
+ * unmapped, since they belong to their textobj. The caller holds
+ * as_lock.
+ */
+static
+void
+as_droprange(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	paddr_t pas[TLBSHOOTDOWN_MAX];
+	uint32_t *pte;
+	vaddr_t va;
+	unsigned n;
+
+	KASSERT(lock_do_i_hold(&as->as_lock));
+
+	n = 0;
+	for (va = start; va < end; va += PAGE_SIZE) {
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL || *pte == 0) {
+			continue;
+		}
+		if ((*pte & PTE_VALID) == 0) {
+			KASSERT(*pte & PTE_SWAPPED);
+			swap_free(PTE_SWAPSLOT(*pte));
+			*pte = 0;
+			continue;
+		}
+		pas[n] = (*pte & PTE_SHARED) ? 0 : (*pte & PTE_FRAME);
+		as->as_stats.vs_resident--;
+		ts[n].ts_as = as;
+		ts[n].ts_vaddr = va;
+		n++;
+		*pte = 0;
+		if (n == TLBSHOOTDOWN_MAX) {
+			as_dropbatch(ts, pas, n);
+			n = 0;
+		}
+	}
+	if (n > 0) {
+		as_dropbatch(ts, pas, n);
+	}
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct vm_region *vr;
+	vaddr_t brk, newbrk, top;
+	size_t npages;
+
+	lock_acquire(&as->as_lock);
+
+	vr = as->as_heap;
+	if (vr == NULL) {
+		lock_release(&as->as_lock);
+		return ENOMEM;
+	}
+	brk = as->as_heapbreak;
+
 	/*
-	 * Write this.
+	 * Negate after converting: -amount overflows for INTPTR_MIN,
+	 * but the unsigned negation is always its magnitude.
 	 */
+	if (amount < 0 && -(size_t)amount > brk - vr->vr_base) {
+		lock_release(&as->as_lock);
+		return EINVAL;
+	}
+	if (amount > 0 && (size_t)amount > USERSPACETOP - brk) {
+		lock_release(&as->as_lock);
+		return ENOMEM;
+	}
+	newbrk = brk + amount;
+	npages = (newbrk - vr->vr_base + PAGE_SIZE - 1) / PAGE_SIZE;
+	top = vr->vr_base + npages * PAGE_SIZE;
 
-	(void)as;
+	if (npages > vr->vr_npages) {
+		/* Growing: just make sure there's room. */
+		if (vr->vr_next != NULL && top > vr->vr_next->vr_base) {
+			lock_release(&as->as_lock);
+			return ENOMEM;
+		}
+	}
+	else {
+		/* Shrinking: give back the pages past the new top. */
+		as_droprange(as, top, vr->vr_base + vr->vr_npages * PAGE_SIZE);
+	}
+
+	vr->vr_npages = npages;
+	as->as_heapbreak = newbrk;
+	lock_release(&as->as_lock);
+
+	*oldbreak = brk;
 	return 0;
 }
 
+/*
+ * Map LEN bytes of V, starting at OFFSET, into AS with permissions
+ * PERMS, and hand back where. Pages come in from the file as they're
+ * touched, like a program's; read-only mappings share their pages
+ * through the textcache. Bytes past the end of the file are zeros.
+ *
+ * The mapping goes in the highest gap below the stack that it fits
+ * in, so mappings stack up downwards and leave the heap room to grow.
+ */
+int
+as_mmap(struct addrspace *as, size_t len, unsigned perms,
+	struct vnode *v, off_t offset, vaddr_t *ret)
+{
+	struct vm_region *vr;
+	struct stat st;
+	vaddr_t base, prevtop, floor;
+	size_t npages, filesz;
+	int result;
+
+	KASSERT((offset & ~(off_t)PAGE_FRAME) == 0);
+
+	if (len == 0 || len > USERSPACETOP) {
+		return EINVAL;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	result = VOP_MMAP(v);
+	if (result) {
+		return result;
+	}
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+	filesz = 0;
+	if (offset < st.st_size) {
+		filesz = len;
+		if ((off_t)filesz > st.st_size - offset) {
+			filesz = st.st_size - offset;
+		}
+	}
+
+	lock_acquire(&as->as_lock);
+
+	floor = as->as_heap != NULL ? as->as_heap->vr_base : PAGE_SIZE;
+	base = 0;
+	prevtop = 0;
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (prevtop >= floor &&
+		    vr->vr_base - prevtop >= npages * PAGE_SIZE) {
+			base = vr->vr_base - npages * PAGE_SIZE;
+		}
+		prevtop = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+	}
+	if (prevtop >= floor && USERSPACETOP - prevtop >= npages * PAGE_SIZE) {
+		base = USERSPACETOP - npages * PAGE_SIZE;
+	}
+	if (base == 0) {
+		lock_release(&as->as_lock);
+		return ENOMEM;
+	}
+
+	result = as_addregion(as, base, npages, perms | VR_MMAP);
+	if (result) {
+		lock_release(&as->as_lock);
+		return result;
+	}
+	vr = as_findregion(as, base);
+	KASSERT(vr != NULL && vr->vr_base == base);
+
+	VOP_INCOPEN(v);
+	VOP_INCREF(v);
+	vr->vr_vnode = v;
+	vr->vr_fileoff = offset;
+	vr->vr_filevaddr = base;
+	vr->vr_filesz = filesz;
+	if ((perms & VR_WRITE) == 0) {
+		vr->vr_text = textcache_get(vr);
+	}
+	lock_release(&as->as_lock);
+
+	*ret = base;
+	return 0;
+}
+
+/*
+ * Remove the mapping at ADDR, which must be exactly LEN bytes (give
+ * or take rounding to pages) and have come from as_mmap.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct vm_region *vr, **pp;
+	size_t npages;
+
+	if ((addr & PAGE_FRAME) != addr || len == 0) {
+		return EINVAL;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	lock_acquire(&as->as_lock);
+	for (pp = &as->as_regions; *pp != NULL; pp = &(*pp)->vr_next) {
+		if ((*pp)->vr_base >= addr) {
+			break;
+		}
+	}
+	vr = *pp;
+	if (vr == NULL || vr->vr_base != addr || vr->vr_npages != npages ||
+	    (vr->vr_perms & VR_MMAP) == 0) {
+		lock_release(&as->as_lock);
+		return EINVAL;
+	}
+
+	as_droprange(as, vr->vr_base, vr->vr_base + npages * PAGE_SIZE);
+	*pp = vr->vr_next;
+	lock_release(&as->as_lock);
+
+	if (vr->vr_text != NULL) {
+		textcache_release(vr->vr_text);
+	}
+	vfs_close(vr->vr_vnode);
+	kfree(vr);
+	return 0;
+}
+
+void
+as_getstats(struct addrspace *as, struct vmstats *ret)
+{
+	lock_acquire(&as->as_lock);
+	*ret = as->as_stats;
+	lock_release(&as->as_lock);
+}
+
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	/*
-	 * Write this.
-	 */
+	int result;
 
-	(void)as;
+	result = as_addregion(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+			      VM_STACKPAGES, VR_READ | VR_WRITE);
+	if (result) {
+		return result;
+	}
 
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
 	
 	return 0;
 }
-
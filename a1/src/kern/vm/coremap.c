@@ -0,0 +1,533 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Physical page allocator ("coremap").
+ *
+ * There is one entry for every physical page of RAM, indexed by
+ * physical page number. Pages taken with ram_stealmem before the
+ * coremap was set up (including the kernel image and the coremap
+ * itself) are marked fixed and are never handed out or given back.
+ *
+ * Free pages are managed as a binary buddy system: each free block
+ * is 2^k pages long, starts on a 2^k-page boundary, and is on the
+ * free list for order k. Allocating n pages takes the smallest block
+ * that fits, splitting larger ones as needed, and gives back the
+ * tail past n; freeing puts pages back one at a time, merging each
+ * with its buddy for as long as the buddy is also free.
+ *
+ * User pages also record which address space and virtual address
+ * they belong to, so that the pager can find a page's mapping from
+ * the page. A user page is busy (CMF_BUSY: can't be paged out) from
+ * when it is allocated until coremap_setowner is called, and again
+ * while it is being paged out. CMF_REF is the reference bit for the
+ * clock algorithm in coremap_pickvictim. Shared text pages (see
+ * textcache.c) never get an owner, so they stay busy.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+
+/* Page states */
+#define CME_FIXED	0	/* stolen before bootstrap; never freed */
+#define CME_FREE	1	/* on a buddy free list */
+#define CME_KERNEL	2	/* allocated with COREMAP_KERNEL */
+#define CME_USER	3	/* allocated with COREMAP_USER */
+
+#define CM_MAXORDER	12		/* largest free block: 16M */
+#define CM_NONE		0xffffffff	/* null page number */
+#define CM_NOTHEAD	0xff		/* cme_order if not a free block */
+
+/* Flags for user pages */
+#define CMF_BUSY	0x1		/* not to be paged out */
+#define CMF_REF		0x2		/* referenced recently */
+
+struct coremap_entry {
+	uint8_t cme_state;	/* CME_* */
+	uint8_t cme_order;	/* order, if first page of a free block */
+	uint16_t cme_flags;	/* CMF_*, for user pages */
+	uint32_t cme_npages;	/* length, if first page of an allocation */
+	uint32_t cme_next;	/* free list links (page numbers) */
+	uint32_t cme_prev;
+	struct addrspace *cme_as;	/* owner, for user pages */
+	vaddr_t cme_vaddr;		/* where the owner has it */
+};
+
+static struct coremap_entry *coremap;	/* NULL until bootstrap */
+static unsigned cm_npages;		/* size of coremap[] */
+static uint32_t cm_freelists[CM_MAXORDER+1];
+#if !OPT_DUMBVM
+static uint32_t cm_clockhand;		/* for coremap_pickvictim */
+#endif
+
+/* Page counts, for coremap_printstats */
+static unsigned cm_nfixed, cm_nfree, cm_nkernel, cm_nuser;
+
+/* Protects all of the above, and ram_stealmem before bootstrap. */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+// Buddy free lists
+
+static
+void
+freelist_add(uint32_t pn, unsigned order)
+{
+	struct coremap_entry *cme = &coremap[pn];
+
+	cme->cme_order = order;
+	cme->cme_prev = CM_NONE;
+	cme->cme_next = cm_freelists[order];
+	if (cme->cme_next != CM_NONE) {
+		coremap[cme->cme_next].cme_prev = pn;
+	}
+	cm_freelists[order] = pn;
+}
+
+static
+void
+freelist_remove(uint32_t pn, unsigned order)
+{
+	struct coremap_entry *cme = &coremap[pn];
+
+	KASSERT(cme->cme_state == CME_FREE);
+	KASSERT(cme->cme_order == order);
+
+	if (cme->cme_prev != CM_NONE) {
+		coremap[cme->cme_prev].cme_next = cme->cme_next;
+	}
+	else {
+		KASSERT(cm_freelists[order] == pn);
+		cm_freelists[order] = cme->cme_next;
+	}
+	if (cme->cme_next != CM_NONE) {
+		coremap[cme->cme_next].cme_prev = cme->cme_prev;
+	}
+	cme->cme_order = CM_NOTHEAD;
+	cme->cme_next = cme->cme_prev = CM_NONE;
+}
+
+/*
+ * Put the free block of 2^ORDER pages at PN on the free lists,
+ * merging it with its buddy as far as possible.
+ */
+static
+void
+buddy_free(uint32_t pn, unsigned order)
+{
+	uint32_t buddy;
+
+	while (order < CM_MAXORDER) {
+		buddy = pn ^ (1U << order);
+		if (buddy >= cm_npages ||
+		    coremap[buddy].cme_state != CME_FREE ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		freelist_remove(buddy, order);
+		if (buddy < pn) {
+			coremap[pn].cme_order = CM_NOTHEAD;
+			pn = buddy;
+		}
+		order++;
+	}
+	freelist_add(pn, order);
+}
+
+/*
+ * Take a free block of 2^ORDER pages off the free lists, splitting a
+ * larger one if necessary. Returns CM_NONE if there isn't one.
+ */
+static
+uint32_t
+buddy_alloc(unsigned order)
+{
+	unsigned k;
+	uint32_t pn;
+
+	for (k = order; k <= CM_MAXORDER; k++) {
+		if (cm_freelists[k] != CM_NONE) {
+			break;
+		}
+	}
+	if (k > CM_MAXORDER) {
+		return CM_NONE;
+	}
+
+	pn = cm_freelists[k];
+	freelist_remove(pn, k);
+	while (k > order) {
+		k--;
+		/* Give back the upper half. */
+		freelist_add(pn + (1U << k), k);
+	}
+	return pn;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	size_t size;
+	uint32_t pn, firstfree;
+	unsigned i;
+
+	KASSERT(coremap == NULL);
+
+	spinlock_acquire(&coremap_lock);
+
+	ram_getsize(&lo, &hi);
+	lo = ROUNDUP(lo, PAGE_SIZE);
+	cm_npages = hi / PAGE_SIZE;
+
+	/* Put the coremap itself at the bottom of free memory. */
+	size = ROUNDUP(cm_npages * sizeof(struct coremap_entry), PAGE_SIZE);
+	if (lo + size >= hi) {
+		panic("coremap: no room for %u-page coremap\n",
+		      (unsigned)(size / PAGE_SIZE));
+	}
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	lo += size;
+	firstfree = lo / PAGE_SIZE;
+
+	for (i=0; i<=CM_MAXORDER; i++) {
+		cm_freelists[i] = CM_NONE;
+	}
+	for (pn = 0; pn < cm_npages; pn++) {
+		coremap[pn].cme_state = CME_FIXED;
+		coremap[pn].cme_order = CM_NOTHEAD;
+		coremap[pn].cme_flags = 0;
+		coremap[pn].cme_npages = 0;
+		coremap[pn].cme_next = coremap[pn].cme_prev = CM_NONE;
+		coremap[pn].cme_as = NULL;
+		coremap[pn].cme_vaddr = 0;
+	}
+	for (pn = firstfree; pn < cm_npages; pn++) {
+		coremap[pn].cme_state = CME_FREE;
+		buddy_free(pn, 0);
+	}
+
+	cm_nfixed = firstfree;
+	cm_nfree = cm_npages - firstfree;
+	cm_nkernel = cm_nuser = 0;
+
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %uk managed, %uk reserved\n",
+		cm_nfree * PAGE_SIZE / 1024, cm_nfixed * PAGE_SIZE / 1024);
+}
+
+/*
+ * Allocate NPAGES physically contiguous pages, for the kernel or for
+ * user address spaces according to HOW (COREMAP_KERNEL/COREMAP_USER).
+ * Returns the physical address, or 0 if there isn't enough memory.
+ */
+paddr_t
+coremap_alloc(unsigned long npages, int how)
+{
+	unsigned order;
+	uint32_t pn, i;
+	paddr_t pa;
+
+	KASSERT(npages > 0);
+	KASSERT(how == COREMAP_KERNEL || how == COREMAP_USER);
+
+	spinlock_acquire(&coremap_lock);
+
+	if (coremap == NULL) {
+		/* Too early; nothing to keep track of it with. */
+		pa = ram_stealmem(npages);
+		spinlock_release(&coremap_lock);
+		return pa;
+	}
+
+	for (order = 0; (1UL << order) < npages; order++) {
+		if (order == CM_MAXORDER) {
+			spinlock_release(&coremap_lock);
+			return 0;
+		}
+	}
+
+	pn = buddy_alloc(order);
+	if (pn == CM_NONE) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+
+	for (i = 0; i < npages; i++) {
+		coremap[pn+i].cme_state =
+			how == COREMAP_KERNEL ? CME_KERNEL : CME_USER;
+		coremap[pn+i].cme_order = CM_NOTHEAD;
+		coremap[pn+i].cme_flags =
+			how == COREMAP_KERNEL ? 0 : CMF_BUSY;
+	}
+	coremap[pn].cme_npages = npages;
+
+	/* Give back whatever we don't need off the end of the block. */
+	for (i = npages; i < (1U << order); i++) {
+		coremap[pn+i].cme_state = CME_FREE;
+		buddy_free(pn+i, 0);
+	}
+
+	cm_nfree -= npages;
+	if (how == COREMAP_KERNEL) {
+		cm_nkernel += npages;
+	}
+	else {
+		cm_nuser += npages;
+	}
+
+	spinlock_release(&coremap_lock);
+
+	return (paddr_t)pn * PAGE_SIZE;
+}
+
+/*
+ * Free the pages allocated by the coremap_alloc call that returned PA.
+ */
+void
+coremap_free(paddr_t pa)
+{
+	uint32_t pn, npages, i;
+	bool kernel;
+
+	KASSERT(pa % PAGE_SIZE == 0);
+
+	spinlock_acquire(&coremap_lock);
+
+	pn = pa / PAGE_SIZE;
+	if (coremap == NULL) {
+		/* Allocated before bootstrap; we can't get it back. */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	KASSERT(pn < cm_npages);
+	if (coremap[pn].cme_state == CME_FIXED) {
+		/* Likewise. */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	KASSERT(coremap[pn].cme_state == CME_KERNEL ||
+		coremap[pn].cme_state == CME_USER);
+	npages = coremap[pn].cme_npages;
+	if (npages == 0) {
+		panic("coremap_free: 0x%x is not the start of a block\n", pa);
+	}
+	kernel = coremap[pn].cme_state == CME_KERNEL;
+
+	for (i = 0; i < npages; i++) {
+		KASSERT(coremap[pn+i].cme_state ==
+			(kernel ? CME_KERNEL : CME_USER));
+		coremap[pn+i].cme_state = CME_FREE;
+		coremap[pn+i].cme_npages = 0;
+		coremap[pn+i].cme_flags = 0;
+		coremap[pn+i].cme_as = NULL;
+		coremap[pn+i].cme_vaddr = 0;
+		buddy_free(pn+i, 0);
+	}
+
+	cm_nfree += npages;
+	if (kernel) {
+		cm_nkernel -= npages;
+	}
+	else {
+		cm_nuser -= npages;
+	}
+
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Record that the user page PA is mapped at VADDR in AS, and let it
+ * be paged out from now on.
+ */
+void
+coremap_setowner(paddr_t pa, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *cme;
+
+	spinlock_acquire(&coremap_lock);
+	cme = &coremap[pa / PAGE_SIZE];
+	KASSERT(cme->cme_state == CME_USER);
+	KASSERT(cme->cme_flags & CMF_BUSY);
+	cme->cme_as = as;
+	cme->cme_vaddr = vaddr;
+	cme->cme_flags = CMF_REF;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Note that the user page PA has been used.
+ */
+void
+coremap_touch(paddr_t pa)
+{
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pa / PAGE_SIZE].cme_state == CME_USER);
+	coremap[pa / PAGE_SIZE].cme_flags |= CMF_REF;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Clear CMF_BUSY on a page picked by coremap_pickvictim that didn't
+ * get paged out after all.
+ */
+void
+coremap_unbusy(paddr_t pa)
+{
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[pa / PAGE_SIZE].cme_flags & CMF_BUSY);
+	coremap[pa / PAGE_SIZE].cme_flags &= ~CMF_BUSY;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_nfree(void)
+{
+	return cm_nfree;
+}
+
+#if !OPT_DUMBVM
+/*
+ * Choose a user page to page out, by the clock algorithm: sweep
+ * around the coremap; a page whose reference bit is set loses it
+ * and is passed over once (its local TLB entry is dropped too, so
+ * the next use faults and sets the bit again), and the first page
+ * found without it is the victim.
+ *
+ * The victim's address space must be locked for it to be paged out.
+ * Pages of address spaces the caller has locked already are fair
+ * game; otherwise we only try the lock (lock_tryacquire), since we
+ * can't sleep here, and skip the page if somebody else has it. *LOCKED is set if we
+ * took the lock, in which case the caller must release it.
+ *
+ * The victim is marked busy; the caller must free it or call
+ * coremap_unbusy. Returns 0 if no page could be found.
+ */
+paddr_t
+coremap_pickvictim(struct addrspace **asret, vaddr_t *vaddrret, bool *locked)
+{
+	struct coremap_entry *cme;
+	struct addrspace *as;
+	unsigned i;
+
+	if (coremap == NULL) {
+		return 0;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	for (i = 0; i < 2 * cm_npages; i++) {
+		cm_clockhand = (cm_clockhand + 1) % cm_npages;
+		cme = &coremap[cm_clockhand];
+		if (cme->cme_state != CME_USER ||
+		    (cme->cme_flags & CMF_BUSY) != 0) {
+			continue;
+		}
+		as = cme->cme_as;
+		KASSERT(as != NULL);
+		if (cme->cme_flags & CMF_REF) {
+			cme->cme_flags &= ~CMF_REF;
+			vm_tlb_invalidate(as, cme->cme_vaddr);
+			continue;
+		}
+		if (lock_do_i_hold(&as->as_lock)) {
+			*locked = false;
+		}
+		else if (lock_tryacquire(&as->as_lock)) {
+			*locked = true;
+		}
+		else {
+			continue;
+		}
+		cme->cme_flags |= CMF_BUSY;
+		*asret = as;
+		*vaddrret = cme->cme_vaddr;
+		spinlock_release(&coremap_lock);
+		return (paddr_t)cm_clockhand * PAGE_SIZE;
+	}
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+#endif
+
+void
+coremap_printstats(void)
+{
+	unsigned order, nblocks[CM_MAXORDER+1];
+	unsigned nfixed, nfree, nkernel, nuser;
+	uint32_t pn;
+
+	if (coremap == NULL) {
+		kprintf("coremap: not initialized yet\n");
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	nfixed = cm_nfixed;
+	nfree = cm_nfree;
+	nkernel = cm_nkernel;
+	nuser = cm_nuser;
+	for (order = 0; order <= CM_MAXORDER; order++) {
+		nblocks[order] = 0;
+		for (pn = cm_freelists[order]; pn != CM_NONE;
+		     pn = coremap[pn].cme_next) {
+			nblocks[order]++;
+		}
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("Physical memory: %u pages of %u bytes\n",
+		cm_npages, PAGE_SIZE);
+	kprintf("   free:     %6u pages (%uk)\n", nfree,
+		nfree * PAGE_SIZE / 1024);
+	kprintf("   kernel:   %6u pages (%uk)\n", nkernel,
+		nkernel * PAGE_SIZE / 1024);
+	kprintf("   user:     %6u pages (%uk)\n", nuser,
+		nuser * PAGE_SIZE / 1024);
+	kprintf("   reserved: %6u pages (%uk)\n", nfixed,
+		nfixed * PAGE_SIZE / 1024);
+	kprintf("Free blocks by size:");
+	for (order = 0; order <= CM_MAXORDER; order++) {
+		if (nblocks[order] > 0) {
+			kprintf(" %uk:%u", (PAGE_SIZE << order) / 1024,
+				nblocks[order]);
+		}
+	}
+	kprintf("\n");
+}
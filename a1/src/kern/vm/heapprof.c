@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Kernel heap profiler. See heapprof.h.
+ *
+ * The profiler can't use kmalloc for its own bookkeeping, so it has
+ * fixed-size tables: one record for each live allocation, found by
+ * hashing the pointer, and one entry for each call site. If either
+ * table fills up, further allocations are counted but not tracked.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <clock.h>
+#include <heapprof.h>
+
+#define HP_MAXLIVE	2048	/* live allocations tracked */
+#define HP_NBUCKETS	512	/* hash buckets; power of 2 */
+#define HP_MAXSITES	256	/* call sites tracked */
+#define HP_TOPSITES	20	/* call sites shown by printstats */
+
+/* Size classes: the kmalloc subpage sizes, then whole pages. */
+#define HP_NCLASSES	9
+#define HP_PAGECLASS	(HP_NCLASSES - 1)
+#define HP_NONE		0xffff
+
+struct hp_site {
+	const void *hs_caller;		/* return address in caller */
+	unsigned hs_nlive;		/* live allocations */
+	size_t hs_bytes;		/* bytes requested, live */
+	unsigned hs_nallocs;		/* total allocations */
+};
+
+struct hp_record {
+	void *hr_ptr;			/* the allocation */
+	uint32_t hr_reqsize;		/* size asked for */
+	uint32_t hr_blksize;		/* size actually used */
+	uint16_t hr_site;		/* index into hp_sites */
+	uint16_t hr_next;		/* hash chain or free list */
+};
+
+static struct hp_record hp_records[HP_MAXLIVE];
+static uint16_t hp_buckets[HP_NBUCKETS];
+static uint16_t hp_freerecs;
+static struct hp_site hp_sites[HP_MAXSITES];
+static unsigned hp_nsites;
+static bool hp_initialized;
+
+/* Per size class: live requested and allocated bytes. */
+static size_t hp_classreq[HP_NCLASSES];
+static size_t hp_classblk[HP_NCLASSES];
+
+/* Totals. */
+static size_t hp_inuse;			/* live block bytes */
+static size_t hp_maxinuse;		/* high-water mark of hp_inuse */
+static unsigned hp_nallocs, hp_nfrees;
+static unsigned hp_untracked;		/* allocations we had no room for */
+static uint64_t hp_allocbytes;		/* total bytes ever requested */
+
+/* For the rate since the last report. */
+static unsigned hp_lastticks, hp_lastallocs;
+
+static struct spinlock hp_lock = SPINLOCK_INITIALIZER;
+
+static
+void
+hp_init(void)
+{
+	unsigned i;
+
+	for (i=0; i<HP_NBUCKETS; i++) {
+		hp_buckets[i] = HP_NONE;
+	}
+	for (i=0; i<HP_MAXLIVE; i++) {
+		hp_records[i].hr_next = (i+1 < HP_MAXLIVE) ? i+1 : HP_NONE;
+	}
+	hp_freerecs = 0;
+	hp_initialized = true;
+}
+
+static
+unsigned
+hp_hash(void *ptr)
+{
+	uint32_t x = (uint32_t)(uintptr_t)ptr;
+
+	/* Blocks are at least 16 bytes apart; drop the low bits. */
+	x >>= 4;
+	x ^= x >> 9;
+	return x & (HP_NBUCKETS - 1);
+}
+
+static
+unsigned
+hp_class(size_t blksize)
+{
+	unsigned c;
+	size_t sz;
+
+	for (c = 0, sz = 16; c < HP_PAGECLASS; c++, sz <<= 1) {
+		if (blksize <= sz) {
+			return c;
+		}
+	}
+	return HP_PAGECLASS;
+}
+
+/*
+ * Find (or add) the site entry for CALLER. Returns HP_NONE if the
+ * table is full.
+ */
+static
+unsigned
+hp_site(const void *caller)
+{
+	unsigned i;
+
+	for (i=0; i<hp_nsites; i++) {
+		if (hp_sites[i].hs_caller == caller) {
+			return i;
+		}
+	}
+	if (hp_nsites == HP_MAXSITES) {
+		return HP_NONE;
+	}
+	hp_sites[i].hs_caller = caller;
+	hp_sites[i].hs_nlive = 0;
+	hp_sites[i].hs_bytes = 0;
+	hp_sites[i].hs_nallocs = 0;
+	hp_nsites++;
+	return i;
+}
+
+void
+heapprof_alloc(void *ptr, size_t reqsize, size_t blksize,
+	       const void *caller)
+{
+	struct hp_record *hr;
+	unsigned site, rec, bucket, class;
+
+	spinlock_acquire(&hp_lock);
+	if (!hp_initialized) {
+		hp_init();
+	}
+
+	hp_nallocs++;
+	hp_allocbytes += reqsize;
+
+	site = hp_site(caller);
+	if (site == HP_NONE || hp_freerecs == HP_NONE) {
+		hp_untracked++;
+		spinlock_release(&hp_lock);
+		return;
+	}
+
+	rec = hp_freerecs;
+	hr = &hp_records[rec];
+	hp_freerecs = hr->hr_next;
+
+	hr->hr_ptr = ptr;
+	hr->hr_reqsize = reqsize;
+	hr->hr_blksize = blksize;
+	hr->hr_site = site;
+	bucket = hp_hash(ptr);
+	hr->hr_next = hp_buckets[bucket];
+	hp_buckets[bucket] = rec;
+
+	hp_sites[site].hs_nlive++;
+	hp_sites[site].hs_bytes += reqsize;
+	hp_sites[site].hs_nallocs++;
+
+	class = hp_class(blksize);
+	hp_classreq[class] += reqsize;
+	hp_classblk[class] += blksize;
+
+	hp_inuse += blksize;
+	if (hp_inuse > hp_maxinuse) {
+		hp_maxinuse = hp_inuse;
+	}
+
+	spinlock_release(&hp_lock);
+}
+
+void
+heapprof_free(void *ptr)
+{
+	struct hp_record *hr;
+	struct hp_site *hs;
+	uint16_t *recp;
+	unsigned class;
+
+	spinlock_acquire(&hp_lock);
+	if (!hp_initialized) {
+		spinlock_release(&hp_lock);
+		return;
+	}
+
+	hp_nfrees++;
+
+	for (recp = &hp_buckets[hp_hash(ptr)]; *recp != HP_NONE;
+	     recp = &hp_records[*recp].hr_next) {
+		if (hp_records[*recp].hr_ptr == ptr) {
+			break;
+		}
+	}
+	if (*recp == HP_NONE) {
+		/* An untracked allocation. */
+		spinlock_release(&hp_lock);
+		return;
+	}
+
+	hr = &hp_records[*recp];
+	hs = &hp_sites[hr->hr_site];
+	KASSERT(hs->hs_nlive > 0);
+	hs->hs_nlive--;
+	hs->hs_bytes -= hr->hr_reqsize;
+
+	class = hp_class(hr->hr_blksize);
+	hp_classreq[class] -= hr->hr_reqsize;
+	hp_classblk[class] -= hr->hr_blksize;
+	hp_inuse -= hr->hr_blksize;
+
+	/* Unhash and put on the free list. */
+	{
+		uint16_t rec = *recp;
+
+		*recp = hr->hr_next;
+		hr->hr_next = hp_freerecs;
+		hp_freerecs = rec;
+	}
+
+	spinlock_release(&hp_lock);
+}
+
+void
+heapprof_printstats(void)
+{
+	static const char *classnames[HP_NCLASSES] = {
+		"16", "32", "64", "128", "256", "512", "1024", "2048", "pages",
+	};
+	unsigned top[HP_TOPSITES];
+	unsigned ntop, i, j, k, now, dt, rate;
+	size_t blk, frag;
+
+	spinlock_acquire(&hp_lock);
+	if (!hp_initialized) {
+		hp_init();
+	}
+
+	/* Pick out the sites with the most bytes in use. */
+	ntop = 0;
+	for (i=0; i<hp_nsites; i++) {
+		if (hp_sites[i].hs_nlive == 0) {
+			continue;
+		}
+		for (j=0; j<ntop; j++) {
+			if (hp_sites[i].hs_bytes > hp_sites[top[j]].hs_bytes) {
+				break;
+			}
+		}
+		if (j == HP_TOPSITES) {
+			continue;
+		}
+		if (ntop < HP_TOPSITES) {
+			ntop++;
+		}
+		for (k = ntop-1; k > j; k--) {
+			top[k] = top[k-1];
+		}
+		top[j] = i;
+	}
+
+	kprintf("Heap profile: %lu bytes in use, high-water %lu bytes\n",
+		(unsigned long)hp_inuse, (unsigned long)hp_maxinuse);
+	kprintf("%u allocations, %u frees, %u untracked, "
+		"%llu bytes requested\n",
+		hp_nallocs, hp_nfrees, hp_untracked,
+		(unsigned long long)hp_allocbytes);
+
+	now = callout_ticks();
+	dt = now - hp_lastticks;
+	rate = dt == 0 ? 0 : (hp_nallocs - hp_lastallocs) * HZ / dt;
+	kprintf("Allocation rate: %u/sec since %s\n", rate,
+		hp_lastticks == 0 ? "boot" : "last report");
+	hp_lastticks = now;
+	hp_lastallocs = hp_nallocs;
+
+	kprintf("\nTop call sites by live bytes:\n");
+	kprintf("   %-10s %8s %6s %8s\n", "caller", "bytes", "live",
+		"allocs");
+	for (i=0; i<ntop; i++) {
+		struct hp_site *hs = &hp_sites[top[i]];
+
+		kprintf("   %p %8lu %6u %8u\n", hs->hs_caller,
+			(unsigned long)hs->hs_bytes, hs->hs_nlive,
+			hs->hs_nallocs);
+	}
+
+	kprintf("\nInternal fragmentation by size class:\n");
+	kprintf("   %-6s %10s %10s %5s\n", "class", "requested", "used",
+		"waste");
+	for (i=0; i<HP_NCLASSES; i++) {
+		blk = hp_classblk[i];
+		if (blk == 0) {
+			continue;
+		}
+		frag = blk - hp_classreq[i];
+		kprintf("   %-6s %10lu %10lu %4lu%%\n", classnames[i],
+			(unsigned long)hp_classreq[i], (unsigned long)blk,
+			(unsigned long)(frag * 100 / blk));
+	}
+
+	spinlock_release(&hp_lock);
+}
@@ -28,14 +28,24 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
+#include <counter.h>
+#include <mainbus.h>
 #include <vm.h>
+#include <heapprof.h>
 
 /*
  * Kernel malloc.
  */
 
+static struct counter kmalloc_count = COUNTER_INITIALIZER("kmalloc");
+static struct counter kfree_count = COUNTER_INITIALIZER("kfree");
+
 
 static
 void
@@ -118,51 +128,116 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
+ * Use one spinlock for the shared pages. Most allocations and frees
+ * are instead satisfied from per-cpu magazines (see below), which
+ * take it only once per batch of blocks.
+ */
+
+static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////
+
+/*
+ * Pagerefs live in page-sized chunks, allocated as the heap grows.
+ * Each chunk has a bitmap of which of its pagerefs are in use, so a
+ * free one can be found a word at a time, and a count of free ones.
+ * Chunks with free pagerefs are kept on a list so that allocation
+ * doesn't have to look at full ones; since chunks are whole pages,
+ * the chunk a pageref belongs to is found by masking its address.
  *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Chunks are never given back. The number of pagerefs needed tracks
+ * the peak size of the heap and is small next to the heap itself
+ * (one chunk manages about 1M).
  */
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+#define PRC_INUSE_WORDS (PAGE_SIZE / sizeof(struct pageref) / 32)
+#define PRC_NREFS ((PAGE_SIZE - sizeof(void *) - sizeof(unsigned) \
+		    - PRC_INUSE_WORDS * sizeof(uint32_t)) \
+		   / sizeof(struct pageref))
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+struct pagerefchunk {
+	struct pagerefchunk *prc_nextfree;	/* next chunk with space */
+	unsigned prc_nfree;			/* free pagerefs here */
+	uint32_t prc_inuse[PRC_INUSE_WORDS];	/* bitmap of used ones */
+	struct pageref prc_refs[PRC_NREFS];
+};
+
+static struct pagerefchunk *pagerefchunks_free;
+static unsigned npagerefs;		/* total over all chunks */
+
+/*
+ * For finding the lowest set bit in a word without a loop: isolate
+ * it, multiply by a de Bruijn sequence, and look up the top 5 bits.
+ */
+static const uint8_t debruijn32[32] = {
+	0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+	31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9,
+};
+
+/*
+ * Add the page at PAGE as a new chunk of pagerefs.
+ */
+static
+void
+addpagerefchunk(vaddr_t page)
+{
+	struct pagerefchunk *prc;
+	unsigned i;
+
+	KASSERT(sizeof(struct pagerefchunk) <= PAGE_SIZE);
+	KASSERT(page % PAGE_SIZE == 0);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prc = (struct pagerefchunk *)page;
+	prc->prc_nfree = PRC_NREFS;
+	for (i=0; i<PRC_INUSE_WORDS; i++) {
+		prc->prc_inuse[i] = 0;
+	}
+	/* Mark the bits past the end of prc_refs[] as permanently used. */
+	for (i=PRC_NREFS; i<PRC_INUSE_WORDS*32; i++) {
+		prc->prc_inuse[i/32] |= ((uint32_t)1) << (i%32);
+	}
+
+	prc->prc_nextfree = pagerefchunks_free;
+	pagerefchunks_free = prc;
+	npagerefs += PRC_NREFS;
+}
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pagerefchunk *prc;
+	unsigned i;
+	uint32_t word, bit;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prc = pagerefchunks_free;
+	if (prc == NULL) {
+		/* ran out */
+		return NULL;
+	}
+	KASSERT(prc->prc_nfree > 0);
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
+	for (i=0; i<PRC_INUSE_WORDS; i++) {
+		word = prc->prc_inuse[i];
+		if (word == 0xffffffff) {
 			/* full */
 			continue;
 		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
+		bit = ~word & (word + 1);
+		prc->prc_inuse[i] = word | bit;
+
+		prc->prc_nfree--;
+		if (prc->prc_nfree == 0) {
+			pagerefchunks_free = prc->prc_nextfree;
+			prc->prc_nextfree = NULL;
 		}
-		KASSERT(0);
+		return &prc->prc_refs[i*32 + debruijn32[(bit*0x077cb531U)>>27]];
 	}
 
-	/* ran out */
+	panic("kmalloc: pageref chunk %p has no free entries\n", prc);
 	return NULL;
 }
 
@@ -170,15 +245,26 @@ static
 void
 freepageref(struct pageref *p)
 {
+	struct pagerefchunk *prc;
 	size_t i, j;
 	uint32_t k;
 
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prc = (struct pagerefchunk *)((vaddr_t)p & PAGE_FRAME);
+	j = p - prc->prc_refs;
+	KASSERT(j < PRC_NREFS);  /* note: j is unsigned, don't test < 0 */
 	i = j/32;
 	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT((prc->prc_inuse[i] & k) != 0);
+	prc->prc_inuse[i] &= ~k;
+
+	if (prc->prc_nfree == 0) {
+		/* Was full; it has space again. */
+		prc->prc_nextfree = pagerefchunks_free;
+		pagerefchunks_free = prc;
+	}
+	prc->prc_nfree++;
 }
 
 ////////////////////////////////////////
@@ -186,16 +272,47 @@ freepageref(struct pageref *p)
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+/*
+ * Reverse map from physical page number to the pageref for that page
+ * (NULL if the page isn't one of ours), so that kfree can find the
+ * page a block lives on in constant time.
+ *
+ * There is one entry per page of RAM. The map is allocated the first
+ * time the subpage allocator needs a page. Entries only change with
+ * kmalloc_spinlock held, but may be read without it: the entry for a
+ * page can't change while any block on it is allocated.
+ */
+static struct pageref **pagerefmap;
+static unsigned pagerefmap_entries;
+
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Per-cpu magazine of free blocks of one size; each cpu has NSIZES of
+ * these, hung off c_kmag.
  */
+#define MAG_MAXCAP 32
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+struct kmalloc_magazine {
+	struct freelist *km_head;	// stack of free blocks
+	unsigned km_count;		// number of blocks on km_head
+};
+
+static
+unsigned
+mag_capacity(unsigned blktype)
+{
+	unsigned cap;
+
+	cap = PAGE_SIZE / 4 / sizes[blktype];
+	if (cap < 2) {
+		cap = 2;
+	}
+	if (cap > MAG_MAXCAP) {
+		cap = MAG_MAXCAP;
+	}
+	return cap;
+}
 
 ////////////////////////////////////////
 
@@ -260,14 +377,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefs);
 		ac++;
 	}
 
@@ -330,6 +447,34 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+static
+void
+kmalloc_printmagazines(void)
+{
+	struct kmalloc_magazine *mags;
+	struct cpu *c;
+	unsigned i, j;
+
+	/*
+	 * This peeks at the other cpus' magazines without any
+	 * interlock, so the numbers are only a snapshot.
+	 */
+	for (i=0; i<cpu_count(); i++) {
+		c = cpu_get(i);
+		mags = c->c_kmag;
+		kprintf("   cpu%u:", i);
+		if (mags == NULL) {
+			kprintf(" (none)\n");
+			continue;
+		}
+		for (j=0; j<NSIZES; j++) {
+			kprintf(" %lu:%u/%u", (unsigned long)sizes[j],
+				mags[j].km_count, mag_capacity(j));
+		}
+		kprintf("\n");
+	}
+}
+
 void
 kheap_printstats(void)
 {
@@ -345,6 +490,9 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kprintf("Per-cpu magazines:\n");
+	kmalloc_printmagazines();
 }
 
 ////////////////////////////////////////
@@ -392,26 +540,104 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Allocate the page-to-pageref map, if it isn't there yet.
+ */
+static
+int
+pagerefmap_setup(void)
+{
+	unsigned entries, npages;
+	vaddr_t map;
+
+	if (pagerefmap != NULL) {
+		return 0;
+	}
+
+	entries = mainbus_ramsize() / PAGE_SIZE;
+	npages = DIVROUNDUP(entries * sizeof(struct pageref *), PAGE_SIZE);
+	map = alloc_kpages(npages);
+	if (map == 0) {
+		return ENOMEM;
+	}
+	bzero((void *)map, npages * PAGE_SIZE);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	if (pagerefmap == NULL) {
+		/* Set the size first; readers check pagerefmap. */
+		pagerefmap_entries = entries;
+		pagerefmap = (struct pageref **)map;
+		map = 0;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	if (map != 0) {
+		/* Someone else got there first. */
+		free_kpages(map);
+	}
+	return 0;
+}
+
+/*
+ * Return the map entry for the page containing ADDR, or NULL if
+ * ADDR can't be on a subpage allocator page.
+ */
+static
+struct pageref **
+pagerefmap_slot(vaddr_t addr)
+{
+	unsigned index;
+
+	if (pagerefmap == NULL || addr < MIPS_KSEG0 || addr >= MIPS_KSEG1) {
+		return NULL;
+	}
+	index = (addr - MIPS_KSEG0) / PAGE_SIZE;
+	if (index >= pagerefmap_entries) {
+		return NULL;
+	}
+	return &pagerefmap[index];
+}
+
+/*
+ * Find the pageref for the page containing PTRADDR, or NULL if it
+ * isn't one of ours. Does not need kmalloc_spinlock if PTRADDR is an
+ * allocated block; see above.
+ */
+static
+struct pageref *
+findpageref(vaddr_t ptraddr)
+{
+	struct pageref **slot;
+	struct pageref *pr;
+
+	slot = pagerefmap_slot(ptraddr);
+	if (slot == NULL) {
+		return NULL;
+	}
+	pr = *slot;
+	if (pr != NULL) {
+		/* check for corruption */
+		KASSERT(PR_PAGEADDR(pr) == (ptraddr & PAGE_FRAME));
+		KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+	}
+	return pr;
+}
+
+/*
+ * Take one block off the first page of type BLKTYPE that has any
+ * free. Returns NULL if none does. Must hold kmalloc_spinlock.
+ */
 static
 void *
-subpage_kmalloc(size_t sz)
+subpage_getblock(unsigned blktype)
 {
-	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
-	struct freelist *volatile fl;	// free list entry
+	struct freelist *fl;	// free list entry
 	void *retptr;		// our result
 
-	volatile int i;
-
-
-	blktype = blocktype(sz);
-	sz = sizes[blktype];
-
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
 	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
 
@@ -420,9 +646,6 @@ subpage_kmalloc(size_t sz)
 		checksubpage(pr);
 
 		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
 			KASSERT(pr->freelist_offset < PAGE_SIZE);
 			prpage = PR_PAGEADDR(pr);
 			fla = prpage + pr->freelist_offset;
@@ -442,13 +665,84 @@ subpage_kmalloc(size_t sz)
 				KASSERT(pr->nfree == 0);
 				pr->freelist_offset = INVALID_OFFSET;
 			}
-
-			checksubpages();
-
-			spinlock_release(&kmalloc_spinlock);
 			return retptr;
 		}
 	}
+	return NULL;
+}
+
+/*
+ * Put the block at PTRADDR back on the free list of its page PR.
+ * Returns true if this made the whole page free; in that case the
+ * page has been taken off the lists and the caller should hand it
+ * to free_kpages once kmalloc_spinlock is released.
+ */
+static
+bool
+subpage_putblock(struct pageref *pr, vaddr_t ptraddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - prpage;
+
+	/*
+	 * We probably ought to check for free twice by seeing if the block
+	 * is already on the free list. But that's expensive, so we don't.
+	 */
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
+		/* Whole page is free. */
+		*pagerefmap_slot(prpage) = NULL;
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		return true;
+	}
+	return false;
+}
+
+static
+void *
+subpage_kmalloc(unsigned blktype)
+{
+	struct pageref *pr;	// pageref for new page
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t prcpage;	// new page of pagerefs, if needed
+	vaddr_t fla;		// free list entry address
+	struct freelist *volatile fl;	// free list entry
+	void *retptr;		// our result
+
+	volatile int i;
+
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	retptr = subpage_getblock(blktype);
+	if (retptr != NULL) {
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+		return retptr;
+	}
 
 	/*
 	 * No page of the right size available.
@@ -460,6 +754,10 @@ subpage_kmalloc(size_t sz)
 	 */
 
 	spinlock_release(&kmalloc_spinlock);
+	if (pagerefmap_setup()) {
+		kprintf("kmalloc: Subpage allocator couldn't get page map\n");
+		return NULL;
+	}
 	prpage = alloc_kpages(1);
 	if (prpage==0) {
 		/* Out of memory. */
@@ -470,11 +768,22 @@ subpage_kmalloc(size_t sz)
 
 	pr = allocpageref();
 	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+		/*
+		 * Out of pagerefs; get another page of them. As above,
+		 * don't call alloc_kpages with the spinlock held.
+		 */
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		prcpage = alloc_kpages(1);
+		if (prcpage==0) {
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get "
+				"pageref\n");
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		addpagerefchunk(prcpage);
+		pr = allocpageref();
+		KASSERT(pr != NULL);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -504,10 +813,22 @@ subpage_kmalloc(size_t sz)
 	pr->next_all = allbase;
 	allbase = pr;
 
-	/* This is kind of cheesy, but avoids duplicating the alloc code. */
-	goto doalloc;
+	KASSERT(pagerefmap_slot(prpage) != NULL);
+	KASSERT(*pagerefmap_slot(prpage) == NULL);
+	*pagerefmap_slot(prpage) = pr;
+
+	/* The new page is now first on the list, so this can't fail. */
+	retptr = subpage_getblock(blktype);
+	KASSERT(retptr != NULL);
+
+	checksubpages();
+
+	spinlock_release(&kmalloc_spinlock);
+	return retptr;
 }
 
+static bool mag_free(unsigned blktype, void *ptr);
+
 static
 int
 subpage_kfree(void *ptr)
@@ -516,35 +837,24 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
+	bool pagefree;		// true if the page is now all free
 
 	ptraddr = (vaddr_t)ptr;
 
-	spinlock_acquire(&kmalloc_spinlock);
-
-	checksubpages();
-
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	/*
+	 * The block is allocated, so its page can't go away, and the
+	 * page's map entry, address and block type can all be read
+	 * without the lock.
+	 */
+	pr = findpageref(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -558,33 +868,18 @@ subpage_kfree(void *ptr)
 	 */
 	fill_deadbeef(ptr, sizes[blktype]);
 
-	/*
-	 * We probably ought to check for free twice by seeing if the block
-	 * is already on the free list. But that's expensive, so we don't.
-	 */
-
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	if (mag_free(blktype, ptr)) {
+		return 0;
 	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
 
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	spinlock_acquire(&kmalloc_spinlock);
+	pagefree = subpage_putblock(pr, ptraddr);
+	spinlock_release(&kmalloc_spinlock);
+
+	if (pagefree) {
 		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
-	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -595,12 +890,178 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+//    Each cpu keeps, for each block size, a small stack of free
+//    blocks (a "magazine") that it can hand out and take back
+//    without touching kmalloc_spinlock. Blocks in a magazine are
+//    still counted as allocated by their page, so the page stays
+//    put. When a magazine runs dry it is refilled with a batch of
+//    blocks from the shared pages; when it fills up, a batch is
+//    flushed back. Either way the global lock is taken once per
+//    batch rather than once per block.
+//
+//    The magazines are only touched by their own cpu, with
+//    interrupts off so that we can't be preempted (and migrated)
+//    in the middle.
+//
+//    Magazine capacity shrinks with the block size so that a
+//    cpu doesn't sit on much more than a page of any one size.
+//
+
+/*
+ * Get the current cpu's magazines, setting them up the first time.
+ * Returns with interrupts off (at *SPL the previous level), or
+ * returns NULL with interrupts as they were if there aren't any.
+ */
+static
+struct kmalloc_magazine *
+mag_get(int *spl)
+{
+	struct kmalloc_magazine *mags;
+	unsigned i;
+
+	if (!CURCPU_EXISTS()) {
+		/* Too early in boot. */
+		return NULL;
+	}
+
+	*spl = splhigh();
+	if (curcpu->c_kmag != NULL) {
+		return curcpu->c_kmag;
+	}
+	splx(*spl);
+
+	/*
+	 * Allocate with interrupts on; we might be migrated while
+	 * doing so, so check again afterwards.
+	 */
+	mags = subpage_kmalloc(blocktype(NSIZES * sizeof(*mags)));
+	if (mags == NULL) {
+		return NULL;
+	}
+	for (i=0; i<NSIZES; i++) {
+		mags[i].km_head = NULL;
+		mags[i].km_count = 0;
+	}
+
+	*spl = splhigh();
+	if (curcpu->c_kmag == NULL) {
+		curcpu->c_kmag = mags;
+	}
+	else {
+		splx(*spl);
+		subpage_kfree(mags);
+		*spl = splhigh();
+	}
+	return curcpu->c_kmag;
+}
+
+static
+void *
+mag_alloc(unsigned blktype)
+{
+	struct kmalloc_magazine *km;
+	struct freelist *fl;
+	unsigned n;
+	int spl;
+
+	km = mag_get(&spl);
+	if (km == NULL) {
+		return NULL;
+	}
+	km = &km[blktype];
+
+	if (km->km_count == 0) {
+		/* Refill half the magazine from existing pages. */
+		spinlock_acquire(&kmalloc_spinlock);
+		for (n = mag_capacity(blktype) / 2; n > 0; n--) {
+			fl = subpage_getblock(blktype);
+			if (fl == NULL) {
+				break;
+			}
+			fl->next = km->km_head;
+			km->km_head = fl;
+			km->km_count++;
+		}
+		spinlock_release(&kmalloc_spinlock);
+
+		if (km->km_count == 0) {
+			/* Nothing free; caller needs to get a new page. */
+			splx(spl);
+			return NULL;
+		}
+	}
+
+	fl = km->km_head;
+	km->km_head = fl->next;
+	km->km_count--;
+	splx(spl);
+
+	return fl;
+}
+
+static
+bool
+mag_free(unsigned blktype, void *ptr)
+{
+	struct kmalloc_magazine *km;
+	struct freelist *fl;
+	struct pageref *pr;
+	vaddr_t freepages[MAG_MAXCAP/2];
+	unsigned n, nfreepages, i;
+	int spl;
+
+	km = mag_get(&spl);
+	if (km == NULL) {
+		return false;
+	}
+	km = &km[blktype];
+
+	nfreepages = 0;
+	if (km->km_count >= mag_capacity(blktype)) {
+		/* Flush half the magazine back to the pages. */
+		spinlock_acquire(&kmalloc_spinlock);
+		for (n = mag_capacity(blktype) / 2; n > 0; n--) {
+			fl = km->km_head;
+			km->km_head = fl->next;
+			km->km_count--;
+
+			pr = findpageref((vaddr_t)fl);
+			KASSERT(pr != NULL);
+			if (subpage_putblock(pr, (vaddr_t)fl)) {
+				freepages[nfreepages++] = PR_PAGEADDR(pr);
+			}
+		}
+		checksubpages();
+		spinlock_release(&kmalloc_spinlock);
+	}
+
+	fl = ptr;
+	fl->next = km->km_head;
+	km->km_head = fl;
+	km->km_count++;
+	splx(spl);
+
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+	return true;
+}
+
 //
 ////////////////////////////////////////////////////////////
 
 void *
 kmalloc(size_t sz)
 {
+	unsigned blktype;
+	void *ptr;
+
+	COUNTER_INC(&kmalloc_count);
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
@@ -612,23 +1073,50 @@ kmalloc(size_t sz)
 			return NULL;
 		}
 
+#if OPT_HEAPPROF
+		heapprof_alloc((void *)address, sz, npages * PAGE_SIZE,
+			       __builtin_return_address(0));
+#endif
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	blktype = blocktype(sz);
+	ptr = mag_alloc(blktype);
+	if (ptr == NULL) {
+		ptr = subpage_kmalloc(blktype);
+	}
+#if OPT_HEAPPROF
+	if (ptr != NULL) {
+		heapprof_alloc(ptr, sz, sizes[blktype],
+			       __builtin_return_address(0));
+	}
+#endif
+	return ptr;
 }
 
 void
 kfree(void *ptr)
 {
-	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
-	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
-		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+	}
+	COUNTER_INC(&kfree_count);
+#if OPT_HEAPPROF
+	heapprof_free(ptr);
+#endif
+
+	/*
+	 * Fast path for whole-page allocations: a page-aligned block
+	 * that isn't on a subpage page goes straight back.
+	 */
+	if ((vaddr_t)ptr % PAGE_SIZE == 0 &&
+	    findpageref((vaddr_t)ptr) == NULL) {
 		free_kpages((vaddr_t)ptr);
+		return;
+	}
+
+	if (subpage_kfree(ptr)) {
+		panic("kfree: %p is not a kmalloc block\n", ptr);
 	}
 }
 
@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Two-level page tables. See pagetable.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <pagetable.h>
+
+/*
+ * Second-level tables are exactly one page.
+ */
+static
+uint32_t *
+pt_l2create(void)
+{
+	vaddr_t va;
+
+	va = alloc_kpages(1);
+	if (va == 0) {
+		return NULL;
+	}
+	bzero((void *)va, PAGE_SIZE);
+	return (uint32_t *)va;
+}
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_L1SIZE; i++) {
+		pt->pt_l1[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	uint32_t *l2;
+	unsigned i, j;
+
+	for (i=0; i<PT_L1SIZE; i++) {
+		l2 = pt->pt_l1[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_L2SIZE; j++) {
+			if (l2[j] & PTE_SHARED) {
+				continue;
+			}
+			if (l2[j] & PTE_VALID) {
+				coremap_free(l2[j] & PTE_FRAME);
+			}
+			else if (l2[j] & PTE_SWAPPED) {
+				swap_free(PTE_SWAPSLOT(l2[j]));
+			}
+		}
+		free_kpages((vaddr_t)l2);
+	}
+	kfree(pt);
+}
+
+uint32_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	uint32_t *l2;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	l2 = pt->pt_l1[PT_L1INDEX(vaddr)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2 = pt_l2create();
+		if (l2 == NULL) {
+			return NULL;
+		}
+		pt->pt_l1[PT_L1INDEX(vaddr)] = l2;
+	}
+	return &l2[PT_L2INDEX(vaddr)];
+}
@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Object caches. See slab.h for the interface.
+ *
+ * Each slab is one page. The slab's bookkeeping (struct kmem_slab)
+ * sits at the end of the page, so the slab an object belongs to is
+ * found by masking the object's address. The objects start at the
+ * slab's color offset from the beginning of the page.
+ *
+ * The free list of a slab can't be kept in the objects themselves,
+ * because free objects are still constructed. Instead each object
+ * has a link word after it; the object size plus the link, rounded
+ * up to the alignment, is the stride between objects.
+ *
+ * Each cache keeps its slabs on three lists: full, partially used,
+ * and empty. Allocation prefers partial slabs, to keep the number of
+ * slabs with free space down. Empty slabs are kept (still
+ * constructed) up to KMEM_MAXEMPTY per cache; beyond that they are
+ * destroyed and their pages returned.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <slab.h>
+#include <vm.h>
+
+#define KMEM_MAXEMPTY	1		/* empty slabs kept per cache */
+#define KMEM_MINALIGN	8		/* same as kmalloc */
+
+struct kmem_slab {
+	struct kmem_slab *ks_next;	/* list links */
+	struct kmem_slab *ks_prev;
+	struct kmem_cache *ks_cache;	/* cache we belong to */
+	void *ks_freelist;		/* first free object */
+	unsigned ks_inuse;		/* number of allocated objects */
+	unsigned ks_color;		/* offset of first object */
+};
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_size;			/* object size */
+	size_t kc_align;		/* object alignment */
+	size_t kc_linkoff;		/* offset of link word in object */
+	size_t kc_stride;		/* distance between objects */
+	unsigned kc_perslab;		/* objects in each slab */
+	unsigned kc_maxcolor;		/* largest color offset */
+	unsigned kc_nextcolor;		/* color of the next new slab */
+	void (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;	/* protects everything below */
+	struct kmem_slab *kc_full;	/* slabs with no free objects */
+	struct kmem_slab *kc_partial;	/* slabs with some */
+	struct kmem_slab *kc_empty;	/* slabs with all objects free */
+	unsigned kc_nempty;		/* length of kc_empty */
+
+	/* statistics */
+	unsigned kc_nslabs;		/* slabs currently held */
+	unsigned kc_inuse;		/* objects currently allocated */
+	unsigned kc_maxinuse;		/* high-water mark of kc_inuse */
+	unsigned kc_nallocs;		/* total kmem_cache_alloc calls */
+	unsigned kc_nconstructed;	/* total constructor calls */
+
+	struct kmem_cache *kc_next;	/* on allcaches */
+};
+
+/* All caches, for kmem_cache_printstats. */
+static struct kmem_cache *allcaches;
+static struct spinlock allcaches_lock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+// Slabs
+
+#define OBJLINK(kc, obj) (*(void **)((char *)(obj) + (kc)->kc_linkoff))
+
+static
+struct kmem_slab *
+obj_to_slab(void *obj)
+{
+	vaddr_t page;
+
+	page = (vaddr_t)obj & PAGE_FRAME;
+	return (struct kmem_slab *)(page + PAGE_SIZE -
+				    sizeof(struct kmem_slab));
+}
+
+static
+void
+slab_push(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = *list;
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks;
+	}
+	*list = ks;
+}
+
+static
+void
+slab_unlink(struct kmem_slab **list, struct kmem_slab *ks)
+{
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(*list == ks);
+		*list = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+/*
+ * Make a new slab and construct all its objects. Called without the
+ * cache lock, since the constructors might do anything.
+ */
+static
+struct kmem_slab *
+slab_create(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t page;
+	char *obj;
+	unsigned i, color;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	color = kc->kc_nextcolor;
+	kc->kc_nextcolor += kc->kc_align;
+	if (kc->kc_nextcolor > kc->kc_maxcolor) {
+		kc->kc_nextcolor = 0;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	ks = obj_to_slab((void *)page);
+	ks->ks_next = ks->ks_prev = NULL;
+	ks->ks_cache = kc;
+	ks->ks_inuse = 0;
+	ks->ks_color = color;
+	ks->ks_freelist = NULL;
+
+	/* Build the free list backwards so it comes out in order. */
+	for (i = kc->kc_perslab; i-- > 0; ) {
+		obj = (char *)page + color + i * kc->kc_stride;
+		if (kc->kc_ctor != NULL) {
+			kc->kc_ctor(obj);
+		}
+		OBJLINK(kc, obj) = ks->ks_freelist;
+		ks->ks_freelist = obj;
+	}
+	return ks;
+}
+
+/*
+ * Destroy an empty slab that is no longer on any list. Called
+ * without the cache lock.
+ */
+static
+void
+slab_destroy(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	void *obj;
+	vaddr_t page;
+
+	KASSERT(ks->ks_inuse == 0);
+
+	page = (vaddr_t)ks & PAGE_FRAME;
+	if (kc->kc_dtor != NULL) {
+		for (obj = ks->ks_freelist; obj != NULL;
+		     obj = OBJLINK(kc, obj)) {
+			kc->kc_dtor(obj);
+		}
+	}
+	free_kpages(page);
+}
+
+////////////////////////////////////////////////////////////
+// Caches
+
+struct kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct kmem_cache *kc;
+	size_t usable;
+
+	if (align < KMEM_MINALIGN) {
+		align = KMEM_MINALIGN;
+	}
+	KASSERT((align & (align - 1)) == 0);
+	KASSERT(size > 0);
+
+	kc = kmalloc(sizeof(*kc));
+	if (kc == NULL) {
+		return NULL;
+	}
+
+	kc->kc_name = name;
+	kc->kc_size = size;
+	kc->kc_align = align;
+	kc->kc_linkoff = ROUNDUP(size, sizeof(void *));
+	kc->kc_stride = ROUNDUP(kc->kc_linkoff + sizeof(void *), align);
+
+	usable = PAGE_SIZE - sizeof(struct kmem_slab);
+	if (kc->kc_stride > usable) {
+		panic("kmem_cache_create: %s: objects of size %lu "
+		      "are too big\n", name, (unsigned long)size);
+	}
+	kc->kc_perslab = usable / kc->kc_stride;
+
+	/* Leftover space in each slab is used for coloring. */
+	kc->kc_maxcolor = usable - kc->kc_perslab * kc->kc_stride;
+	kc->kc_maxcolor -= kc->kc_maxcolor % align;
+	kc->kc_nextcolor = 0;
+
+	kc->kc_ctor = ctor;
+	kc->kc_dtor = dtor;
+
+	spinlock_init(&kc->kc_lock);
+	kc->kc_full = kc->kc_partial = kc->kc_empty = NULL;
+	kc->kc_nempty = 0;
+
+	kc->kc_nslabs = 0;
+	kc->kc_inuse = 0;
+	kc->kc_maxinuse = 0;
+	kc->kc_nallocs = 0;
+	kc->kc_nconstructed = 0;
+
+	spinlock_acquire(&allcaches_lock);
+	kc->kc_next = allcaches;
+	allcaches = kc;
+	spinlock_release(&allcaches_lock);
+
+	return kc;
+}
+
+void
+kmem_cache_destroy(struct kmem_cache *kc)
+{
+	struct kmem_cache **kcp;
+	struct kmem_slab *ks;
+
+	KASSERT(kc->kc_inuse == 0);
+	KASSERT(kc->kc_full == NULL);
+	KASSERT(kc->kc_partial == NULL);
+
+	spinlock_acquire(&allcaches_lock);
+	for (kcp = &allcaches; *kcp != kc; kcp = &(*kcp)->kc_next) {
+		KASSERT(*kcp != NULL);
+	}
+	*kcp = kc->kc_next;
+	spinlock_release(&allcaches_lock);
+
+	while (kc->kc_empty != NULL) {
+		ks = kc->kc_empty;
+		slab_unlink(&kc->kc_empty, ks);
+		slab_destroy(kc, ks);
+	}
+
+	spinlock_cleanup(&kc->kc_lock);
+	kfree(kc);
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	void *obj;
+
+	spinlock_acquire(&kc->kc_lock);
+
+	while (kc->kc_partial == NULL && kc->kc_empty == NULL) {
+		/* Need a new slab. Construct it without the lock. */
+		spinlock_release(&kc->kc_lock);
+		ks = slab_create(kc);
+		if (ks == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+		slab_push(&kc->kc_empty, ks);
+		kc->kc_nempty++;
+		kc->kc_nslabs++;
+		kc->kc_nconstructed += kc->kc_perslab;
+	}
+
+	if (kc->kc_partial != NULL) {
+		ks = kc->kc_partial;
+	}
+	else {
+		ks = kc->kc_empty;
+		slab_unlink(&kc->kc_empty, ks);
+		kc->kc_nempty--;
+		slab_push(&kc->kc_partial, ks);
+	}
+
+	obj = ks->ks_freelist;
+	KASSERT(obj != NULL);
+	ks->ks_freelist = OBJLINK(kc, obj);
+	ks->ks_inuse++;
+	if (ks->ks_inuse == kc->kc_perslab) {
+		KASSERT(ks->ks_freelist == NULL);
+		slab_unlink(&kc->kc_partial, ks);
+		slab_push(&kc->kc_full, ks);
+	}
+
+	kc->kc_nallocs++;
+	kc->kc_inuse++;
+	if (kc->kc_inuse > kc->kc_maxinuse) {
+		kc->kc_maxinuse = kc->kc_inuse;
+	}
+
+	spinlock_release(&kc->kc_lock);
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks, *victim;
+
+	KASSERT(obj != NULL);
+	ks = obj_to_slab(obj);
+	if (ks->ks_cache != kc) {
+		panic("kmem_cache_free: %p does not belong to cache %s\n",
+		      obj, kc->kc_name);
+	}
+
+	victim = NULL;
+
+	spinlock_acquire(&kc->kc_lock);
+
+	KASSERT(ks->ks_inuse > 0);
+	if (ks->ks_inuse == kc->kc_perslab) {
+		slab_unlink(&kc->kc_full, ks);
+		slab_push(&kc->kc_partial, ks);
+	}
+	OBJLINK(kc, obj) = ks->ks_freelist;
+	ks->ks_freelist = obj;
+	ks->ks_inuse--;
+	kc->kc_inuse--;
+
+	if (ks->ks_inuse == 0) {
+		slab_unlink(&kc->kc_partial, ks);
+		if (kc->kc_nempty < KMEM_MAXEMPTY) {
+			slab_push(&kc->kc_empty, ks);
+			kc->kc_nempty++;
+		}
+		else {
+			victim = ks;
+			kc->kc_nslabs--;
+		}
+	}
+
+	spinlock_release(&kc->kc_lock);
+
+	if (victim != NULL) {
+		slab_destroy(kc, victim);
+	}
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	kprintf("%-16s %5s %5s %4s %5s %6s %6s %8s %8s\n",
+		"cache", "size", "slab", "per", "color", "inuse", "max",
+		"allocs", "ctors");
+
+	spinlock_acquire(&allcaches_lock);
+	for (kc = allcaches; kc != NULL; kc = kc->kc_next) {
+		kprintf("%-16s %5lu %5u %4u %5u %6u %6u %8u %8u\n",
+			kc->kc_name, (unsigned long)kc->kc_size,
+			kc->kc_nslabs, kc->kc_perslab, kc->kc_maxcolor,
+			kc->kc_inuse, kc->kc_maxinuse, kc->kc_nallocs,
+			kc->kc_nconstructed);
+	}
+	spinlock_release(&allcaches_lock);
+}
@@ -0,0 +1,480 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Paging to swap.
+ *
+ * When memory runs low, user pages are written out to the swap disk
+ * (the raw device SWAP_DEVICE) and their page table entries marked
+ * PTE_SWAPPED with the swap slot they went to; as_getpage reads them
+ * back when they are next touched. Pages of read-only regions are
+ * never written: they are simply dropped, since as_getpage can read
+ * them from the program file again.
+ *
+ * Victims are chosen by the clock algorithm in coremap_pickvictim.
+ * They are paged out PAGEOUT_BATCH at a time, into consecutive slots
+ * where possible, so that one disk request covers several pages.
+ *
+ * The pageout thread keeps some memory free in the background: it
+ * is woken when the number of free pages drops below SWAP_LOWAT and
+ * pages out until there are SWAP_HIWAT free. If that doesn't keep
+ * up, page_alloc pages out a batch itself before giving up. Only
+ * when there is nothing left that can be paged out (no swap space,
+ * or every page busy or locked) does page_alloc fail.
+ *
+ * Kernel allocations can't use user pages, but they can make room
+ * by paging some out: when alloc_kpages finds no memory it calls
+ * page_reclaim, which gives back a page from the zero pool if there
+ * is one, and otherwise pages out a batch.
+ *
+ * Only one batch is paged out at a time; pageout_lock serializes the
+ * pageout thread, page_alloc and page_reclaim. The lock also covers
+ * the victim, shootdown and iovec arrays, which are too big to put
+ * on a kernel stack that may already be deep in a page fault. Paging
+ * out can itself allocate kernel memory (in the disk driver), and an
+ * allocation made while holding pageout_lock won't try to page out
+ * again; if it fails, the write fails and the pages stay where they
+ * are.
+ *
+ * If there is no swap disk we carry on without one; read-only pages
+ * can still be dropped.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <thread.h>
+#include <current.h>
+#include <cpu.h>
+#include <counter.h>
+#include <addrspace.h>
+#include <pagetable.h>
+#include <vm.h>
+
+#define SWAP_DEVICE	"lhd1raw:"
+#define PAGEOUT_BATCH	8	/* pages written per disk request */
+#define SWAP_LOWAT	8	/* wake the pageout thread below this */
+#define SWAP_HIWAT	16	/* ...and have it stop above this */
+
+/* Slot numbers have to fit in a page table entry. */
+#define SWAP_MAXSLOTS	(PTE_FRAME >> 12)
+
+static struct vnode *swap_vnode;	/* NULL if no swap */
+static unsigned swap_nslots;
+static struct bitmap *swap_map;		/* which slots are in use */
+static unsigned swap_hint;		/* where to start looking */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+static struct semaphore *pageout_sem;
+static volatile bool pageout_pending;
+
+static struct counter pageout_count = COUNTER_INITIALIZER("pageout");
+static struct counter pagein_count = COUNTER_INITIALIZER("pagein");
+static struct counter discard_count = COUNTER_INITIALIZER("page_discard");
+static struct counter syncout_count = COUNTER_INITIALIZER("pageout_sync");
+static struct counter reclaim_count = COUNTER_INITIALIZER("kpage_reclaim");
+
+/* A page being paged out. */
+struct victim {
+	paddr_t v_pa;
+	struct addrspace *v_as;
+	vaddr_t v_vaddr;
+	uint32_t *v_pte;
+	bool v_locked;		/* we took v_as's lock */
+};
+
+/* State for pageout_batch, protected by pageout_lock. */
+static struct lock *pageout_lock;
+static struct victim pageout_victims[PAGEOUT_BATCH];
+static struct victim *pageout_writes[PAGEOUT_BATCH];
+static struct iovec pageout_iov[PAGEOUT_BATCH];
+static struct tlbshootdown pageout_ts[PAGEOUT_BATCH];
+
+////////////////////////////////////////////////////////////
+// Swap slots
+
+/*
+ * Allocate a run of up to WANT consecutive free slots, looking
+ * onward from where the last run ended. Returns the first slot and
+ * sets *GOT to the length, or returns false if swap is full.
+ */
+static
+bool
+swap_allocrun(unsigned want, unsigned *first, unsigned *got)
+{
+	unsigned i, slot, n;
+
+	spinlock_acquire(&swap_lock);
+	for (i = 0; i < swap_nslots; i++) {
+		slot = (swap_hint + i) % swap_nslots;
+		if (bitmap_isset(swap_map, slot)) {
+			continue;
+		}
+		for (n = 0; n < want && slot + n < swap_nslots; n++) {
+			if (bitmap_isset(swap_map, slot + n)) {
+				break;
+			}
+			bitmap_mark(swap_map, slot + n);
+		}
+		swap_hint = (slot + n) % swap_nslots;
+		spinlock_release(&swap_lock);
+		*first = slot;
+		*got = n;
+		return true;
+	}
+	spinlock_release(&swap_lock);
+	return false;
+}
+
+void
+swap_free(unsigned slot)
+{
+	spinlock_acquire(&swap_lock);
+	KASSERT(slot < swap_nslots);
+	KASSERT(bitmap_isset(swap_map, slot));
+	bitmap_unmark(swap_map, slot);
+	spinlock_release(&swap_lock);
+}
+
+////////////////////////////////////////////////////////////
+// I/O
+
+int
+swap_pagein(unsigned slot, paddr_t pa)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+
+	uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, UIO_READ);
+	result = VOP_READ(swap_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	COUNTER_INC(&pagein_count);
+	return 0;
+}
+
+/*
+ * Write the N pages of W[] to consecutive slots starting at SLOT, in
+ * one request. Uses pageout_iov, so the caller must hold
+ * pageout_lock.
+ */
+static
+int
+swap_writerun(struct victim **w, unsigned n, unsigned slot)
+{
+	struct iovec *iov = pageout_iov;
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	KASSERT(n <= PAGEOUT_BATCH);
+	KASSERT(lock_do_i_hold(pageout_lock));
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_kbase = (void *)PADDR_TO_KVADDR(w[i]->v_pa);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)slot * PAGE_SIZE;
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_WRITE;
+	ku.uio_space = NULL;
+
+	result = VOP_WRITE(swap_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return EIO;
+	}
+	COUNTER_ADD(&pageout_count, n);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Paging out
+
+/*
+ * Page out up to MAX pages. Returns how many pages were freed, which
+ * is 0 if this thread is already paging out further up the stack.
+ */
+static
+unsigned
+pageout_batch(unsigned max)
+{
+	struct victim *v = pageout_victims;
+	struct victim **w = pageout_writes;
+	struct tlbshootdown *ts = pageout_ts;
+	struct vm_region *vr;
+	unsigned i, j, n, nw, slot, got, freed;
+	int result;
+
+	KASSERT(max <= PAGEOUT_BATCH);
+	KASSERT(pageout_lock != NULL);
+
+	if (lock_do_i_hold(pageout_lock)) {
+		/* Allocating on behalf of a pageout; don't recurse. */
+		return 0;
+	}
+	lock_acquire(pageout_lock);
+
+	/* Pick the victims... */
+	for (n = 0; n < max; n++) {
+		v[n].v_pa = coremap_pickvictim(&v[n].v_as, &v[n].v_vaddr,
+					       &v[n].v_locked);
+		if (v[n].v_pa == 0) {
+			break;
+		}
+		v[n].v_pte = pt_lookup(v[n].v_as->as_pt, v[n].v_vaddr, false);
+		KASSERT(v[n].v_pte != NULL);
+		KASSERT((*v[n].v_pte & PTE_VALID) != 0);
+		KASSERT((*v[n].v_pte & PTE_FRAME) == v[n].v_pa);
+		ts[n].ts_as = v[n].v_as;
+		ts[n].ts_vaddr = v[n].v_vaddr;
+	}
+
+	/* ...and take them out of the TLBs, all at once. */
+	if (n > 0) {
+		vm_tlb_shootdown_many(ts, n);
+	}
+
+	/* Drop the read-only ones; queue the rest for writing. */
+	freed = 0;
+	nw = 0;
+	for (i = 0; i < n; i++) {
+		vr = as_findregion(v[i].v_as, v[i].v_vaddr);
+		KASSERT(vr != NULL);
+		if ((vr->vr_perms & VR_WRITE) == 0) {
+			*v[i].v_pte = 0;
+			v[i].v_as->as_stats.vs_resident--;
+			coremap_free(v[i].v_pa);
+			COUNTER_INC(&discard_count);
+			freed++;
+		}
+		else if (swap_vnode == NULL) {
+			coremap_unbusy(v[i].v_pa);
+		}
+		else {
+			w[nw++] = &v[i];
+		}
+	}
+
+	/* Write the rest out, as few requests as the free slots allow. */
+	for (i = 0; i < nw; i += got) {
+		if (!swap_allocrun(nw - i, &slot, &got)) {
+			for (; i < nw; i++) {
+				coremap_unbusy(w[i]->v_pa);
+			}
+			break;
+		}
+		result = swap_writerun(&w[i], got, slot);
+		for (j = 0; j < got; j++) {
+			if (result) {
+				swap_free(slot + j);
+				coremap_unbusy(w[i+j]->v_pa);
+				continue;
+			}
+			*w[i+j]->v_pte = PTE_MKSWAP(slot + j);
+			w[i+j]->v_as->as_stats.vs_resident--;
+			coremap_free(w[i+j]->v_pa);
+			freed++;
+		}
+		if (result) {
+			kprintf("swap: write error: %s\n", strerror(result));
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (v[i].v_locked) {
+			lock_release(&v[i].v_as->as_lock);
+		}
+	}
+	lock_release(pageout_lock);
+	return freed;
+}
+
+void
+pageout_wakeup(void)
+{
+	if (pageout_sem == NULL || pageout_pending) {
+		return;
+	}
+	if (coremap_nfree() < SWAP_LOWAT) {
+		pageout_pending = true;
+		V(pageout_sem);
+	}
+}
+
+static
+void
+pageout_thread(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		P(pageout_sem);
+		pageout_pending = false;
+		while (coremap_nfree() < SWAP_HIWAT) {
+			if (pageout_batch(PAGEOUT_BATCH) == 0) {
+				break;
+			}
+		}
+	}
+}
+
+paddr_t
+page_alloc(void)
+{
+	paddr_t pa;
+
+	while (1) {
+		pa = coremap_alloc(1, COREMAP_USER);
+		if (pa != 0) {
+			pageout_wakeup();
+			return pa;
+		}
+
+		/* A page from the zero pool is better than paging. */
+		pa = zeropool_get();
+		if (pa != 0) {
+			pageout_wakeup();
+			return pa;
+		}
+
+		/* The pageout thread isn't keeping up; help it. */
+		COUNTER_INC(&syncout_count);
+		if (pageout_batch(PAGEOUT_BATCH) == 0) {
+			return 0;
+		}
+	}
+}
+
+bool
+page_reclaim(void)
+{
+	paddr_t pa;
+
+	/* A pre-zeroed page is cheaper to give up than paging. */
+	pa = zeropool_get();
+	if (pa != 0) {
+		coremap_free(pa);
+		return true;
+	}
+
+	if (pageout_lock == NULL) {
+		/* Too early. */
+		return false;
+	}
+	if (curthread->t_in_interrupt || curthread->t_iplhigh_count > 0) {
+		/* Can't sleep. */
+		return false;
+	}
+
+	COUNTER_INC(&reclaim_count);
+	return pageout_batch(PAGEOUT_BATCH) > 0;
+}
+
+////////////////////////////////////////////////////////////
+// Setup
+
+void
+swap_bootstrap(void)
+{
+	char path[sizeof(SWAP_DEVICE)];
+	struct stat st;
+	int result;
+
+	pageout_sem = sem_create("pageout", 0);
+	if (pageout_sem == NULL) {
+		panic("swap_bootstrap: Out of memory\n");
+	}
+	pageout_lock = lock_create("pageout");
+	if (pageout_lock == NULL) {
+		panic("swap_bootstrap: Out of memory\n");
+	}
+
+	/* vfs_open may scribble on the name */
+	strcpy(path, SWAP_DEVICE);
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+	}
+	else {
+		result = VOP_STAT(swap_vnode, &st);
+		if (result) {
+			panic("swap_bootstrap: stat %s: %s\n",
+			      SWAP_DEVICE, strerror(result));
+		}
+		swap_nslots = st.st_size / PAGE_SIZE;
+		if (swap_nslots > SWAP_MAXSLOTS) {
+			swap_nslots = SWAP_MAXSLOTS;
+		}
+		if (swap_nslots == 0) {
+			kprintf("swap: %s is too small; running without "
+				"swap\n", SWAP_DEVICE);
+			vfs_close(swap_vnode);
+			swap_vnode = NULL;
+		}
+		else {
+			swap_map = bitmap_create(swap_nslots);
+			if (swap_map == NULL) {
+				panic("swap_bootstrap: Out of memory\n");
+			}
+			kprintf("swap: %u pages on %s\n", swap_nslots,
+				SWAP_DEVICE);
+		}
+	}
+
+	result = thread_fork("pageout", pageout_thread, NULL, 0, NULL);
+	if (result) {
+		panic("swap_bootstrap: thread_fork: %s\n", strerror(result));
+	}
+}
@@ -0,0 +1,290 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Shared program text and read-only file mappings. See textcache.h.
+ *
+ * The textobjs are kept on a list, which is short (one entry per
+ * program running), under textcache_lock. Each textobj has its own
+ * lock for filling in its pages, which is held across the disk read
+ * so that two processes faulting on the same page don't both read
+ * it. Lock order: as_lock, then to_lock, then textcache_lock.
+ *
+ * Text pages can't be paged out while they're shared, so the number
+ * of them is capped at 1/TEXTCACHE_SHARE of the memory free at boot.
+ * Past that, textcache_getpage declines and the page becomes an
+ * ordinary private (and evictable) page of the faulting process.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <current.h>
+#include <cpu.h>
+#include <counter.h>
+#include <addrspace.h>
+#include <textcache.h>
+#include <vm.h>
+
+#define TEXTCACHE_SHARE	4	/* at most 1/4 of memory is shared text */
+
+struct textobj {
+	/*
+	 * What's in it: must match the region, except that the region
+	 * can be anywhere, so the file data is placed relative to the
+	 * start of the region rather than at a fixed address.
+	 */
+	struct vnode *to_vnode;
+	size_t to_npages;
+	off_t to_fileoff;
+	size_t to_filestart;		/* vr_filevaddr - vr_base */
+	size_t to_filesz;
+
+	unsigned to_refcount;		/* regions using it */
+	struct lock *to_lock;		/* protects to_pages */
+	paddr_t *to_pages;		/* per page; 0 if not read in yet */
+	struct textobj *to_next;	/* list link */
+};
+
+static struct lock *textcache_lock;
+static struct textobj *textcache_list;		/* under textcache_lock */
+static unsigned textcache_npages;		/* under textcache_lock */
+static unsigned textcache_maxpages;
+
+static struct counter hit_count = COUNTER_INITIALIZER("text_hit");
+static struct counter miss_count = COUNTER_INITIALIZER("text_miss");
+static struct counter full_count = COUNTER_INITIALIZER("text_full");
+
+void
+textcache_bootstrap(void)
+{
+	textcache_lock = lock_create("textcache");
+	if (textcache_lock == NULL) {
+		panic("textcache_bootstrap: Out of memory\n");
+	}
+	textcache_maxpages = coremap_nfree() / TEXTCACHE_SHARE;
+}
+
+static
+bool
+textobj_matches(struct textobj *to, struct vm_region *vr)
+{
+	return to->to_vnode == vr->vr_vnode &&
+		to->to_npages == vr->vr_npages &&
+		to->to_fileoff == vr->vr_fileoff &&
+		to->to_filestart == vr->vr_filevaddr - vr->vr_base &&
+		to->to_filesz == vr->vr_filesz;
+}
+
+static
+struct textobj *
+textobj_create(struct vm_region *vr)
+{
+	struct textobj *to;
+	size_t i;
+
+	to = kmalloc(sizeof(*to));
+	if (to == NULL) {
+		return NULL;
+	}
+	to->to_pages = kmalloc(vr->vr_npages * sizeof(to->to_pages[0]));
+	if (to->to_pages == NULL) {
+		kfree(to);
+		return NULL;
+	}
+	to->to_lock = lock_create("textobj");
+	if (to->to_lock == NULL) {
+		kfree(to->to_pages);
+		kfree(to);
+		return NULL;
+	}
+	for (i=0; i<vr->vr_npages; i++) {
+		to->to_pages[i] = 0;
+	}
+
+	/* Keep the file open as long as we're around. */
+	VOP_INCOPEN(vr->vr_vnode);
+	VOP_INCREF(vr->vr_vnode);
+	to->to_vnode = vr->vr_vnode;
+	to->to_npages = vr->vr_npages;
+	to->to_fileoff = vr->vr_fileoff;
+	to->to_filestart = vr->vr_filevaddr - vr->vr_base;
+	to->to_filesz = vr->vr_filesz;
+	to->to_refcount = 1;
+	to->to_next = NULL;
+	return to;
+}
+
+static
+void
+textobj_destroy(struct textobj *to)
+{
+	size_t i;
+	unsigned n;
+
+	n = 0;
+	for (i=0; i<to->to_npages; i++) {
+		if (to->to_pages[i] != 0) {
+			coremap_free(to->to_pages[i]);
+			n++;
+		}
+	}
+	lock_acquire(textcache_lock);
+	KASSERT(textcache_npages >= n);
+	textcache_npages -= n;
+	lock_release(textcache_lock);
+
+	vfs_close(to->to_vnode);
+	lock_destroy(to->to_lock);
+	kfree(to->to_pages);
+	kfree(to);
+}
+
+struct textobj *
+textcache_get(struct vm_region *vr)
+{
+	struct textobj *to;
+
+	KASSERT(vr->vr_vnode != NULL);
+
+	lock_acquire(textcache_lock);
+	for (to = textcache_list; to != NULL; to = to->to_next) {
+		if (textobj_matches(to, vr)) {
+			to->to_refcount++;
+			lock_release(textcache_lock);
+			return to;
+		}
+	}
+	to = textobj_create(vr);
+	if (to != NULL) {
+		to->to_next = textcache_list;
+		textcache_list = to;
+	}
+	lock_release(textcache_lock);
+	return to;
+}
+
+void
+textcache_incref(struct textobj *to)
+{
+	lock_acquire(textcache_lock);
+	KASSERT(to->to_refcount > 0);
+	to->to_refcount++;
+	lock_release(textcache_lock);
+}
+
+void
+textcache_release(struct textobj *to)
+{
+	struct textobj **pp;
+
+	lock_acquire(textcache_lock);
+	KASSERT(to->to_refcount > 0);
+	to->to_refcount--;
+	if (to->to_refcount > 0) {
+		lock_release(textcache_lock);
+		return;
+	}
+	for (pp = &textcache_list; *pp != to; pp = &(*pp)->to_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = to->to_next;
+	lock_release(textcache_lock);
+
+	textobj_destroy(to);
+}
+
+int
+textcache_getpage(struct textobj *to, struct vm_region *vr, vaddr_t vaddr,
+		  paddr_t *ret, bool *readin)
+{
+	unsigned index;
+	paddr_t pa;
+	int result;
+
+	KASSERT(textobj_matches(to, vr));
+	KASSERT(vaddr >= vr->vr_base);
+	index = (vaddr - vr->vr_base) / PAGE_SIZE;
+	KASSERT(index < to->to_npages);
+
+	lock_acquire(to->to_lock);
+	pa = to->to_pages[index];
+	if (pa != 0) {
+		lock_release(to->to_lock);
+		COUNTER_INC(&hit_count);
+		*ret = pa;
+		*readin = false;
+		return 0;
+	}
+
+	/* Count the page against the cap before getting it. */
+	lock_acquire(textcache_lock);
+	if (textcache_npages >= textcache_maxpages) {
+		lock_release(textcache_lock);
+		lock_release(to->to_lock);
+		COUNTER_INC(&full_count);
+		*ret = 0;
+		return 0;
+	}
+	textcache_npages++;
+	lock_release(textcache_lock);
+
+	/*
+	 * The page stays busy, since it has no single owner; that
+	 * keeps the pager away from it.
+	 */
+	pa = page_alloc();
+	if (pa == 0) {
+		result = ENOMEM;
+	}
+	else {
+		result = as_fillpage(vr, vaddr, pa);
+		if (result) {
+			coremap_free(pa);
+		}
+	}
+	if (result) {
+		lock_release(to->to_lock);
+		lock_acquire(textcache_lock);
+		textcache_npages--;
+		lock_release(textcache_lock);
+		return result;
+	}
+	to->to_pages[index] = pa;
+	lock_release(to->to_lock);
+
+	COUNTER_INC(&miss_count);
+	*ret = pa;
+	*readin = true;
+	return 0;
+}
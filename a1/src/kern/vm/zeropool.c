@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Pool of pre-zeroed pages.
+ *
+ * Zero-filled pages (stack, heap, bss, and anything else with no
+ * file data) are taken from a pool of pages that have already been
+ * zeroed, so the fault doesn't have to do it. Idle cpus keep the
+ * pool topped up: when a cpu has nothing to run, thread_switch calls
+ * zeropool_idle, which zeroes one page at a time and goes back to
+ * check for runnable threads in between.
+ *
+ * The pool is refilled once it drops below ZP_LOWAT and up to
+ * ZP_HIWAT, so that an idle cpu does a stretch of zeroing at once
+ * rather than one page every time a page is taken. Pages aren't put
+ * in the pool if memory is short (fewer than ZP_RESERVE free), and
+ * page_alloc takes pages from the pool before paging anything out.
+ *
+ * Pool pages are allocated as user pages, busy and without an owner
+ * (see coremap.c), exactly as page_alloc would return them.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <current.h>
+#include <cpu.h>
+#include <counter.h>
+#include <vm.h>
+
+#define ZP_HIWAT	16	/* fill up to this many */
+#define ZP_LOWAT	4	/* start filling below this many */
+#define ZP_RESERVE	32	/* leave at least this many pages free */
+
+static paddr_t zp_pages[ZP_HIWAT];
+static unsigned zp_count;
+static bool zp_filling = true;		/* starts out empty */
+static struct spinlock zp_lock = SPINLOCK_INITIALIZER;
+
+static struct counter hit_count = COUNTER_INITIALIZER("zeropool_hit");
+static struct counter miss_count = COUNTER_INITIALIZER("zeropool_miss");
+static struct counter fill_count = COUNTER_INITIALIZER("zeropool_fill");
+
+paddr_t
+zeropool_get(void)
+{
+	paddr_t pa;
+
+	spinlock_acquire(&zp_lock);
+	if (zp_count == 0) {
+		spinlock_release(&zp_lock);
+		return 0;
+	}
+	pa = zp_pages[--zp_count];
+	if (zp_count < ZP_LOWAT) {
+		zp_filling = true;
+	}
+	spinlock_release(&zp_lock);
+	return pa;
+}
+
+paddr_t
+page_alloc_zeroed(void)
+{
+	paddr_t pa;
+
+	pa = zeropool_get();
+	if (pa != 0) {
+		COUNTER_INC(&hit_count);
+		return pa;
+	}
+
+	COUNTER_INC(&miss_count);
+	pa = page_alloc();
+	if (pa == 0) {
+		return 0;
+	}
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	return pa;
+}
+
+/*
+ * Called from the idle loop, with interrupts off. Zero one page for
+ * the pool if it needs one. Returns true if there was work to do, in
+ * which case the caller should check for runnable threads and call
+ * again rather than idling.
+ *
+ * Interrupts go back on while the page is zeroed, as they would in
+ * cpu_idle, so that zeroing doesn't hold up interrupt handling. The
+ * cpu is marked idle, so an interrupt can't switch us out.
+ */
+bool
+zeropool_idle(void)
+{
+	paddr_t pa;
+	int spl;
+
+	spinlock_acquire(&zp_lock);
+	if (zp_count >= ZP_HIWAT) {
+		zp_filling = false;
+	}
+	if (!zp_filling) {
+		spinlock_release(&zp_lock);
+		return false;
+	}
+	spinlock_release(&zp_lock);
+
+	if (coremap_nfree() < ZP_RESERVE) {
+		return false;
+	}
+	pa = coremap_alloc(1, COREMAP_USER);
+	if (pa == 0) {
+		return false;
+	}
+	spl = spl0();
+	bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	splx(spl);
+
+	spinlock_acquire(&zp_lock);
+	if (zp_count < ZP_HIWAT) {
+		zp_pages[zp_count++] = pa;
+		pa = 0;
+	}
+	spinlock_release(&zp_lock);
+
+	if (pa != 0) {
+		/* Another cpu filled it first. */
+		coremap_free(pa);
+	}
+	else {
+		COUNTER_INC(&fill_count);
+	}
+	return true;
+}
@@ -30,10 +30,26 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * This is a segregated-fit allocator with boundary tags; see
+ * design/usermalloc.txt for the full story. In brief:
+ *
+ * Every block starts with a header giving its size and whether it
+ * and the block below it are in use. When a block is free, the
+ * header of the block above it also holds its size (the "boundary
+ * tag"), so free blocks can be merged with free neighbors in either
+ * direction in constant time.
+ *
+ * Free blocks are kept in bins by size. Small blocks (up to
+ * MSMALLMAX bytes) have one bin per size, and are not merged when
+ * freed: they just go on the front of their bin, and malloc of that
+ * size takes the first one off again, so both are O(1). Everything
+ * else is merged with its neighbors and kept in bins by power of two;
+ * malloc looks in the bin for its size, then in the bins above. The
+ * small blocks are merged too (consolidated) before any large
+ * allocation, so memory freed in small pieces can still be reused in
+ * big ones.
+ *
+ * If nothing fits, the heap is extended with sbrk.
  */
 
 #include <stdlib.h>
@@ -54,92 +70,89 @@
 /*
  * malloc block header.
  *
- * mh_prevblock is the downwards offset to the previous header, 0 if this
- * is the bottom of the heap.
+ * mh_prevsize is the size of the block below, if it is free (the
+ * boundary tag); otherwise it's garbage.
  *
- * mh_nextblock is the upwards offset to the next header.
+ * mh_size is the size of this block, including the header. Block
+ * sizes are multiples of MALIGN, which leaves the low bits of
+ * mh_size free for flags:
+ *    M_INUSE     - this block is allocated (or is a small free block
+ *                  sitting in its bin, which counts as in use for
+ *                  merging purposes)
+ *    M_PREVINUSE - the block below is not a free, merged block
+ *    M_CACHED    - this is a small free block in a bin
  *
- * mh_pad is unused.
- * mh_inuse is 1 if the block is in use, 0 if it is free.
- * mh_magic* should always be a fixed value.
- *
- * MBLOCKSIZE should equal sizeof(struct mheader) and be a power of 2.
- * MBLOCKSHIFT is the log base 2 of MBLOCKSIZE.
- * MMAGIC is the value for mh_magic*.
+ * MALIGN is both the header size and the alignment of everything we
+ * hand out.
  */
 struct mheader {
+	size_t mh_prevsize;
+	size_t mh_size;
+};
 
-#if defined(MALLOC32)
-#define MBLOCKSIZE 8
-#define MBLOCKSHIFT 3
-#define MMAGIC 2
-	/*
-	 * 32-bit platform. size_t is 32 bits (4 bytes). 
-	 * Block size is 8 bytes.
-	 */
-	unsigned mh_prevblock:29;
-	unsigned mh_pad:1;
-	unsigned mh_magic1:2;
-
-	unsigned mh_nextblock:29;
-	unsigned mh_inuse:1;
-	unsigned mh_magic2:2;
-
-#elif defined(MALLOC64)
-#define MBLOCKSIZE 16
-#define MBLOCKSHIFT 4
-#define MMAGIC 6
-	/*
-	 * 64-bit platform. size_t is 64 bits (8 bytes)
-	 * Block size is 16 bytes.
-	 */
-	unsigned mh_prevblock:62;
-	unsigned mh_pad:1;
-	unsigned mh_magic1:3;
+#define MALIGN		(sizeof(struct mheader))
 
-	unsigned mh_nextblock:62;
-	unsigned mh_inuse:1;
-	unsigned mh_magic2:3;
+#define M_INUSE		((size_t)1)
+#define M_PREVINUSE	((size_t)2)
+#define M_CACHED	((size_t)4)
+#define M_FLAGS		(M_INUSE | M_PREVINUSE | M_CACHED)
 
-#else
-#error "please fix me"
-#endif
+/*
+ * A free block also holds its list links.
+ */
+struct mfree {
+	struct mheader mf_hdr;
+	struct mfree *mf_next;
+	struct mfree *mf_prev;
 };
 
+/* Smallest block we can make */
+#define MMINBLOCK	((sizeof(struct mfree) + MALIGN - 1) & ~(MALIGN - 1))
+
 /*
  * Operator macros on struct mheader.
  *
- * M_NEXT/PREVOFF:	return offset to next/previous header
- * M_NEXT/PREV:		return next/previous header
- * 
- * M_DATA:		return data pointer of a header
- * M_SIZE:		return data size of a header
- *
- * M_OK:		true if the magic values are correct
- * 
- * M_MKFIELD:		prepare a value for mh_next/prevblock.
- * 			(value should include the header size)
+ * M_SIZE:	return the size of a block
+ * M_NEXT:	return the next block up
+ * M_PREV:	return the block below (only if it's free)
+ * M_DATA:	return the data pointer of a block
+ * M_HDR:	return the header of a data pointer
  */
+#define M_SIZE(mh)	((mh)->mh_size & ~M_FLAGS)
+#define M_NEXT(mh)	((struct mheader *)((char *)(mh) + M_SIZE(mh)))
+#define M_PREV(mh)	((struct mheader *)((char *)(mh) - (mh)->mh_prevsize))
+#define M_DATA(mh)	((void *)((mh) + 1))
+#define M_HDR(ptr)	(((struct mheader *)(ptr)) - 1)
 
-#define M_NEXTOFF(mh)	((size_t)(((size_t)((mh)->mh_nextblock))<<MBLOCKSHIFT))
-#define M_PREVOFF(mh)	((size_t)(((size_t)((mh)->mh_prevblock))<<MBLOCKSHIFT))
-#define M_NEXT(mh)	((struct mheader *)(((char*)(mh))+M_NEXTOFF(mh)))
-#define M_PREV(mh)	((struct mheader *)(((char*)(mh))-M_PREVOFF(mh)))
-
-#define M_DATA(mh)	((void *)((mh)+1))
-#define M_SIZE(mh)	(M_NEXTOFF(mh)-MBLOCKSIZE)
+/*
+ * Bins.
+ *
+ * Small bin N holds blocks of size N*MALIGN; they are singly linked
+ * through mf_next. Large bin N holds free blocks whose size has its
+ * top bit at position N; they are doubly linked.
+ */
+#define MSMALLMAX	512
+#define NSMALLBINS	(MSMALLMAX / MALIGN + 1)
+#define NLARGEBINS	(sizeof(size_t) * 8)
 
-#define M_OK(mh)	((mh)->mh_magic1==MMAGIC && (mh)->mh_magic2==MMAGIC)
+static struct mfree *__smallbins[NSMALLBINS];
+static struct mfree *__largebins[NLARGEBINS];
+static unsigned __ncached;	/* blocks in small bins */
 
-#define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
+/* Grow the heap by at least this much at a time. */
+#define MSBRKUNIT	4096
 
 ////////////////////////////////////////////////////////////
 
 /*
- * Static variables - the bottom and top addresses of the heap.
+ * Static variables - the bottom and top addresses of the heap. The
+ * last MALIGN bytes of the heap are an empty in-use block that marks
+ * the end (the "epilogue").
  */
 static uintptr_t __heapbase, __heaptop;
 
+#define M_EPILOGUE()	((struct mheader *)(__heaptop - MALIGN))
+
 /*
  * Setup function.
  */
@@ -147,19 +160,14 @@ static
 void
 __malloc_init(void)
 {
+	struct mheader *epi;
 	void *x;
 
 	/*
 	 * Check various assumed properties of the sizes.
 	 */
-	if (sizeof(struct mheader) != MBLOCKSIZE) {
-		errx(1, "malloc: Internal error - MBLOCKSIZE wrong");
-	}
-	if ((MBLOCKSIZE & (MBLOCKSIZE-1))!=0) {
-		errx(1, "malloc: Internal error - MBLOCKSIZE not power of 2");
-	}
-	if (1<<MBLOCKSHIFT != MBLOCKSIZE) {
-		errx(1, "malloc: Internal error - MBLOCKSHIFT wrong");
+	if ((MALIGN & (MALIGN-1))!=0 || MALIGN < 8) {
+		errx(1, "malloc: Internal error - MALIGN wrong");
 	}
 
 	/* init should only be called once. */
@@ -184,8 +192,8 @@ __malloc_init(void)
 	 * begins at _end.)
 	 */
 
-	if (__heapbase % MBLOCKSIZE != 0) {
-		size_t adjust = MBLOCKSIZE - (__heapbase % MBLOCKSIZE);
+	if (__heapbase % MALIGN != 0) {
+		size_t adjust = MALIGN - (__heapbase % MALIGN);
 		x = sbrk(adjust);
 		if (x==(void *)-1) {
 			err(1, "malloc: sbrk failed aligning heap base");
@@ -200,6 +208,19 @@ __malloc_init(void)
 		__heapbase += adjust;
 		__heaptop = __heapbase;
 	}
+
+	/* Put the epilogue in. */
+	x = sbrk(MALIGN);
+	if (x==(void *)-1) {
+		err(1, "malloc: sbrk failed");
+	}
+	if ((uintptr_t)x != __heaptop) {
+		err(1, "malloc: heap base moved during init");
+	}
+	__heaptop += MALIGN;
+	epi = M_EPILOGUE();
+	epi->mh_prevsize = 0;
+	epi->mh_size = M_INUSE | M_PREVINUSE;
 }
 
 ////////////////////////////////////////////////////////////
@@ -215,35 +236,32 @@ __malloc_dump(void)
 {
 	struct mheader *mh;
 	uintptr_t i;
-	size_t rightprevblock;
+	int prevfree;
 
 	warnx("heap: ************************************************");
 
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
+	prevfree = 0;
+	for (i=__heapbase; i<__heaptop - MALIGN; i += M_SIZE(mh)) {
 		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
+		if (M_SIZE(mh) < MMINBLOCK || M_SIZE(mh) % MALIGN != 0) {
 			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
+			     " has bad size %lu",
+			     (unsigned long) i, (unsigned long) M_SIZE(mh));
 		}
-		if (mh->mh_prevblock != rightprevblock) {
+		if (!(mh->mh_size & M_PREVINUSE) != prevfree) {
 			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
+			     " has wrong M_PREVINUSE",
+			     (unsigned long) i);
 		}
-		rightprevblock = mh->mh_nextblock;
+		prevfree = !(mh->mh_size & M_INUSE);
 
-		warnx("heap: 0x%lx 0x%-6lx (next: 0x%lx) %s",
-		      (unsigned long) i + MBLOCKSIZE,
+		warnx("heap: 0x%lx 0x%-6lx %s",
+		      (unsigned long) i + MALIGN,
 		      (unsigned long) M_SIZE(mh),
-		      (unsigned long) (i+M_NEXTOFF(mh)),
-		      mh->mh_inuse ? "INUSE" : "FREE");
+		      (mh->mh_size & M_CACHED) ? "CACHED" :
+		      (mh->mh_size & M_INUSE) ? "INUSE" : "FREE");
 	}
-	if (i!=__heaptop) {
+	if (i != __heaptop - MALIGN) {
 		errx(1, "malloc: Heap corrupt; ran off end");
 	}
 
@@ -255,75 +273,213 @@ __malloc_dump(void)
 ////////////////////////////////////////////////////////////
 
 /*
- * Get more memory (at the top of the heap) using sbrk, and 
- * return a pointer to it.
+ * Which large bin a block of size SIZE goes in: the position of the
+ * top bit.
  */
 static
-void *
-__malloc_sbrk(size_t size)
+unsigned
+__malloc_largebin(size_t size)
 {
-	void *x;
+	unsigned bin = 0;
 
-	x = sbrk(size);
-	if (x == (void *)-1) {
-		return NULL;
+	while (size > 1) {
+		size >>= 1;
+		bin++;
 	}
+	return bin;
+}
 
-	if ((uintptr_t)x != __heaptop) {
-		errx(1, "malloc: Internal error - "
-		     "heap top moved itself from 0x%lx to 0x%lx",
-		     (unsigned long) __heaptop,
-		     (unsigned long) (uintptr_t) x);
+static
+void
+__malloc_link(struct mfree *mf)
+{
+	unsigned bin;
+
+	bin = __malloc_largebin(M_SIZE(&mf->mf_hdr));
+	mf->mf_prev = NULL;
+	mf->mf_next = __largebins[bin];
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf;
+	}
+	__largebins[bin] = mf;
+}
+
+static
+void
+__malloc_unlink(struct mfree *mf)
+{
+	unsigned bin;
+
+	if (mf->mf_prev != NULL) {
+		mf->mf_prev->mf_next = mf->mf_next;
+	}
+	else {
+		bin = __malloc_largebin(M_SIZE(&mf->mf_hdr));
+		if (__largebins[bin] != mf) {
+			errx(1, "malloc: Heap corrupt; free block %p "
+			     "not in its bin", mf);
+		}
+		__largebins[bin] = mf->mf_next;
+	}
+	if (mf->mf_next != NULL) {
+		mf->mf_next->mf_prev = mf->mf_prev;
 	}
-	__heaptop += size;
-	return x;
 }
 
 /*
- * Make a new (free) block from the block passed in, leaving size
- * bytes for data in the current block. size must be a multiple of
- * MBLOCKSIZE.
- *
- * Only split if the excess space is at least twice the blocksize -
- * one blocksize to hold a header and one for data.
+ * Make the in-use block MH free: merge it with any free neighbors,
+ * set the boundary tag, and put the result in its bin.
  */
 static
 void
-__malloc_split(struct mheader *mh, size_t size)
+__malloc_release(struct mheader *mh)
 {
-	struct mheader *mhnext, *mhnew;
-	size_t oldsize;
+	struct mheader *prev, *next;
+	size_t size;
+
+	size = M_SIZE(mh);
+	next = M_NEXT(mh);
+
+	if (!(mh->mh_size & M_PREVINUSE)) {
+		prev = M_PREV(mh);
+		if (M_SIZE(prev) != mh->mh_prevsize ||
+		    (prev->mh_size & M_INUSE)) {
+			errx(1, "free: Heap corrupt (%p and %p inconsistent)",
+			     prev, mh);
+		}
+		__malloc_unlink((struct mfree *)prev);
+		size += M_SIZE(prev);
+		mh = prev;
+	}
+	if (!(next->mh_size & M_INUSE)) {
+		__malloc_unlink((struct mfree *)next);
+		size += M_SIZE(next);
+	}
+
+	/* The block below a free block is always in use. */
+	mh->mh_size = size | M_PREVINUSE;
+	next = M_NEXT(mh);
+	next->mh_prevsize = size;
+	next->mh_size &= ~M_PREVINUSE;
+
+	__malloc_link((struct mfree *)mh);
+}
 
-	if (size % MBLOCKSIZE != 0) {
-		errx(1, "malloc: Internal error (size %lu passed to split)",
-		     (unsigned long) size);
+/*
+ * Merge all the small free blocks into the large bins.
+ */
+static
+void
+__malloc_consolidate(void)
+{
+	struct mfree *mf;
+	unsigned i;
+
+	for (i=0; i<NSMALLBINS; i++) {
+		while ((mf = __smallbins[i]) != NULL) {
+			__smallbins[i] = mf->mf_next;
+			mf->mf_hdr.mh_size &= ~M_CACHED;
+			__malloc_release(&mf->mf_hdr);
+		}
 	}
+	__ncached = 0;
+}
+
+/*
+ * Cut SIZE bytes off the front of the in-use block MH if what's left
+ * is big enough to be a block, and free the rest.
+ */
+static
+void
+__malloc_split(struct mheader *mh, size_t size)
+{
+	struct mheader *rest;
+	size_t oldsize;
 
-	if (M_SIZE(mh) - size < 2*MBLOCKSIZE) {
+	oldsize = M_SIZE(mh);
+	if (oldsize - size < MMINBLOCK) {
 		/* no room */
 		return;
 	}
 
-	mhnext = M_NEXT(mh);
+	mh->mh_size = size | (mh->mh_size & M_FLAGS);
+	rest = M_NEXT(mh);
+	rest->mh_size = (oldsize - size) | M_INUSE | M_PREVINUSE;
+	__malloc_release(rest);
+}
 
-	oldsize = M_SIZE(mh);
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
-	
-	mhnew = M_NEXT(mh);
-	if (mhnew==mhnext) {
-		errx(1, "malloc: Internal error (split screwed up?)");
+/*
+ * Get more memory (at the top of the heap) using sbrk, enough for a
+ * block of SIZE bytes, and add it to the free blocks. Returns 0 on
+ * success, -1 if out of memory.
+ */
+static
+int
+__malloc_sbrk(size_t size)
+{
+	struct mheader *mh, *epi;
+	size_t amount, prevflag;
+	void *x;
+
+	/*
+	 * If the block at the top is free, the new memory will be
+	 * merged with it. (It must be smaller than SIZE, or it would
+	 * have been used.)
+	 */
+	epi = M_EPILOGUE();
+	prevflag = epi->mh_size & M_PREVINUSE;
+	amount = size;
+	if (!prevflag && epi->mh_prevsize < size) {
+		amount -= epi->mh_prevsize;
+	}
+	if (amount < MSBRKUNIT) {
+		amount = MSBRKUNIT;
 	}
+	amount = (amount + MALIGN - 1) & ~(size_t)(MALIGN - 1);
 
-	mhnew->mh_prevblock = M_MKFIELD(size + MBLOCKSIZE);
-	mhnew->mh_pad = 0;
-	mhnew->mh_magic1 = MMAGIC;
-	mhnew->mh_nextblock = M_MKFIELD(oldsize - size);
-	mhnew->mh_inuse = 0;
-	mhnew->mh_magic2 = MMAGIC;
+	x = sbrk(amount);
+	if (x == (void *)-1) {
+		return -1;
+	}
+	if ((uintptr_t)x != __heaptop) {
+		errx(1, "malloc: Internal error - "
+		     "heap top moved itself from 0x%lx to 0x%lx",
+		     (unsigned long) __heaptop,
+		     (unsigned long) (uintptr_t) x);
+	}
+	__heaptop += amount;
+
+	/* The old epilogue becomes the header of the new block. */
+	mh = epi;
+	mh->mh_size = amount | M_INUSE | prevflag;
+	epi = M_EPILOGUE();
+	epi->mh_size = M_INUSE;
+	__malloc_release(mh);
+	return 0;
+}
 
-	if (mhnext != (struct mheader *) __heaptop) {
-		mhnext->mh_prevblock = mhnew->mh_nextblock;
+/*
+ * Find a free block of at least SIZE bytes in the large bins, take
+ * it out, and return it (in use); or NULL.
+ */
+static
+struct mheader *
+__malloc_findlarge(size_t size)
+{
+	struct mfree *mf;
+	unsigned bin;
+
+	for (bin = __malloc_largebin(size); bin < NLARGEBINS; bin++) {
+		for (mf = __largebins[bin]; mf != NULL; mf = mf->mf_next) {
+			if (M_SIZE(&mf->mf_hdr) >= size) {
+				__malloc_unlink(mf);
+				mf->mf_hdr.mh_size |= M_INUSE;
+				M_NEXT(&mf->mf_hdr)->mh_size |= M_PREVINUSE;
+				return &mf->mf_hdr;
+			}
+		}
 	}
+	return NULL;
 }
 
 /*
@@ -333,8 +489,8 @@ void *
 malloc(size_t size)
 {
 	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
+	struct mfree *mf;
+	unsigned bin;
 
 	if (__heapbase==0) {
 		__malloc_init();
@@ -351,74 +507,46 @@ malloc(size_t size)
 	__malloc_dump();
 #endif
 
-	/* Round size up to an integral number of blocks. */
-	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
-
-	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
-	 */
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
-
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
+	/* Add the header and round up to the block size. */
+	if (size > (size_t)-1 - 2*MALIGN) {
+		return NULL;
+	}
+	size = (size + MALIGN + MALIGN - 1) & ~(size_t)(MALIGN-1);
+	if (size < MMINBLOCK) {
+		size = MMINBLOCK;
+	}
 
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
+	/* Small: take one from the bin if there is one. */
+	if (size <= MSMALLMAX) {
+		bin = size / MALIGN;
+		mf = __smallbins[bin];
+		if (mf != NULL) {
+			__smallbins[bin] = mf->mf_next;
+			__ncached--;
+			mf->mf_hdr.mh_size &= ~M_CACHED;
+			return M_DATA(&mf->mf_hdr);
 		}
-
-		/* Try splitting block. */
-		__malloc_split(mh, size);
-
-		/*
-		 * Now, allocate.
-		 */
-		mh->mh_inuse = 1;
-
-#ifdef MALLOCDEBUG
-		warnx("malloc: allocating at %p", M_DATA(mh));
-		__malloc_dump();
-#endif
-		return M_DATA(mh);
 	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
+	else if (__ncached > 0) {
+		/* Large: let the small blocks merge first. */
+		__malloc_consolidate();
 	}
 
-	/*
-	 * Didn't find anything. Expand the heap.
-	 */
-
-	mh = __malloc_sbrk(size + MBLOCKSIZE);
+	mh = __malloc_findlarge(size);
 	if (mh == NULL) {
-		return NULL;
+		if (__malloc_sbrk(size) < 0) {
+			/* Last chance: maybe small blocks will do. */
+			if (__ncached == 0) {
+				return NULL;
+			}
+			__malloc_consolidate();
+		}
+		mh = __malloc_findlarge(size);
+		if (mh == NULL) {
+			return NULL;
+		}
 	}
-
-	mh->mh_prevblock = rightprevblock;
-	mh->mh_magic1 = MMAGIC;
-	mh->mh_magic2 = MMAGIC;
-	mh->mh_pad = 0;
-	mh->mh_inuse = 1;
-	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
+	__malloc_split(mh, size);
 
 #ifdef MALLOCDEBUG
 	warnx("malloc: allocating at %p", M_DATA(mh));
@@ -444,44 +572,16 @@ __malloc_deadbeef(void *ptr, size_t size)
 	}
 }
 
-/*
- * Attempt to merge two adjacent blocks (mh below mhnext).
- */
-static
-void
-__malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
-{
-	struct mheader *mhnextnext;
-
-	if (mh->mh_nextblock != mhnext->mh_prevblock) {
-		errx(1, "free: Heap corrupt (%p and %p inconsistent)",
-		     mh, mhnext);
-	}
-	if (mh->mh_inuse || mhnext->mh_inuse) {
-		/* can't merge */
-		return;
-	}
-
-	mhnextnext = M_NEXT(mhnext);
-
-	mh->mh_nextblock = M_MKFIELD(MBLOCKSIZE + M_SIZE(mh) +
-				     MBLOCKSIZE + M_SIZE(mhnext));
-
-	if (mhnextnext != (struct mheader *)__heaptop) {
-		mhnextnext->mh_prevblock = mh->mh_nextblock;
-	}
-
-	/* Deadbeef out the memory used by the now-obsolete header */
-	__malloc_deadbeef(mhnext, sizeof(struct mheader));
-}
-
 /*
  * The actual free() implementation.
  */
 void
 free(void *x)
 {
-	struct mheader *mh, *mhnext, *mhprev;
+	struct mheader *mh;
+	struct mfree *mf;
+	size_t size;
+	unsigned bin;
 
 	if (x==NULL) {
 		/* safest practice */
@@ -496,7 +596,9 @@ free(void *x)
 	}
 
 	/* Don't allow freeing pointers that aren't on the heap. */
-	if ((uintptr_t)x < __heapbase || (uintptr_t)x >= __heaptop) {
+	if ((uintptr_t)x < __heapbase + MALIGN ||
+	    (uintptr_t)x >= __heaptop - MALIGN ||
+	    (uintptr_t)x % MALIGN != 0) {
 		errx(1, "free: Invalid pointer %p freed (out of range)", x);
 	}
 
@@ -505,31 +607,32 @@ free(void *x)
 	__malloc_dump();
 #endif
 
-	mh = ((struct mheader *)x)-1;
-	if (!M_OK(mh)) {
+	mh = M_HDR(x);
+	size = M_SIZE(mh);
+	if (size < MMINBLOCK || size % MALIGN != 0 ||
+	    (uintptr_t)mh + size > __heaptop - MALIGN ||
+	    !(M_NEXT(mh)->mh_size & M_PREVINUSE)) {
 		errx(1, "free: Invalid pointer %p freed (corrupt header)", x);
 	}
 
-	if (!mh->mh_inuse) {
+	if (!(mh->mh_size & M_INUSE) || (mh->mh_size & M_CACHED)) {
 		errx(1, "free: Invalid pointer %p freed (already free)", x);
 	}
 
-	/* mark it free */
-	mh->mh_inuse = 0;
-
 	/* wipe it */
-	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
-
-	/* Try merging with the block above (but not if we're at the top) */
-	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
-		__malloc_trymerge(mh, mhnext);
+	__malloc_deadbeef(M_DATA(mh), size - MALIGN);
+
+	if (size <= MSMALLMAX) {
+		/* Small: just put it in its bin. */
+		bin = size / MALIGN;
+		mf = (struct mfree *)mh;
+		mh->mh_size |= M_CACHED;
+		mf->mf_next = __smallbins[bin];
+		__smallbins[bin] = mf;
+		__ncached++;
 	}
-
-	/* Try merging with the block below (but not if we're at the bottom) */
-	if (mh != (struct mheader *)__heapbase) {
-		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+	else {
+		__malloc_release(mh);
 	}
 
 #ifdef MALLOCDEBUG
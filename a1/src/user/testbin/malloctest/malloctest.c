@@ -623,6 +623,77 @@ test7(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Test 8
+ *
+ * Benchmark: times a long run of mallocs and frees, in the same
+ * pattern as test 5 but without touching the blocks, and prints the
+ * rate. Use it to compare malloc implementations (or kernels: it
+ * also exercises sbrk and page faults in the heap).
+ */
+
+#define BENCH_OPS 200000
+
+static
+void
+test8(void)
+{
+	static const int sizes[8] = { 13, 17, 69, 176, 433, 871, 1150, 6060 };
+
+	void *ptrs[32];
+	time_t secs0, secs1;
+	unsigned long nsecs0, nsecs1, msecs;
+	int i, n;
+
+	printf("Beginning malloc test 8 (benchmark)\n");
+
+	srandom(0);
+	for (i=0; i<32; i++) {
+		ptrs[i] = NULL;
+	}
+
+	__time(&secs0, &nsecs0);
+	for (i=0; i<BENCH_OPS; i++) {
+		n = random()%32;
+		if (ptrs[n] == NULL) {
+			ptrs[n] = malloc(sizes[random()%8]);
+			if (ptrs[n] == NULL) {
+				printf("malloc failed after %d operations\n", i);
+				printf("FAILED malloc test 8\n");
+				break;
+			}
+		}
+		else {
+			free(ptrs[n]);
+			ptrs[n] = NULL;
+		}
+	}
+	__time(&secs1, &nsecs1);
+
+	for (n=0; n<32; n++) {
+		if (ptrs[n] != NULL) {
+			free(ptrs[n]);
+		}
+	}
+
+	msecs = (secs1 - secs0) * 1000;
+	if (nsecs1 >= nsecs0) {
+		msecs += (nsecs1 - nsecs0) / 1000000;
+	}
+	else {
+		msecs -= (nsecs0 - nsecs1) / 1000000;
+	}
+	printf("%d operations in %lu.%03lu seconds", i,
+	       msecs / 1000, msecs % 1000);
+	if (msecs > 0) {
+		printf(" (%lu per second)",
+		       (unsigned long)i * 1000 / msecs);
+	}
+	printf("\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static struct {
 	int num;
 	const char *desc;
@@ -635,6 +706,7 @@ static struct {
 	{ 5, "Stress test", test5 },
 	{ 6, "Randomized stress test", test6 },
 	{ 7, "Stress test with particular seed", test7 },
+	{ 8, "Benchmark", test8 },
 	{ -1, NULL, NULL }
 };
 
@@ -38,6 +38,7 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -194,6 +195,25 @@ answer(void)
 	return trace(&mats[NMATS-1]);
 }
 
+/*
+ * Print what the VM did for us, if the kernel can tell us.
+ */
+static
+void
+vmreport(int mynum)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0) {
+		return;
+	}
+	say("Process %d: %lu TLB faults; %lu zero, %lu file, %lu text, "
+	    "%lu swap page faults; max RSS %luk\n", mynum,
+	    (unsigned long) ru.ru_tlbflt, (unsigned long) ru.ru_zeroflt,
+	    (unsigned long) ru.ru_fileflt, (unsigned long) ru.ru_textflt,
+	    (unsigned long) ru.ru_swapflt, (unsigned long) ru.ru_maxrss);
+}
+
 static
 void
 go(int mynum)
@@ -212,6 +232,7 @@ go(int mynum)
 		exit(1);
 	}
 	say("Process %d answer %d: passed\n", mynum, r);
+	vmreport(mynum);
 	exit(0);
 }
 